@@ -6,17 +6,30 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <queue>
 #include <set>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 #include "args.h"
 #include "utils.h"
 #include "uniVec.h"
+#include "compact.h"
 #include "dataLoader.h"
+#include "delta.h"
+#include "mappedModel.h"
+#include "server.h"
+#include "synthetic.h"
+#include "trace.h"
 
 using namespace uni_vec;
 
@@ -28,8 +41,31 @@ void printUsage() {
       << std::endl;
 }
 
+void printTestUsage() {
+  std::cerr
+      << "usage: uni_vec test <model> <baskets> [-k <n>] [-candidates <n>] [-last] [-thread <n>]\n\n"
+      << "  Ranks every item of the baskets after the first given the user and the\n"
+      << "  items before it, and prints HitRate@k, NDCG@k and MRR@k.\n\n"
+      << "  <baskets>    held-out baskets, in the format of -userHistInput\n"
+      << "  -k           cutoff of the metrics [10]\n"
+      << "  -candidates  rank against this many uniformly sampled items instead of\n"
+      << "               the whole catalog, 0 for the whole catalog [0]\n"
+      << "  -last        only rank the last item of every basket\n"
+      << "  -thread      number of threads [all cores]\n"
+      << std::endl;
+}
+
 void printQuantizeUsage() {
-  std::cerr << "usage: uni_vec quantize <args>" << std::endl;
+  std::cerr
+      << "usage: uni_vec quantize <model> <output> [-dsub <n>] [-qnorm] [-qout] [-thread <n>]\n\n"
+      << "  Product quantizes the user and item input matrices of <model>, one byte\n"
+      << "  per -dsub columns, and saves the model to <output>. Loading it decodes\n"
+      << "  them, so every command takes it as any other model.\n\n"
+      << "  -dsub     columns per sub-quantizer [2]\n"
+      << "  -qnorm    quantize the norms of the rows apart from their directions\n"
+      << "  -qout     quantize the output matrices too\n"
+      << "  -thread   number of threads [all cores]\n"
+      << std::endl;
 }
 
 void printPredictUsage() {
@@ -72,10 +108,109 @@ void printPrintNgramsUsage() {
 }
 
 void printNNUsage() {
-  std::cout << "usage: fasttext nn <model> <k>\n\n"
-            << "  <model>      model filename\n"
-            << "  <k>          (optional; 10 by default) predict top k labels\n"
-            << std::endl;
+  std::cerr
+      << "usage: uni_vec nn <model> <k> [-input <file>] [-ban <file>] [-cosine] [-keepSelf] [-batch <n>] [-thread <n>] [-index <file> [-efSearch <n>] [-nprobe <n>] [-shortlist <n>] | -int8 <rerank>] [-recall]\n\n"
+      << "  <model>      model filename\n"
+      << "  <k>          number of complements per item\n"
+      << "  -input       anchor item ids, one per line [stdin]\n"
+      << "  -ban         lines of <item> <banned item> ... never returned for <item>\n"
+      << "  -cosine      rank by cosine instead of the raw inner product\n"
+      << "  -keepSelf    allow an item to be its own complement\n"
+      << "  -batch       anchors scanned together [1024]\n"
+      << "  -thread      number of threads [all cores]\n"
+      << "  -index       search an index built by uni_vec index instead of scanning\n"
+      << "  -efSearch    candidates kept by an HNSW index search [64]\n"
+      << "  -nprobe      lists scanned by an IVF-PQ index search [16]\n"
+      << "  -shortlist   items nearest in Hamming distance scored exactly by a hash\n"
+      << "               index search [200]\n"
+      << "  -int8        scan an int8 copy of the items instead, the best max(k, rerank)\n"
+      << "               scored again in fp32 if rerank > 0\n"
+      << "  -recall      also scan in fp32, report recall@k and both timings on stderr\n\n"
+      << "  Prints <item> followed by tab separated <complement>:<score>.\n"
+      << std::endl;
+}
+
+void printRecommendUsage() {
+  std::cerr
+      << "usage: uni_vec recommend <model> <output> <k> [-users] [-input <file>] [-ban <file>] [-keepSelf] [-format <tsv|npy>] [-batch <n>] [-int8 <rerank>] [-thread <n>]\n\n"
+      << "  Exact top k items for every item, or user, of the model by blocked matrix\n"
+      << "  products on all cores.\n\n"
+      << "  <output>     tsv file (if -, stdout) or prefix of <output>.ids.npy and\n"
+      << "               <output>.scores.npy, one row per query, padded with -1 / -inf\n"
+      << "  -users       recommend to users instead of complementing items\n"
+      << "  -input       query ids, one per line [all items or users]\n"
+      << "  -ban         lines of <query> <banned item> ... never returned for <query>\n"
+      << "  -keepSelf    allow an item to be its own complement\n"
+      << "  -format      tsv or npy [tsv]\n"
+      << "  -batch       queries scored between two writes [16384]\n"
+      << "  -int8        scan an int8 copy of the items, about 4x less memory traffic,\n"
+      << "               the best max(k, rerank) scored again in fp32 if rerank > 0\n"
+      << "  -thread      number of threads [all cores]\n"
+      << std::endl;
+}
+
+void printRankUsage() {
+  std::cerr
+      << "usage: uni_vec rank <model> [-input <file>] [-k <n>] [-combineMethod <method>] [-batch <n>] [-thread <n>]\n\n"
+      << "  Scores candidates for a user and their recent items with the formula the\n"
+      << "  model was trained with. Requests are lines of\n"
+      << "  <user> \\t <item>,...,<item> \\t <candidate>,...,<candidate>\n"
+      << "  with -1 for an unknown user and an empty field for no recent items.\n\n"
+      << "  -input          requests [stdin]\n"
+      << "  -k              best candidates printed per request, 0 for all [0]\n"
+      << "  -combineMethod  concat, mean or meanSum, for legacy format models [from the model]\n"
+      << "  -batch          requests scored together [4096]\n"
+      << "  -thread         number of threads [all cores]\n\n"
+      << "  Prints <user> followed by tab separated <candidate>:<score>, best first.\n"
+      << std::endl;
+}
+
+void printIndexUsage() {
+  std::cerr
+      << "usage: uni_vec index <model> <index> [-type <hnsw|ivfpq|hash>] [-M <n>] [-efConstruction <n>] [-nlist <n>] [-dsub <n>] [-bits <n>] [-seed <n>] [-thread <n>]\n\n"
+      << "  Builds an HNSW graph, an IVF-PQ index or binary hash codes over the item\n"
+      << "  part of the item output vectors for uni_vec nn -index.\n\n"
+      << "  -type            hnsw, ivfpq or hash [hnsw]\n"
+      << "  -M               hnsw: links per item, twice as many on the bottom layer [16]\n"
+      << "  -efConstruction  hnsw: candidates kept while linking an item [200]\n"
+      << "  -nlist           ivfpq: inverted lists, 0 for 4 sqrt(items) [0]\n"
+      << "  -dsub            ivfpq: columns per sub-quantizer, one byte each [2]\n"
+      << "  -bits            hash: bits per item, a multiple of 64 [512]\n"
+      << "  -seed            seed of the layer assignment, k-means or projections [0]\n"
+      << "  -thread          number of threads [all cores]\n"
+      << std::endl;
+}
+
+void printServeUsage() {
+  std::cerr
+      << "usage: uni_vec serve <model> (-socket <path> | -port <n>) [-index <file>] [-efSearch <n>] [-nprobe <n>] [-shortlist <n>] [-int8 <rerank>] [-maxBatch <n>] [-batchWait <us>] [-maxK <n>] [-cacheSize <n>] [-foldInEpoch <n>] [-thread <n>]\n\n"
+      << "  Answers queries, one per line, until interrupted:\n"
+      << "    item <id> <k>                complements of an item\n"
+      << "    user <id> <k>                items for a user\n"
+      << "    basket <user> <k> <item>...  items completing a basket, user -1 if unknown\n"
+      << "    foldin <user> <k> <basket>...\n"
+      << "                                 items for a user refitted to recent baskets,\n"
+      << "                                 each item,item,...; user -1 if unknown\n"
+      << "    stats                        counters, cache hit rate and latency percentiles\n"
+      << "    reload [<model> [<index>]]   swaps in a new model, by default reloads the\n"
+      << "                                 files served; SIGHUP reloads them too\n"
+      << "    quit                         closes the connection\n"
+      << "  with ok <id>:<score> ..., best first, or error <message>.\n\n"
+      << "  -socket     Unix socket to listen on\n"
+      << "  -port       port to listen on at 127.0.0.1\n"
+      << "  -index      answer item queries with an index built by uni_vec index\n"
+      << "  -efSearch   candidates kept by an HNSW index search [64]\n"
+      << "  -nprobe     lists scanned by an IVF-PQ index search [16]\n"
+      << "  -shortlist  items scored exactly after a hash index scan [200]\n"
+      << "  -int8       answer item queries without an index and user queries from int8\n"
+      << "              copies, the best max(k, rerank) scored again in fp32 [fp32]\n"
+      << "  -maxBatch   queries scored together [64]\n"
+      << "  -batchWait  microseconds a query waits for others to join its batch [500]\n"
+      << "  -maxK       largest k accepted [1000]\n"
+      << "  -cacheSize  item and user results cached, 0 for none [100000]\n"
+      << "  -foldInEpoch passes over the baskets of a foldin request [5]\n"
+      << "  -thread     workers scoring batches [all cores]\n"
+      << std::endl;
 }
 
 void printAnalogiesUsage() {
@@ -86,9 +221,122 @@ void printAnalogiesUsage() {
 }
 
 void printDumpUsage() {
-  std::cout << "usage: fasttext dump <model> <option>\n\n"
+  std::cout << "usage: fasttext dump <model> <option> [<thread>]\n\n"
             << "  <model>      model filename\n"
-            << "  <option>     option from args,dict,input,output" << std::endl;
+            << "  <option>     option from args,user_input,item_input,word_output,item_output\n"
+            << "  <thread>     (optional; all cores by default) formatting threads" << std::endl;
+}
+
+void printExportUsage() {
+  std::cerr
+      << "usage: uni_vec export <model> <prefix> [-format npy|txt|fp16|int8[,...]] [-shards <n>] [-thread <n>]\n\n"
+      << "  <model>      model filename\n"
+      << "  <prefix>     output prefix, one <prefix>_<matrix>.vec file per matrix\n"
+      << "  -format      comma separated list of npy, txt, fp16, int8 [npy]\n"
+      << "  -shards      split every matrix into this many row shards [1]\n"
+      << "  -thread      number of threads [all cores]\n"
+      << std::endl;
+}
+
+void printInferColdUsage() {
+  std::cerr
+      << "usage: uni_vec infer-cold <model> <input> <output> [-users] [-method <ns|ls>] [-wordCount <file>] [-epoch <n>] [-lr <x>] [-neg <n>] [-logit <x>] [-lambda <x>] [-maxWords <n>] [-thread <n>]\n\n"
+      << "  Fits item vectors for items unseen in training from their context words,\n"
+      << "  against the frozen word output vectors of the model, or user vectors for\n"
+      << "  new users against the user context output vectors.\n\n"
+      << "  <input>      lines of <id> <word> <word> ..., separated by tabs, spaces or\n"
+      << "               commas; ids are kept as text\n"
+      << "  <output>     prefix of <output>.npy, one row per item, and <output>.ids.txt,\n"
+      << "               the id of every row\n"
+      << "  -users       fit users instead of items\n"
+      << "  -method      ns: negative sampling as in training, ls: closed-form least\n"
+      << "               squares to target logits, users only [ns]\n"
+      << "  -wordCount   context file of training, weights the negatives [uniform]\n"
+      << "  -epoch       ns: passes over the words of an item [200]\n"
+      << "  -lr          ns: learning rate, decaying to 0 [0.01]\n"
+      << "  -neg         negatives sampled, or for ls weighed, per word [50, ls 5]\n"
+      << "  -logit       ls: target logit of words, negated for negatives [8]\n"
+      << "  -lambda      ls: ridge penalty [1]\n"
+      << "  -maxWords    items with more words are skipped, 0 for no limit [40]\n"
+      << "  -thread      number of threads [all cores]\n"
+      << std::endl;
+}
+
+void printFoldInUsage() {
+  std::cerr
+      << "usage: uni_vec fold-in <model> <baskets> <output> [-itemCount <file>] [-epoch <n>] [-lr <x>] [-saveModel <file>] [-thread <n>]\n\n"
+      << "  Refits the vectors of the users of <baskets> to their recent baskets with\n"
+      << "  the item vectors of the model frozen, starting from their current vectors\n"
+      << "  or from zero for new users.\n\n"
+      << "  <baskets>    recent baskets, in the format of -userHistInput\n"
+      << "  <output>     prefix of <output>.npy, one row per user, and <output>.ids.txt,\n"
+      << "               the user of every row\n"
+      << "  -itemCount   purchase history of training, weights the negatives [<baskets>]\n"
+      << "  -epoch       passes over the baskets of a user [5]\n"
+      << "  -lr          learning rate, decaying to 0 [that of training]\n"
+      << "  -saveModel   also save the model with the new user vectors\n"
+      << "  -thread      number of threads [all cores]\n"
+      << std::endl;
+}
+
+void printDequantizeUsage() {
+  std::cerr
+      << "usage: uni_vec dequantize <base> <format> [<thread>]\n\n"
+      << "  <base>       exported matrix without the format suffix, e.g. out_itemInput.vec\n"
+      << "  <format>     fp16 or int8\n"
+      << "  <thread>     (optional; all cores by default) formatting threads\n"
+      << std::endl;
+}
+
+void printMergeUsage() {
+  std::cerr
+      << "usage: uni_vec merge <base> <output> <delta> [<delta> ...]\n\n"
+      << "  <base>       .npy snapshot, e.g. <output>.base_itemInput.vec.npy\n"
+      << "  <output>     .npy file to write\n"
+      << "  <delta>      .vec.delta files of the same matrix, oldest first\n"
+      << std::endl;
+}
+
+void printSynthUsage() {
+  SyntheticConfig c;
+  std::cerr
+      << "usage: uni_vec synth -output <prefix> <args>\n\n"
+      << "  -output          prefix of the generated files\n"
+      << "  -items           number of items [" << c.items << "]\n"
+      << "  -users           number of users [" << c.users << "]\n"
+      << "  -words           item context vocabulary size [" << c.words << "]\n"
+      << "  -userWords       user context vocabulary size [" << c.userWords << "]\n"
+      << "  -baskets         trx lines [" << c.baskets << "]\n"
+      << "  -views           view lines, 0 to skip [" << c.views << "]\n"
+      << "  -subs            sub lines, 0 to skip [" << c.subs << "]\n"
+      << "  -searches        search lines, 0 to skip [" << c.searches << "]\n"
+      << "  -zipf            Zipf exponent of item and word popularity [" << c.zipf << "]\n"
+      << "  -basketMu        log-normal basket length mu [" << c.basketMu << "]\n"
+      << "  -basketSigma     log-normal basket length sigma [" << c.basketSigma << "]\n"
+      << "  -maxBasket       maximum basket length [" << c.maxBasket << "]\n"
+      << "  -wordsPerItem    mean context tokens per item [" << c.wordsPerItem << "]\n"
+      << "  -wordsPerUser    mean context tokens per user [" << c.wordsPerUser << "]\n"
+      << "  -wordsPerSearch  mean words per search [" << c.wordsPerSearch << "]\n"
+      << "  -seed            random seed [" << c.seed << "]\n"
+      << "  -thread          number of threads [" << c.thread << "]\n"
+      << std::endl;
+}
+
+void printBenchmarkUsage() {
+  std::cerr
+      << "usage: uni_vec benchmark <train args> [-benchSeconds <s>] [-benchThreads <n>]\n\n"
+      << "  Loads the training data once, then trains for <s> seconds [10] with\n"
+      << "  1, 2, 4, ... up to <n> threads [all cores] and reports load MB/s,\n"
+      << "  examples/sec and the scaling efficiency relative to one thread.\n"
+      << std::endl;
+}
+
+void printRankingMetrics(const RankingMetrics& metrics, int32_t k) {
+  std::cout << "N\t" << metrics.count << std::endl;
+  std::cout << std::setprecision(4);
+  std::cout << "HitRate@" << k << "\t" << metrics.hitRate << std::endl;
+  std::cout << "NDCG@" << k << "\t" << metrics.ndcg << std::endl;
+  std::cout << "MRR@" << k << "\t" << metrics.mrr << std::endl;
 }
 
 void train(const std::vector<std::string> args) {
@@ -104,17 +352,269 @@ void train(const std::vector<std::string> args) {
   }
   ofs.close();
 
+  if (!a.trace.empty()) {
+    Trace::start(a.trace);
+  }
+
   std::shared_ptr<Args> argsPtr = std::make_shared<Args>(a);
-  std::shared_ptr<DataLoader> dataLoader = std::make_shared<DataLoader>(argsPtr.get());
+  std::shared_ptr<DataLoader> dataLoader;
+  {
+    TraceScope trace("DataLoader", "load");
+    dataLoader = std::make_shared<DataLoader>(argsPtr.get());
+  }
   std::cout << "Data loaded!" << std::endl;
-  uniVec.init(argsPtr, dataLoader);
+  {
+    TraceScope trace("init", "train");
+    uniVec.init(argsPtr, dataLoader);
+  }
   std::cout << "Model intialized!" << std::endl;
 
-  uniVec.train(a);
+  {
+    TraceScope trace("train", "train");
+    uniVec.train(a);
+  }
   
   // uniVec.saveModel(outputFileName);
   std::cout <<  uniVec.getUserInputMatrix()->cols() << std::endl;
   uniVec.saveVectors(a.output + ".vec");
+  if (a.saveModel) {
+    uniVec.saveMappedModel(outputFileName);
+  }
+  if (!dataLoader->heldOutUserHist.empty()) {
+    TraceScope trace("test", "train");
+    printRankingMetrics(
+        uniVec.test(dataLoader->heldOutUserHist, true, a.testK, 0, a.thread),
+        a.testK);
+  }
+  Trace::finish();
+}
+
+void test(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printTestUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t k = 10;
+  int32_t candidates = 0;
+  bool lastOnly = false;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 4; ai < args.size(); ai += 2) {
+    if (args[ai] == "-last") {
+      lastOnly = true;
+      ai--;
+      continue;
+    }
+    if (ai + 1 >= args.size()) {
+      printTestUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-k") {
+      k = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-candidates") {
+      candidates = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printTestUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  auto baskets = DataLoader::loadOrderedBasket(args[3]);
+  auto start = std::chrono::steady_clock::now();
+  RankingMetrics metrics =
+      uniVec.test(baskets, lastOnly, k, candidates, thread);
+  printRankingMetrics(metrics, k);
+  std::cerr << "Evaluated in "
+            << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "s" << std::endl;
+}
+
+void synth(const std::vector<std::string>& args) {
+  SyntheticConfig c;
+  c.thread = std::max(1u, std::thread::hardware_concurrency());
+  std::string prefix;
+  for (size_t ai = 2; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printSynthUsage();
+      exit(EXIT_FAILURE);
+    }
+    const std::string& name = args[ai];
+    const std::string& value = args[ai + 1];
+    if (name == "-output") {
+      prefix = value;
+    } else if (name == "-items") {
+      c.items = std::stoll(value);
+    } else if (name == "-users") {
+      c.users = std::stoll(value);
+    } else if (name == "-words") {
+      c.words = std::stoll(value);
+    } else if (name == "-userWords") {
+      c.userWords = std::stoll(value);
+    } else if (name == "-baskets") {
+      c.baskets = std::stoll(value);
+    } else if (name == "-views") {
+      c.views = std::stoll(value);
+    } else if (name == "-subs") {
+      c.subs = std::stoll(value);
+    } else if (name == "-searches") {
+      c.searches = std::stoll(value);
+    } else if (name == "-zipf") {
+      c.zipf = std::stod(value);
+    } else if (name == "-basketMu") {
+      c.basketMu = std::stod(value);
+    } else if (name == "-basketSigma") {
+      c.basketSigma = std::stod(value);
+    } else if (name == "-maxBasket") {
+      c.maxBasket = std::stoi(value);
+    } else if (name == "-wordsPerItem") {
+      c.wordsPerItem = std::stod(value);
+    } else if (name == "-wordsPerUser") {
+      c.wordsPerUser = std::stod(value);
+    } else if (name == "-wordsPerSearch") {
+      c.wordsPerSearch = std::stod(value);
+    } else if (name == "-seed") {
+      c.seed = std::stoi(value);
+    } else if (name == "-thread") {
+      c.thread = std::stoi(value);
+    } else {
+      std::cerr << "Unknown argument: " << name << std::endl;
+      printSynthUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (prefix.empty()) {
+    printSynthUsage();
+    exit(EXIT_FAILURE);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::string> paths = SyntheticData(c).write(prefix);
+  double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  int64_t bytes = 0;
+  for (const auto& path : paths) {
+    std::ifstream ifs(path, std::ifstream::binary);
+    bytes += utils::size(ifs);
+    std::cout << path << std::endl;
+  }
+  std::cout << "Wrote " << bytes / (1 << 20) << " MB in " << seconds << "s"
+            << std::endl;
+}
+
+void benchmark(const std::vector<std::string>& args) {
+  double seconds = 10;
+  int32_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::string> trainArgs;
+  bool hasOutput = false;
+  for (size_t ai = 0; ai < args.size(); ai++) {
+    if ((args[ai] == "-benchSeconds" || args[ai] == "-benchThreads") &&
+        ai + 1 >= args.size()) {
+      printBenchmarkUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-benchSeconds") {
+      seconds = std::stod(args[++ai]);
+    } else if (args[ai] == "-benchThreads") {
+      maxThreads = std::stoi(args[++ai]);
+    } else {
+      hasOutput = hasOutput || args[ai] == "-output";
+      trainArgs.push_back(args[ai]);
+    }
+  }
+  // nothing is saved, but Args requires an output path
+  if (!hasOutput) {
+    trainArgs.push_back("-output");
+    trainArgs.push_back("benchmark");
+  }
+  Args a = Args();
+  a.parseArgs(trainArgs);
+  if (seconds <= 0 || maxThreads < 1) {
+    printBenchmarkUsage();
+    exit(EXIT_FAILURE);
+  }
+
+  int64_t bytes = 0;
+  for (const std::string* path :
+       {&a.itemWordInput, &a.userWordInput, &a.userHistInput,
+        &a.userHistInputView, &a.userHistInputSub, &a.userHistInputSearch}) {
+    if (!path->empty()) {
+      std::ifstream ifs(*path, std::ifstream::binary);
+      bytes += utils::size(ifs);
+    }
+  }
+  auto loadStart = std::chrono::steady_clock::now();
+  std::shared_ptr<DataLoader> dataLoader = std::make_shared<DataLoader>(&a);
+  double loadSeconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+                           std::chrono::steady_clock::now() - loadStart)
+                           .count();
+
+  std::vector<int32_t> threadCounts;
+  for (int32_t t = 1; t < maxThreads; t *= 2) {
+    threadCounts.push_back(t);
+  }
+  threadCounts.push_back(maxThreads);
+
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2);
+  report << "load\tbytes " << bytes << "\tseconds " << loadSeconds
+         << "\tMB/s " << bytes / double(1 << 20) / loadSeconds << std::endl;
+  report << "threads\tseconds\tbaskets/s\texamples/s\tefficiency" << std::endl;
+  double baseline = 0;
+  for (int32_t t : threadCounts) {
+    std::shared_ptr<Args> argsPtr = std::make_shared<Args>(a);
+    argsPtr->thread = t;
+    argsPtr->timeLimit = seconds;
+    // enough epochs that the time limit ends every run
+    argsPtr->epoch = 1000000;
+    argsPtr->verbose = 0;
+    UniVec uniVec;
+    uniVec.init(argsPtr, dataLoader);
+    uniVec.train(*argsPtr);
+
+    double trainSeconds = uniVec.getTrainSeconds();
+    double examplesPerSec = uniVec.getExampleCount() / trainSeconds;
+    if (t == 1) {
+      baseline = examplesPerSec;
+    }
+    report << t << "\t" << trainSeconds << "\t"
+           << uniVec.getTokenCount() / trainSeconds << "\t" << examplesPerSec
+           << "\t" << examplesPerSec / (t * baseline) << std::endl;
+  }
+  std::cout << std::endl << report.str();
+}
+
+void printVerifyUsage() {
+  std::cerr << "usage: uni_vec verify <model>\n\n"
+            << "  <model>      memory-mappable model filename\n"
+            << std::endl;
+}
+
+void verify(const std::vector<std::string>& args) {
+  if (args.size() < 3) {
+    printVerifyUsage();
+    exit(EXIT_FAILURE);
+  }
+  MappedModel model(args[2]);
+  for (uint32_t i = 0; i < model.header().nsections; i++) {
+    const MappedModel::Section& s = model.section(i);
+    std::cout << s.name << "\t" << s.rows << " x " << s.cols << "\t"
+              << s.bytes << " bytes" << std::endl;
+  }
+  std::vector<std::string> failed = model.verify();
+  for (const auto& name : failed) {
+    std::cerr << "Checksum mismatch in section " << name << std::endl;
+  }
+  if (!failed.empty()) {
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "OK" << std::endl;
 }
 
 void dump(const std::vector<std::string>& args) {
@@ -125,23 +625,1022 @@ void dump(const std::vector<std::string>& args) {
 
   std::string modelPath = args[2];
   std::string option = args[3];
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  if (args.size() > 4) {
+    thread = std::stoi(args[4]);
+  }
 
   UniVec uniVec;
   uniVec.loadModel(modelPath);
+  std::shared_ptr<const Matrix> mat;
   if (option == "args") {
     uniVec.getArgs().dump(std::cout);
+    return;
   } else if (option == "user_input") {
-    uniVec.getUserInputMatrix()->dump(std::cout);
+    mat = uniVec.getUserInputMatrix();
   } else if (option == "item_input") {
-    uniVec.getItemInputMatrix()->dump(std::cout);
+    mat = uniVec.getItemInputMatrix();
   } else if (option == "word_output") {
-    uniVec.getWordOutputMatrix()->dump(std::cout);
+    mat = uniVec.getWordOutputMatrix();
   } else if (option == "item_output") {
-    uniVec.getItemOutputMatrix()->dump(std::cout);
+    mat = uniVec.getItemOutputMatrix();
   } else {
     printDumpUsage();
     exit(EXIT_FAILURE);
   }
+  mat->dump(std::cout, 0, mat->rows(), thread);
+}
+
+void exportVectors(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printExportUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::vector<export_format> formats = {export_format::npy};
+  int32_t shards = 1;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 4; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printExportUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-format") {
+      formats = Exporter::formatsFromString(args[ai + 1]);
+    } else if (args[ai] == "-shards") {
+      shards = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printExportUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  uniVec.exportVectors(args[3], formats, shards, thread);
+}
+
+// Reads lines of <id> <word> ..., skipping lines with a null field or more
+// than maxWords words, 0 for no limit.
+void readColdContext(
+    const std::string& path,
+    int32_t maxWords,
+    std::vector<std::string>& ids,
+    std::vector<std::vector<int32_t>>& words) {
+  std::ifstream ifs(path);
+  if (!ifs.is_open()) {
+    throw std::invalid_argument(path + " cannot be opened for loading!");
+  }
+  std::string line;
+  int64_t skipped = 0;
+  while (std::getline(ifs, line)) {
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::replace(line.begin(), line.end(), '"', ' ');
+    std::istringstream iss(line);
+    std::string id;
+    std::string token;
+    std::vector<int32_t> list;
+    bool null = !(iss >> id) || id == "\\N" || id == "NULL";
+    while (!null && iss >> token) {
+      if (token == "\\N" || token == "NULL") {
+        null = true;
+      } else {
+        list.push_back(std::stoi(token));
+      }
+    }
+    if (null || list.empty() ||
+        (maxWords > 0 && int32_t(list.size()) > maxWords)) {
+      skipped++;
+      continue;
+    }
+    ids.push_back(id);
+    words.push_back(std::move(list));
+  }
+  if (skipped > 0) {
+    std::cerr << "Skipped " << skipped << " lines without words or with more than "
+              << maxWords << std::endl;
+  }
+}
+
+// Writes the rows of vectors to <output>.npy and the id of every row, one
+// per line, to <output>.ids.txt.
+template <typename Id>
+void writeEmbeddings(
+    const std::string& output,
+    const std::vector<Id>& ids,
+    const Matrix& vectors) {
+  std::ofstream npy(output + ".npy", std::ofstream::binary);
+  std::ofstream idMap(output + ".ids.txt");
+  if (!npy || !idMap) {
+    throw std::invalid_argument(output + " cannot be opened for saving!");
+  }
+  const std::string header =
+      compact::npyHeader("<f4", vectors.rows(), vectors.cols());
+  npy.write(header.data(), header.size());
+  npy.write(
+      (const char*)vectors.data(),
+      vectors.rows() * vectors.cols() * sizeof(real));
+  for (const auto& id : ids) {
+    idMap << id << '\n';
+  }
+  npy.flush();
+  idMap.flush();
+  if (!npy || !idMap) {
+    throw std::runtime_error(output + " could not be written completely!");
+  }
+}
+
+void inferCold(const std::vector<std::string>& args) {
+  if (args.size() < 5) {
+    printInferColdUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::string wordCountPath;
+  bool users = false;
+  std::string method = "ns";
+  int32_t epoch = 200;
+  real lr = 0.01;
+  int32_t neg = -1;
+  real logit = 8.0;
+  real lambda = 1.0;
+  int32_t maxWords = 40;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 5; ai < args.size(); ai += 2) {
+    if (args[ai] == "-users") {
+      users = true;
+      ai--;
+      continue;
+    }
+    if (ai + 1 >= args.size()) {
+      printInferColdUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-method") {
+      method = args[ai + 1];
+    } else if (args[ai] == "-logit") {
+      logit = std::stof(args[ai + 1]);
+    } else if (args[ai] == "-lambda") {
+      lambda = std::stof(args[ai + 1]);
+    } else if (args[ai] == "-wordCount") {
+      wordCountPath = args[ai + 1];
+    } else if (args[ai] == "-epoch") {
+      epoch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-lr") {
+      lr = std::stof(args[ai + 1]);
+    } else if (args[ai] == "-neg") {
+      neg = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-maxWords") {
+      maxWords = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printInferColdUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (method != "ns" && !(method == "ls" && users)) {
+    std::cerr << "Unknown method: " << method << std::endl;
+    printInferColdUsage();
+    exit(EXIT_FAILURE);
+  }
+  if (neg < 0) {
+    // squared errors penalize far negatives as much as near ones, so least
+    // squares weighs fewer of them
+    neg = method == "ns" ? 50 : 5;
+  }
+
+  std::vector<int64_t> wordCounts;
+  if (!wordCountPath.empty()) {
+    wordCounts = DataLoader::computeWordCount(
+        DataLoader::loadContextFromFile(wordCountPath, false));
+  }
+  std::vector<std::string> ids;
+  std::vector<std::vector<int32_t>> words;
+  readColdContext(args[3], maxWords, ids, words);
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  auto start = std::chrono::steady_clock::now();
+  std::shared_ptr<const Matrix> vectors;
+  if (!users) {
+    vectors = uniVec.inferColdItems(words, wordCounts, epoch, lr, neg, thread);
+  } else if (method == "ns") {
+    vectors = uniVec.inferColdUsers(words, wordCounts, epoch, lr, neg, thread);
+  } else {
+    vectors =
+        uniVec.solveColdUsers(words, wordCounts, neg, logit, lambda, thread);
+  }
+  std::cerr << "Inferred " << ids.size() << (users ? " users" : " items")
+            << " in "
+            << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "s" << std::endl;
+
+  writeEmbeddings(args[4], ids, *vectors);
+}
+
+void foldIn(const std::vector<std::string>& args) {
+  if (args.size() < 5) {
+    printFoldInUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::string itemCountPath;
+  std::string modelPath;
+  int32_t epoch = 5;
+  real lr = -1.0;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 5; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printFoldInUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-itemCount") {
+      itemCountPath = args[ai + 1];
+    } else if (args[ai] == "-epoch") {
+      epoch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-lr") {
+      lr = std::stof(args[ai + 1]);
+    } else if (args[ai] == "-saveModel") {
+      modelPath = args[ai + 1];
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printFoldInUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  if (lr <= 0.0) {
+    lr = uniVec.getArgs().lr;
+  }
+
+  // the baskets of every user, in the order users first appear
+  std::vector<int64_t> users;
+  std::vector<std::vector<std::vector<int32_t>>> baskets;
+  std::unordered_map<int64_t, size_t> userRow;
+  const int64_t nitems = uniVec.getItemInputMatrix()->rows();
+  std::vector<int64_t> counts(nitems, 1);
+  for (const auto& line : DataLoader::loadOrderedBasket(args[3])) {
+    auto it = userRow.find(line[0]);
+    if (it == userRow.end()) {
+      it = userRow.emplace(line[0], users.size()).first;
+      users.push_back(line[0]);
+      baskets.emplace_back();
+    }
+    baskets[it->second].emplace_back(line.begin() + 1, line.end());
+    if (itemCountPath.empty()) {
+      for (size_t i = 1; i < line.size(); i++) {
+        counts.at(line[i])++;
+      }
+    }
+  }
+  if (!itemCountPath.empty()) {
+    for (const auto& line : DataLoader::loadOrderedBasket(itemCountPath)) {
+      for (size_t i = 1; i < line.size(); i++) {
+        counts.at(line[i])++;
+      }
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto negatives = std::make_shared<const NegativeTable>(counts, 0);
+  std::shared_ptr<const Matrix> vectors =
+      uniVec.foldInUsers(users, baskets, negatives, epoch, lr, thread);
+  std::cerr << "Folded in " << users.size() << " users in "
+            << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "s" << std::endl;
+
+  writeEmbeddings(args[4], users, *vectors);
+  if (!modelPath.empty()) {
+    uniVec.setUserRows(users, *vectors);
+    uniVec.saveMappedModel(modelPath);
+  }
+}
+
+void quantize(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printQuantizeUsage();
+    exit(EXIT_FAILURE);
+  }
+  Args qargs;
+  qargs.thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 4; ai < args.size(); ai += 2) {
+    if (args[ai] == "-qnorm") {
+      qargs.qnorm = true;
+      ai--;
+      continue;
+    }
+    if (args[ai] == "-qout") {
+      qargs.qout = true;
+      ai--;
+      continue;
+    }
+    if (ai + 1 >= args.size()) {
+      printQuantizeUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-dsub") {
+      qargs.dsub = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      qargs.thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printQuantizeUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  auto start = std::chrono::steady_clock::now();
+  uniVec.quantize(qargs);
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  uniVec.saveMappedModel(args[3]);
+
+  std::ifstream before(args[2], std::ifstream::binary);
+  std::ifstream after(args[3], std::ifstream::binary);
+  const int64_t beforeBytes = utils::size(before);
+  const int64_t afterBytes = utils::size(after);
+  std::cerr << "Quantized in " << seconds << "s, " << beforeBytes << " -> "
+            << afterBytes << " bytes (" << std::setprecision(3)
+            << double(beforeBytes) / afterBytes << "x)" << std::endl;
+}
+
+void dequantize(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printDequantizeUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  if (args.size() > 4) {
+    thread = std::stoi(args[4]);
+  }
+  CompactMatrix compact;
+  compact.load(args[2], Exporter::formatFromString(args[3]));
+  std::shared_ptr<const Matrix> mat = compact.toMatrix();
+  mat->dump(std::cout, 0, mat->rows(), thread);
+}
+
+void merge(const std::vector<std::string>& args) {
+  if (args.size() < 5) {
+    printMergeUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> deltas(args.begin() + 4, args.end());
+  int64_t replaced = MatrixDelta::merge(args[2], deltas, args[3]);
+  std::cerr << "Applied " << deltas.size() << " deltas, " << replaced
+            << " rows" << std::endl;
+}
+
+// Lines of <id> <banned item> ..., nothing without a file.
+std::unordered_map<int64_t, std::vector<int64_t>> readBans(
+    const std::string& path) {
+  std::unordered_map<int64_t, std::vector<int64_t>> banned;
+  if (path.empty()) {
+    return banned;
+  }
+  std::ifstream ifs(path);
+  if (!ifs.is_open()) {
+    throw std::invalid_argument(path + " cannot be opened for loading!");
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    int64_t id, ban;
+    if (!(iss >> id)) {
+      continue;
+    }
+    while (iss >> ban) {
+      banned[id].push_back(ban);
+    }
+  }
+  return banned;
+}
+
+void nn(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printNNUsage();
+    exit(EXIT_FAILURE);
+  }
+  const int32_t k = std::stoi(args[3]);
+  std::string input = "-";
+  std::string banPath;
+  std::string indexPath;
+  int32_t efSearch = 64;
+  int32_t nprobe = 16;
+  int32_t shortlist = 200;
+  int32_t int8Rerank = -1;
+  bool cosine = false;
+  bool keepSelf = false;
+  bool recall = false;
+  int64_t batch = 1024;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 4; ai < args.size(); ai += 2) {
+    if (args[ai] == "-cosine") {
+      cosine = true;
+      ai--;
+      continue;
+    } else if (args[ai] == "-keepSelf") {
+      keepSelf = true;
+      ai--;
+      continue;
+    } else if (args[ai] == "-recall") {
+      recall = true;
+      ai--;
+      continue;
+    }
+    if (ai + 1 >= args.size()) {
+      printNNUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-input") {
+      input = args[ai + 1];
+    } else if (args[ai] == "-ban") {
+      banPath = args[ai + 1];
+    } else if (args[ai] == "-batch") {
+      batch = std::max(1, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-index") {
+      indexPath = args[ai + 1];
+    } else if (args[ai] == "-efSearch") {
+      efSearch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-nprobe") {
+      nprobe = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-shortlist") {
+      shortlist = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-int8") {
+      int8Rerank = std::max(0, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printNNUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const auto banned = readBans(banPath);
+
+  const bool approx = !indexPath.empty() || int8Rerank >= 0;
+  if (!indexPath.empty() && int8Rerank >= 0) {
+    std::cerr << "-index and -int8 are exclusive." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (approx && cosine) {
+    std::cerr << "The index ranks by inner product, -cosine needs a scan." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (recall && !approx) {
+    std::cerr << "-recall compares -index or -int8 against a scan." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  if (!indexPath.empty()) {
+    uniVec.loadIndex(indexPath);
+  } else if (int8Rerank >= 0) {
+    uniVec.buildInt8(int8Rerank, thread);
+  }
+
+  std::ifstream ifs;
+  if (input != "-") {
+    ifs.open(input);
+    if (!ifs.is_open()) {
+      throw std::invalid_argument(input + " cannot be opened for loading!");
+    }
+  }
+  std::istream& in = (input == "-") ? std::cin : ifs;
+  std::vector<int64_t> items;
+  std::vector<std::vector<int64_t>> bans;
+  std::string out;
+  int64_t found = 0;
+  int64_t expected = 0;
+  double indexSeconds = 0;
+  double scanSeconds = 0;
+  auto flush = [&]() {
+    if (items.empty()) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<ScoredId>> results;
+    if (!approx) {
+      results = uniVec.getNN(items, k, cosine, bans, thread);
+    } else {
+      results = uniVec.getApproxNN(
+          items, k, efSearch, nprobe, shortlist, bans, thread);
+    }
+    auto end = std::chrono::steady_clock::now();
+    indexSeconds += std::chrono::duration<double>(end - start).count();
+    if (recall) {
+      auto exact = uniVec.getNN(items, k, false, bans, thread);
+      scanSeconds += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - end)
+                         .count();
+      for (size_t q = 0; q < items.size(); q++) {
+        std::set<int64_t> truth;
+        for (const auto& p : exact[q]) {
+          truth.insert(p.second);
+        }
+        for (const auto& p : results[q]) {
+          found += truth.count(p.second);
+        }
+        expected += truth.size();
+      }
+    }
+    out.clear();
+    for (size_t q = 0; q < items.size(); q++) {
+      out += std::to_string(items[q]);
+      for (const auto& p : results[q]) {
+        out += '\t';
+        out += std::to_string(p.second);
+        out += ':';
+        utils::appendReal(out, p.first);
+      }
+      out += '\n';
+    }
+    std::cout << out;
+    items.clear();
+    bans.clear();
+  };
+  int64_t item;
+  while (in >> item) {
+    std::vector<int64_t> ban;
+    auto it = banned.find(item);
+    if (it != banned.end()) {
+      ban = it->second;
+    }
+    if (!keepSelf) {
+      ban.push_back(item);
+    }
+    std::sort(ban.begin(), ban.end());
+    items.push_back(item);
+    bans.push_back(ban);
+    if (int64_t(items.size()) == batch) {
+      flush();
+    }
+  }
+  flush();
+  std::cout.flush();
+  if (recall) {
+    std::cerr << "recall@" << k << ": "
+              << (expected ? double(found) / expected : 1.0)
+              << "\tindex: " << indexSeconds << "s\tscan: " << scanSeconds
+              << "s" << std::endl;
+  }
+}
+
+void recommend(const std::vector<std::string>& args) {
+  if (args.size() < 5) {
+    printRecommendUsage();
+    exit(EXIT_FAILURE);
+  }
+  const std::string output = args[3];
+  const int32_t k = std::stoi(args[4]);
+  std::string input;
+  std::string banPath;
+  std::string format = "tsv";
+  bool users = false;
+  bool keepSelf = false;
+  int64_t batch = 16384;
+  int32_t int8Rerank = -1;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 5; ai < args.size(); ai += 2) {
+    if (args[ai] == "-users") {
+      users = true;
+      ai--;
+      continue;
+    } else if (args[ai] == "-keepSelf") {
+      keepSelf = true;
+      ai--;
+      continue;
+    }
+    if (ai + 1 >= args.size()) {
+      printRecommendUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-input") {
+      input = args[ai + 1];
+    } else if (args[ai] == "-ban") {
+      banPath = args[ai + 1];
+    } else if (args[ai] == "-format") {
+      format = args[ai + 1];
+    } else if (args[ai] == "-batch") {
+      batch = std::max(1, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-int8") {
+      int8Rerank = std::max(0, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printRecommendUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (format != "tsv" && format != "npy") {
+    std::cerr << "Unknown format: " << format << std::endl;
+    printRecommendUsage();
+    exit(EXIT_FAILURE);
+  }
+  const auto banned = readBans(banPath);
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  if (int8Rerank >= 0) {
+    uniVec.buildInt8(int8Rerank, thread);
+  }
+  std::vector<int64_t> queries;
+  if (input.empty()) {
+    const int64_t n = users ? uniVec.getUserInputMatrix()->rows()
+                            : uniVec.getItemInputMatrix()->rows();
+    queries.resize(n);
+    for (int64_t i = 0; i < n; i++) {
+      queries[i] = i;
+    }
+  } else {
+    std::ifstream ifs(input);
+    if (!ifs.is_open()) {
+      throw std::invalid_argument(input + " cannot be opened for loading!");
+    }
+    int64_t id;
+    while (ifs >> id) {
+      queries.push_back(id);
+    }
+  }
+  const int64_t nq = queries.size();
+
+  std::ofstream tsv;
+  std::ofstream ids;
+  std::ofstream scores;
+  if (format == "npy") {
+    ids.open(output + ".ids.npy", std::ofstream::binary);
+    scores.open(output + ".scores.npy", std::ofstream::binary);
+    if (!ids.is_open() || !scores.is_open()) {
+      throw std::invalid_argument(output + " cannot be opened for saving!");
+    }
+    const std::string idsHeader = compact::npyHeader("<i4", nq, k);
+    const std::string scoresHeader = compact::npyHeader("<f4", nq, k);
+    ids.write(idsHeader.data(), idsHeader.size());
+    scores.write(scoresHeader.data(), scoresHeader.size());
+  } else if (output != "-") {
+    tsv.open(output);
+    if (!tsv.is_open()) {
+      throw std::invalid_argument(output + " cannot be opened for saving!");
+    }
+  }
+  std::ostream& out = (output == "-") ? std::cout : tsv;
+
+  auto start = std::chrono::steady_clock::now();
+  std::string text;
+  std::vector<int32_t> idRows;
+  std::vector<real> scoreRows;
+  for (int64_t b = 0; b < nq; b += batch) {
+    const int64_t e = std::min(nq, b + batch);
+    const std::vector<int64_t> block(queries.begin() + b, queries.begin() + e);
+    std::vector<std::vector<int64_t>> bans;
+    if (!banned.empty() || (!users && !keepSelf)) {
+      bans.resize(block.size());
+      for (size_t q = 0; q < block.size(); q++) {
+        auto it = banned.find(block[q]);
+        if (it != banned.end()) {
+          bans[q] = it->second;
+        }
+        if (!users && !keepSelf) {
+          bans[q].push_back(block[q]);
+        }
+        std::sort(bans[q].begin(), bans[q].end());
+      }
+    }
+    const auto results = uniVec.recommend(block, users, k, bans, thread);
+    if (format == "npy") {
+      idRows.assign(block.size() * k, -1);
+      scoreRows.assign(block.size() * k, -std::numeric_limits<real>::infinity());
+      for (size_t q = 0; q < block.size(); q++) {
+        for (size_t j = 0; j < results[q].size(); j++) {
+          idRows[q * k + j] = results[q][j].second;
+          scoreRows[q * k + j] = results[q][j].first;
+        }
+      }
+      ids.write((char*)idRows.data(), idRows.size() * sizeof(int32_t));
+      scores.write((char*)scoreRows.data(), scoreRows.size() * sizeof(real));
+    } else {
+      text.clear();
+      for (size_t q = 0; q < block.size(); q++) {
+        text += std::to_string(block[q]);
+        for (const auto& p : results[q]) {
+          text += '\t';
+          text += std::to_string(p.second);
+          text += ':';
+          utils::appendReal(text, p.first);
+        }
+        text += '\n';
+      }
+      out << text;
+    }
+  }
+  out.flush();
+  if (!out || !ids.good() || !scores.good()) {
+    throw std::runtime_error(output + " could not be written completely!");
+  }
+  std::cerr << "Recommended for " << nq << " " << (users ? "users" : "items")
+            << " in "
+            << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "s" << std::endl;
+}
+
+// Comma separated ids, none for an empty field.
+std::vector<int64_t> parseIds(const std::string& field) {
+  std::vector<int64_t> ids;
+  size_t begin = 0;
+  while (begin < field.size()) {
+    size_t end = field.find(',', begin);
+    if (end == std::string::npos) {
+      end = field.size();
+    }
+    if (end > begin) {
+      ids.push_back(std::stoll(field.substr(begin, end - begin)));
+    }
+    begin = end + 1;
+  }
+  return ids;
+}
+
+void rank(const std::vector<std::string>& args) {
+  if (args.size() < 3) {
+    printRankUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::string input = "-";
+  std::string combine;
+  int32_t k = 0;
+  int64_t batch = 4096;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 3; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printRankUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-input") {
+      input = args[ai + 1];
+    } else if (args[ai] == "-k") {
+      k = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-combineMethod") {
+      combine = args[ai + 1];
+    } else if (args[ai] == "-batch") {
+      batch = std::max(1, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printRankUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  if (combine == "concat") {
+    uniVec.setCombineMethod(combine_method::concat);
+  } else if (combine == "mean") {
+    uniVec.setCombineMethod(combine_method::mean);
+  } else if (combine == "meanSum") {
+    uniVec.setCombineMethod(combine_method::meanSum);
+  } else if (!combine.empty()) {
+    std::cerr << "Unknown combine method: " << combine << std::endl;
+    printRankUsage();
+    exit(EXIT_FAILURE);
+  }
+
+  std::ifstream ifs;
+  if (input != "-") {
+    ifs.open(input);
+    if (!ifs.is_open()) {
+      throw std::invalid_argument(input + " cannot be opened for loading!");
+    }
+  }
+  std::istream& in = (input == "-") ? std::cin : ifs;
+  std::vector<RankRequest> requests;
+  std::vector<std::pair<real, int64_t>> ranked;
+  std::string out;
+  int64_t nrequests = 0;
+  int64_t ncandidates = 0;
+  double seconds = 0;
+  auto flush = [&]() {
+    auto start = std::chrono::steady_clock::now();
+    const auto scores = uniVec.rank(requests, thread);
+    seconds += std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    out.clear();
+    for (size_t r = 0; r < requests.size(); r++) {
+      const auto& candidates = requests[r].candidates;
+      ranked.clear();
+      for (size_t i = 0; i < candidates.size(); i++) {
+        ranked.emplace_back(scores[r][i], candidates[i]);
+      }
+      const size_t kept =
+          k > 0 ? std::min<size_t>(k, ranked.size()) : ranked.size();
+      std::partial_sort(
+          ranked.begin(), ranked.begin() + kept, ranked.end(), betterScore);
+      out += std::to_string(requests[r].user);
+      for (size_t i = 0; i < kept; i++) {
+        out += '\t';
+        out += std::to_string(ranked[i].second);
+        out += ':';
+        utils::appendReal(out, ranked[i].first);
+      }
+      out += '\n';
+      ncandidates += candidates.size();
+    }
+    std::cout << out;
+    nrequests += requests.size();
+    requests.clear();
+  };
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    for (size_t end; (end = line.find('\t', begin)) != std::string::npos;
+         begin = end + 1) {
+      fields.push_back(line.substr(begin, end - begin));
+    }
+    fields.push_back(line.substr(begin));
+    if (fields.size() != 3) {
+      throw std::invalid_argument("Malformed request: " + line);
+    }
+    RankRequest request;
+    request.user = std::stoll(fields[0]);
+    request.context = parseIds(fields[1]);
+    request.candidates = parseIds(fields[2]);
+    requests.push_back(std::move(request));
+    if (int64_t(requests.size()) == batch) {
+      flush();
+    }
+  }
+  flush();
+  std::cout.flush();
+  std::cerr << "Ranked " << ncandidates << " candidates of " << nrequests
+            << " requests in " << seconds << "s, "
+            << (seconds > 0 ? nrequests / seconds : 0) << " requests/s"
+            << std::endl;
+}
+
+void index(const std::vector<std::string>& args) {
+  if (args.size() < 4) {
+    printIndexUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::string type = "hnsw";
+  int32_t M = 16;
+  int32_t efConstruction = 200;
+  int32_t nlist = 0;
+  int32_t dsub = 2;
+  int32_t bits = 512;
+  int32_t seed = 0;
+  int32_t thread = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t ai = 4; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printIndexUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-type") {
+      type = args[ai + 1];
+    } else if (args[ai] == "-M") {
+      M = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-efConstruction") {
+      efConstruction = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-nlist") {
+      nlist = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-dsub") {
+      dsub = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-bits") {
+      bits = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-seed") {
+      seed = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printIndexUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (type != "hnsw" && type != "ivfpq" && type != "hash") {
+    std::cerr << "Unknown index type: " << type << std::endl;
+    printIndexUsage();
+    exit(EXIT_FAILURE);
+  }
+  UniVec uniVec;
+  uniVec.loadModel(args[2]);
+  auto start = std::chrono::steady_clock::now();
+  if (type == "hnsw") {
+    uniVec.buildIndex(M, efConstruction, seed, thread);
+  } else if (type == "ivfpq") {
+    uniVec.buildIvfPqIndex(nlist, dsub, seed, thread);
+  } else {
+    uniVec.buildHashIndex(bits, seed, thread);
+  }
+  std::cerr << "Built the index in "
+            << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "s" << std::endl;
+  uniVec.saveIndex(args[3]);
+}
+
+Server* runningServer = nullptr;
+
+void stopServer(int) {
+  if (runningServer) {
+    runningServer->stop();
+  }
+}
+
+void reloadServer(int) {
+  if (runningServer) {
+    runningServer->requestReload();
+  }
+}
+
+void serve(const std::vector<std::string>& args) {
+  if (args.size() < 3) {
+    printServeUsage();
+    exit(EXIT_FAILURE);
+  }
+  ServerArgs serverArgs;
+  serverArgs.thread = std::max(1u, std::thread::hardware_concurrency());
+  std::string indexPath;
+  for (size_t ai = 3; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printServeUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-socket") {
+      serverArgs.socket = args[ai + 1];
+    } else if (args[ai] == "-port") {
+      serverArgs.port = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-index") {
+      indexPath = args[ai + 1];
+    } else if (args[ai] == "-efSearch") {
+      serverArgs.efSearch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-nprobe") {
+      serverArgs.nprobe = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-shortlist") {
+      serverArgs.shortlist = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-int8") {
+      serverArgs.int8Rerank = std::max(0, std::stoi(args[ai + 1]));
+    } else if (args[ai] == "-maxBatch") {
+      serverArgs.maxBatch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-batchWait") {
+      serverArgs.batchWait = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-maxK") {
+      serverArgs.maxK = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-cacheSize") {
+      serverArgs.cacheSize = std::stoll(args[ai + 1]);
+    } else if (args[ai] == "-foldInEpoch") {
+      serverArgs.foldInEpoch = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-thread") {
+      serverArgs.thread = std::stoi(args[ai + 1]);
+    } else {
+      std::cerr << "Unknown argument: " << args[ai] << std::endl;
+      printServeUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (serverArgs.socket.empty() && serverArgs.port == 0) {
+    printServeUsage();
+    exit(EXIT_FAILURE);
+  }
+
+  serverArgs.model = args[2];
+  serverArgs.index = indexPath;
+  Server server(serverArgs);
+  runningServer = &server;
+  std::signal(SIGINT, stopServer);
+  std::signal(SIGTERM, stopServer);
+  std::signal(SIGHUP, reloadServer);
+  std::cerr << "Serving "
+            << (serverArgs.socket.empty()
+                    ? "127.0.0.1:" + std::to_string(serverArgs.port)
+                    : serverArgs.socket)
+            << std::endl;
+  server.run();
+  runningServer = nullptr;
 }
 
 int main(int argc, char** argv) {
@@ -153,13 +1652,56 @@ int main(int argc, char** argv) {
   }
   std::string command(args[1]);
   if (command == "test") {
-  ;
+    test(args);
+
   } else if (command == "train") {
     train(args);
 
   } else if (command == "dump") {
     dump(args);
 
+  } else if (command == "export") {
+    exportVectors(args);
+
+  } else if (command == "infer-cold") {
+    inferCold(args);
+
+  } else if (command == "fold-in") {
+    foldIn(args);
+
+  } else if (command == "quantize") {
+    quantize(args);
+
+  } else if (command == "dequantize") {
+    dequantize(args);
+
+  } else if (command == "nn") {
+    nn(args);
+
+  } else if (command == "recommend") {
+    recommend(args);
+
+  } else if (command == "rank") {
+    rank(args);
+
+  } else if (command == "index") {
+    index(args);
+
+  } else if (command == "serve") {
+    serve(args);
+
+  } else if (command == "merge") {
+    merge(args);
+
+  } else if (command == "verify") {
+    verify(args);
+
+  } else if (command == "synth") {
+    synth(args);
+
+  } else if (command == "benchmark") {
+    benchmark(args);
+
   } else {
     printUsage();
     exit(EXIT_FAILURE);
@@ -0,0 +1,286 @@
+/*
+ * Microbenchmarks of the training and quantization kernels.
+ *
+ * usage: uni-vec-bench [-filter <kernel>] [-minTime <seconds>] [-maxMB <MB>]
+ *
+ * Every case runs for at least minTime seconds over rows picked at random,
+ * so matrices larger than the last level cache measure memory bound
+ * behaviour. GB/s counts the embedding bytes a single call reads and writes.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "kernel.h"
+#include "matrix.h"
+#include "model.h"
+#include "productquantizer.h"
+#include "vector.h"
+
+using namespace uni_vec;
+
+namespace {
+
+struct BenchOptions {
+  std::string filter;
+  double minTime = 0.2;
+  int64_t maxMB = 1024;
+};
+
+// Exposes the protected sampler of Model to the benchmark.
+class BenchModel : public Model {
+ public:
+  using Model::Model;
+  using Model::getNegative;
+};
+
+volatile real sink;
+
+std::vector<int64_t> dims() {
+  return {32, 64, 100, 128, 256};
+}
+
+// 1 MB, 32 MB and the configured maximum (beyond the LLC by default)
+std::vector<int64_t> rowsFor(const BenchOptions& opt, int64_t dim) {
+  std::vector<int64_t> res;
+  for (int64_t mb : {int64_t(1), int64_t(32), opt.maxMB}) {
+    res.push_back(std::max<int64_t>(256, mb * 1024 * 1024 / (dim * sizeof(real))));
+  }
+  return res;
+}
+
+std::vector<int32_t> randomRows(int64_t rows, int64_t n, int32_t seed) {
+  std::minstd_rand rng(seed);
+  std::uniform_int_distribution<int64_t> uniform(0, rows - 1);
+  std::vector<int32_t> res(n);
+  for (auto& r : res) {
+    r = uniform(rng);
+  }
+  return res;
+}
+
+std::shared_ptr<Matrix> randomMatrix(int64_t rows, int64_t cols) {
+  auto mat = std::make_shared<Matrix>(rows, cols);
+  mat->uniform(1.0 / cols);
+  return mat;
+}
+
+// Calls op(i) until minTime elapsed and prints one result line.
+template <typename Op>
+void run(
+    const BenchOptions& opt,
+    const std::string& kernel,
+    const std::string& params,
+    double bytesPerOp,
+    Op op) {
+  if (!opt.filter.empty() && kernel.find(opt.filter) == std::string::npos) {
+    return;
+  }
+  for (int64_t i = 0; i < 1024; i++) {
+    op(i);
+  }
+  const auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  int64_t ops = 0;
+  while (elapsed < opt.minTime) {
+    for (int64_t i = 0; i < 1024; i++) {
+      op(ops + i);
+    }
+    ops += 1024;
+    elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  }
+  double ns = elapsed * 1e9 / ops;
+  std::cout << std::left << std::setw(30) << kernel << std::setw(40) << params
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(12) << ns << " ns/op" << std::setprecision(2)
+            << std::setw(10) << bytesPerOp / ns << " GB/s" << std::endl;
+}
+
+std::string describe(int64_t dim, int64_t rows) {
+  return "dim=" + std::to_string(dim) + " rows=" + std::to_string(rows) +
+      " (" + std::to_string(rows * dim * sizeof(real) >> 20) + "MB)";
+}
+
+const int64_t kIndexCount = 1 << 20;
+
+typedef void (Model::*ConcatFn)(const std::vector<int32_t>&, int32_t, int32_t, real);
+
+// The dimension-specialised concat kernel training selects for dim, if any.
+ConcatFn concatKernel(int64_t dim) {
+  switch (dim) {
+#define UNI_VEC_CONCAT_KERNEL_CASE(D) \
+  case D:                             \
+    return &Model::updateConcatKernel<D>;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_CONCAT_KERNEL_CASE)
+#undef UNI_VEC_CONCAT_KERNEL_CASE
+    default:
+      return nullptr;
+  }
+}
+
+void benchMatrixVector(const BenchOptions& opt) {
+  for (int64_t dim : dims()) {
+    for (int64_t rows : rowsFor(opt, dim)) {
+      auto mat = randomMatrix(rows, dim);
+      auto idx = randomRows(rows, kIndexCount, 1);
+      Vector vec(dim);
+      vec.zero();
+      vec[0] = 1.0;
+      const double rowBytes = dim * sizeof(real);
+      run(opt, "Matrix::dotRow", describe(dim, rows), rowBytes, [&](int64_t i) {
+        sink = mat->dotRow(vec, idx[i & (kIndexCount - 1)]);
+      });
+      run(opt, "Matrix::addRow", describe(dim, rows), 2 * rowBytes,
+          [&](int64_t i) { mat->addRow(vec, idx[i & (kIndexCount - 1)], 1e-6); });
+      run(opt, "Vector::addRow", describe(dim, rows), rowBytes, [&](int64_t i) {
+        vec.addRow(*mat, idx[i & (kIndexCount - 1)], 1e-6);
+      });
+    }
+  }
+}
+
+void benchModel(const BenchOptions& opt) {
+  for (int64_t dim : dims()) {
+    for (int64_t rows : rowsFor(opt, 2 * dim)) {
+      // item and user inputs with dim columns, concat outputs with 2 * dim
+      auto itemInput = randomMatrix(rows, dim);
+      auto userInput = randomMatrix(rows, dim);
+      auto itemOutput = randomMatrix(rows, 2 * dim);
+      auto meanOutput = randomMatrix(rows, dim);
+      auto idx = randomRows(rows, kIndexCount, 2);
+      auto table = std::make_shared<NegativeTable>(
+          std::vector<int64_t>(rows, 1), 1);
+      std::string base = describe(dim, rows);
+
+      for (int32_t neg : {5, 10, 20}) {
+        auto args = std::make_shared<Args>();
+        args->dim = dim;
+        args->userDim = dim;
+        args->neg = neg;
+
+        BenchModel meanSum(
+            itemInput, userInput, itemInput, meanOutput, args, false, 1);
+        meanSum.setNegativeTable(table, 0);
+        Vector itemGrad(dim);
+        Vector userGrad(dim);
+        if (neg == 5) {
+          run(opt, "Model::binaryLogisticMeanSum", base, 4 * dim * sizeof(real),
+              [&](int64_t i) {
+                sink = meanSum.binaryLogisticMeanSum(
+                    idx[i & (kIndexCount - 1)],
+                    idx[(i + 1) & (kIndexCount - 1)],
+                    i & 1,
+                    1e-4,
+                    itemGrad,
+                    userGrad);
+              });
+          run(opt, "Model::getNegative", "rows=" + std::to_string(rows),
+              sizeof(int32_t), [&](int64_t i) {
+                sink = meanSum.getNegative(idx[i & (kIndexCount - 1)]);
+              });
+        }
+
+        BenchModel concat(
+            itemInput, userInput, itemInput, itemOutput, args, false, 1);
+        concat.setNegativeTable(table, 0);
+        for (int32_t ws : {2, 5, 10}) {
+          // [target, user, ws context items]
+          std::vector<int32_t> hist(ws + 2);
+          // floats read or written: user row and context rows read for the
+          // hidden vector and updated, neg + 1 output rows of 2 * dim
+          // read and updated.
+          double bytes = dim * (3.0 + 3.0 * ws + 4.0 * (neg + 1)) * sizeof(real);
+          run(opt, "Model::updateConcat",
+              base + " neg=" + std::to_string(neg) + " ws=" + std::to_string(ws),
+              bytes, [&](int64_t i) {
+                for (size_t j = 0; j < hist.size(); j++) {
+                  hist[j] = idx[(i * (ws + 2) + j) & (kIndexCount - 1)];
+                }
+                concat.updateConcat(hist, 1, 0, 1e-4);
+              });
+          ConcatFn specialised = concatKernel(dim);
+          if (specialised) {
+            run(opt, "Model::updateConcatKernel<D>",
+                base + " neg=" + std::to_string(neg) +
+                    " ws=" + std::to_string(ws),
+                bytes, [&](int64_t i) {
+                  for (size_t j = 0; j < hist.size(); j++) {
+                    hist[j] = idx[(i * (ws + 2) + j) & (kIndexCount - 1)];
+                  }
+                  (concat.*specialised)(hist, 1, 0, 1e-4);
+                });
+          }
+        }
+      }
+    }
+  }
+}
+
+void benchProductQuantizer(const BenchOptions& opt) {
+  const int32_t ksub = 256;
+  for (int32_t dsub : {2, 4, 8}) {
+    std::minstd_rand rng(3);
+    std::uniform_real_distribution<real> uniform(-1, 1);
+    std::vector<real> centroids(ksub * dsub);
+    std::vector<real> x(kIndexCount / 16 * dsub);
+    for (auto& c : centroids) {
+      c = uniform(rng);
+    }
+    for (auto& v : x) {
+      v = uniform(rng);
+    }
+    ProductQuantizer pq(dsub, dsub);
+    uint8_t code;
+    const int64_t npoints = x.size() / dsub;
+    run(opt, "PQ::assign_centroid", "dsub=" + std::to_string(dsub),
+        ksub * dsub * sizeof(real), [&](int64_t i) {
+          sink = pq.assign_centroid(
+              x.data() + (i % npoints) * dsub, centroids.data(), &code, dsub);
+        });
+  }
+}
+
+void printUsage() {
+  std::cerr << "usage: uni-vec-bench [-filter <kernel>] [-minTime <seconds>] "
+               "[-maxMB <MB>]\n\n"
+            << "  -filter     only run kernels whose name contains this string\n"
+            << "  -minTime    minimum seconds per case [0.2]\n"
+            << "  -maxMB      size of the largest matrix, beyond LLC [1024]\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::string> args(argv, argv + argc);
+  BenchOptions opt;
+  for (size_t ai = 1; ai < args.size(); ai += 2) {
+    if (ai + 1 >= args.size()) {
+      printUsage();
+      exit(EXIT_FAILURE);
+    }
+    if (args[ai] == "-filter") {
+      opt.filter = args[ai + 1];
+    } else if (args[ai] == "-minTime") {
+      opt.minTime = std::stod(args[ai + 1]);
+    } else if (args[ai] == "-maxMB") {
+      opt.maxMB = std::stoll(args[ai + 1]);
+    } else {
+      printUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  benchMatrixVector(opt);
+  benchModel(opt);
+  benchProductQuantizer(opt);
+  return 0;
+}
@@ -28,6 +28,13 @@ Args::Args() {
   loss = loss_name::ns;
   model = model_name::sg;
   combine = combine_method::concat;
+  optimizer = optimizer_name::sgd;
+  targetLoss = -1;
+  timeLimit = 0;
+  deltaInterval = 0;
+  testK = 10;
+  exportShards = 1;
+  exportFormats = "npy";
   bucket = 2000000;
   minn = 3;
   maxn = 6;
@@ -36,8 +43,11 @@ Args::Args() {
   t = 1e-4;
   label = "__label__";
   verbose = 2;
+  metricsInterval = 10;
   pretrainedVectors = "";
   saveOutput = false;
+  saveModel = false;
+  holdOutLast = false;
   useConcat = false;
   regOutput = false;
   quasiAtten = false;
@@ -105,6 +115,16 @@ std::string Args::combineToString(combine_method cm) const {
   return "Unknown model name!"; // should never happen 
 }
 
+std::string Args::optimizerToString(optimizer_name on) const {
+  switch (on) {
+    case optimizer_name::sgd:
+      return "sgd";
+    case optimizer_name::adagrad:
+      return "adagrad";
+  }
+  return "Unknown optimizer!"; // should never happen
+}
+
 void Args::parseArgs(const std::vector<std::string>& args) {
   std::string command(args[1]);
 
@@ -147,6 +167,12 @@ void Args::parseArgs(const std::vector<std::string>& args) {
         userHistInputSearch = std::string(args.at(ai + 1));
       } else if (args[ai] == "-output") {
         output = std::string(args.at(ai + 1));
+      } else if (args[ai] == "-metricsOutput") {
+        metricsOutput = std::string(args.at(ai + 1));
+      } else if (args[ai] == "-trace") {
+        trace = std::string(args.at(ai + 1));
+      } else if (args[ai] == "-metricsInterval") {
+        metricsInterval = std::stoi(args.at(ai + 1));
       } else if (args[ai] == "-lr") {
         lr = std::stof(args.at(ai + 1));
       } else if (args[ai] == "-lrUpdateRate") {
@@ -194,6 +220,28 @@ void Args::parseArgs(const std::vector<std::string>& args) {
           printHelp();
           exit(EXIT_FAILURE);
         }
+      } else if (args[ai] == "-optimizer") {
+        if (args.at(ai + 1) == "sgd") {
+          optimizer = optimizer_name::sgd;
+        } else if (args.at(ai + 1) == "adagrad") {
+          optimizer = optimizer_name::adagrad;
+        } else {
+          std::cerr << "Unknown optimizer: " << args.at(ai + 1) << std::endl;
+          printHelp();
+          exit(EXIT_FAILURE);
+        }
+      } else if (args[ai] == "-targetLoss") {
+        targetLoss = std::stof(args.at(ai + 1));
+      } else if (args[ai] == "-timeLimit") {
+        timeLimit = std::stod(args.at(ai + 1));
+      } else if (args[ai] == "-deltaInterval") {
+        deltaInterval = std::stod(args.at(ai + 1));
+      } else if (args[ai] == "-testK") {
+        testK = std::stoi(args.at(ai + 1));
+      } else if (args[ai] == "-exportShards") {
+        exportShards = std::stoi(args.at(ai + 1));
+      } else if (args[ai] == "-exportFormats") {
+        exportFormats = std::string(args.at(ai + 1));
       } else if (args[ai] == "-bucket") {
         bucket = std::stoi(args.at(ai + 1));
       } else if (args[ai] == "-minn") {
@@ -213,6 +261,12 @@ void Args::parseArgs(const std::vector<std::string>& args) {
       } else if (args[ai] == "-saveOutput") {
         saveOutput = true;
         ai--;
+      } else if (args[ai] == "-saveModel") {
+        saveModel = true;
+        ai--;
+      } else if (args[ai] == "-holdOutLast") {
+        holdOutLast = true;
+        ai--;
       } else if (args[ai] == "-skipContext") {
         skipContext = true;
         ai--;
@@ -329,7 +383,10 @@ void Args::printBasicHelp() {
             << "  -userHistInput      user hist training file path\n"
             << "  -output             output file path\n"
             << "\nThe following arguments are optional:\n"
-            << "  -verbose            verbosity level [" << verbose << "]\n";
+            << "  -verbose            verbosity level [" << verbose << "]\n"
+            << "  -metricsOutput      append training metrics as JSON lines to this file [" << metricsOutput << "]\n"
+            << "  -metricsInterval    seconds between two metrics lines [" << metricsInterval << "]\n"
+            << "  -trace              write a Chrome trace-event timeline of the run to this file [" << trace << "]\n";
 }
 
 void Args::printTrainingHelp() {
@@ -342,9 +399,21 @@ void Args::printTrainingHelp() {
       << "  -ws                 size of the context window [" << ws << "]\n"
       << "  -epoch              number of epochs [" << epoch << "]\n"
       << "  -neg                number of negatives sampled [" << neg << "]\n"
+      << "  -optimizer          sgd (linear lr decay) or row-wise adagrad (constant lr, try -lr 0.2) ["
+      << optimizerToString(optimizer) << "]\n"
+      << "  -targetLoss         log the time at which the loss first drops below this value [" << targetLoss << "]\n"
+      << "  -timeLimit          stop training after this many seconds, 0 for no limit [" << timeLimit << "]\n"
       << "  -thread             number of threads [" << thread << "]\n"
       << "  -saveOutput         whether output params should be saved ["
       << boolToString(saveOutput) << "]\n"
+      << "  -exportShards       split every saved .npy matrix into this many row shards [" << exportShards << "]\n"
+      << "  -exportFormats      comma separated output formats: npy, txt, fp16, int8 [" << exportFormats << "]\n"
+      << "  -deltaInterval      every this many seconds write the rows updated since the last delta, 0 to disable [" << deltaInterval << "]\n"
+      << "  -saveModel          also write a memory-mappable model to <output>.bin ["
+      << boolToString(saveModel) << "]\n"
+      << "  -holdOutLast        train without the last item of every trx basket and evaluate on them ["
+      << boolToString(holdOutLast) << "]\n"
+      << "  -testK              cutoff of the metrics of -holdOutLast [" << testK << "]\n"
       << "  -userWordInput      location of user context [" << userWordInput << "]\n"
       << "  -userHistInputView  location of the user view history [" << userHistInputView << "]\n"
 
@@ -18,6 +18,7 @@ namespace uni_vec {
 enum class model_name : int { cbow = 1, sg, sup };
 enum class combine_method: int {concat = 1, mean, meanSum};
 enum class loss_name : int { hs = 1, ns, softmax, ova };
+enum class optimizer_name : int { sgd = 1, adagrad };
 
 class Args {
 
@@ -34,6 +35,11 @@ class Args {
   std::string userHistInputSearch;
 
   std::string output;
+  std::string metricsOutput;
+  std::string trace;
+  int metricsInterval;
+  int exportShards;
+  std::string exportFormats;
   double lr;
   int lrUpdateRate;
   int dim;
@@ -47,6 +53,11 @@ class Args {
   loss_name loss;
   model_name model;
   combine_method combine;
+  optimizer_name optimizer;
+  double targetLoss;
+  double timeLimit;
+  double deltaInterval;
+  int testK;
   int bucket;
   int minn;
   int maxn;
@@ -57,6 +68,8 @@ class Args {
   std::string pretrainedVectors;
 
   bool saveOutput;
+  bool saveModel;
+  bool holdOutLast;
   bool skipContext;
   bool skipUserContext;
   bool skipTrxData;
@@ -90,5 +103,6 @@ class Args {
   std::string boolToString(bool) const;
   std::string modelToString(model_name) const;
   std::string combineToString(combine_method) const;
+  std::string optimizerToString(optimizer_name) const;
 };
 } // namespace uni_vec
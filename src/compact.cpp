@@ -0,0 +1,290 @@
+#include "compact.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include "cnpy/cnpy.h"
+
+namespace uni_vec {
+
+namespace compact {
+
+uint16_t floatToHalf(real f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const int32_t biased = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+  if (biased == 0xff) {
+    // inf stays inf, nan stays a quiet nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  const int32_t exp = biased - 127 + 15;
+  if (exp >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exp <= 0) {
+    // subnormal half, or zero
+    if (exp < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    const uint32_t shift = 14 - exp;
+    uint32_t half = mant >> shift;
+    const uint32_t rem = mant & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  uint32_t half = (exp << 10) | (mant >> 13);
+  const uint32_t rem = mant & 0x1fff;
+  // a carry out of the mantissa correctly bumps the exponent
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+    half++;
+  }
+  return sign | half;
+}
+
+real halfToFloat(uint16_t h) {
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  int32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0) {
+    if (mant == 0) {
+      bits = sign;
+    } else {
+      exp = 127 - 15 + 1;
+      while (!(mant & 0x400)) {
+        mant <<= 1;
+        exp--;
+      }
+      bits = sign | (uint32_t(exp) << 23) | ((mant & 0x3ff) << 13);
+    }
+  } else if (exp == 31) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else {
+    bits = sign | (uint32_t(exp + 127 - 15) << 23) | (mant << 13);
+  }
+  real f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+std::string npyHeader(const char* descr, int64_t rows, int64_t cols) {
+  std::string dict = std::string("{'descr': '") + descr +
+      "', 'fortran_order': False, 'shape': (" + std::to_string(rows) +
+      (cols >= 0 ? ", " + std::to_string(cols) + ")" : ",)") + ", }";
+  size_t total = 10 + dict.size() + 1;
+  dict.append((64 - total % 64) % 64, ' ');
+  dict.push_back('\n');
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header.push_back(char(dict.size() & 0xff));
+  header.push_back(char(dict.size() >> 8));
+  return header + dict;
+}
+
+} // namespace compact
+
+namespace {
+
+void toHalf(const real* x, uint16_t* h, int64_t n) {
+  int64_t i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(h + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    h[i] = compact::floatToHalf(x[i]);
+  }
+}
+
+void fromHalf(const uint16_t* h, real* x, int64_t n) {
+  int64_t i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i));
+    _mm256_storeu_ps(x + i, _mm256_cvtph_ps(v));
+  }
+#endif
+  for (; i < n; i++) {
+    x[i] = compact::halfToFloat(h[i]);
+  }
+}
+
+FILE* openForWrite(const std::string& path) {
+  FILE* fp = std::fopen(path.c_str(), "wb");
+  if (!fp) {
+    throw std::invalid_argument(path + " cannot be opened for saving vectors!");
+  }
+  return fp;
+}
+
+void writeAll(FILE* fp, const void* data, size_t bytes, const std::string& path) {
+  if (bytes > 0 && std::fwrite(data, 1, bytes, fp) != bytes) {
+    std::fclose(fp);
+    throw std::runtime_error(path + " could not be written completely!");
+  }
+}
+
+cnpy::NpyArray loadNpy(const std::string& path, size_t wordSize) {
+  cnpy::NpyArray arr = cnpy::npy_load(path);
+  if (arr.word_size != wordSize || arr.fortran_order) {
+    throw std::invalid_argument(path + " does not hold the expected type!");
+  }
+  return arr;
+}
+
+} // namespace
+
+CompactMatrix::CompactMatrix() : format_(export_format::fp16), m_(0), n_(0) {}
+
+std::vector<std::string> CompactMatrix::files(
+    const std::string& base,
+    export_format format) {
+  if (format == export_format::fp16) {
+    return {base + ".fp16.npy"};
+  } else if (format == export_format::int8) {
+    return {base + ".int8.npy", base + ".int8.scale.npy"};
+  }
+  throw std::invalid_argument("Not a compact export format.");
+}
+
+std::vector<std::string> CompactMatrix::save(
+    const Matrix& mat,
+    int64_t begin,
+    int64_t end,
+    export_format format,
+    const std::string& base) {
+  const std::vector<std::string> paths = files(base, format);
+  const int64_t n = mat.cols();
+  const int64_t blockRows = 4096;
+  FILE* fp = openForWrite(paths[0]);
+  std::string header = compact::npyHeader(
+      format == export_format::fp16 ? "<f2" : "|i1", end - begin, n);
+  writeAll(fp, header.data(), header.size(), paths[0]);
+
+  std::vector<uint16_t> half;
+  std::vector<int8_t> codes;
+  std::vector<real> scales;
+  for (int64_t b = begin; b < end; b += blockRows) {
+    const int64_t e = std::min(end, b + blockRows);
+    if (format == export_format::fp16) {
+      half.resize((e - b) * n);
+      toHalf(mat.row(b), half.data(), half.size());
+      writeAll(fp, half.data(), half.size() * sizeof(uint16_t), paths[0]);
+    } else {
+      codes.resize((e - b) * n);
+      for (int64_t i = b; i < e; i++) {
+        const real* x = mat.row(i);
+        real maxAbs = 0.0;
+        for (int64_t j = 0; j < n; j++) {
+          maxAbs = std::max(maxAbs, std::fabs(x[j]));
+        }
+        const real scale = maxAbs / 127.0;
+        const real inv = scale > 0 ? 1.0 / scale : 0.0;
+        int8_t* q = codes.data() + (i - b) * n;
+        for (int64_t j = 0; j < n; j++) {
+          q[j] = int8_t(std::max(-127.0f, std::min(127.0f, std::nearbyint(x[j] * inv))));
+        }
+        scales.push_back(scale);
+      }
+      writeAll(fp, codes.data(), codes.size(), paths[0]);
+    }
+  }
+  std::fclose(fp);
+
+  if (format == export_format::int8) {
+    fp = openForWrite(paths[1]);
+    header = compact::npyHeader("<f4", end - begin, -1);
+    writeAll(fp, header.data(), header.size(), paths[1]);
+    writeAll(fp, scales.data(), scales.size() * sizeof(real), paths[1]);
+    std::fclose(fp);
+  }
+  return paths;
+}
+
+void CompactMatrix::load(const std::string& base, export_format format) {
+  const std::vector<std::string> paths = files(base, format);
+  format_ = format;
+  cnpy::NpyArray arr = loadNpy(
+      paths[0], format == export_format::fp16 ? sizeof(uint16_t) : sizeof(int8_t));
+  if (arr.shape.size() != 2) {
+    throw std::invalid_argument(paths[0] + " is not a matrix!");
+  }
+  m_ = arr.shape[0];
+  n_ = arr.shape[1];
+  if (format == export_format::fp16) {
+    half_ = arr.as_vec<uint16_t>();
+    codes_.clear();
+    scales_.clear();
+  } else {
+    codes_ = arr.as_vec<int8_t>();
+    cnpy::NpyArray scales = loadNpy(paths[1], sizeof(real));
+    if (scales.num_vals != size_t(m_)) {
+      throw std::invalid_argument(paths[1] + " must hold one scale per row!");
+    }
+    scales_ = scales.as_vec<real>();
+    half_.clear();
+  }
+}
+
+void CompactMatrix::row(int64_t i, real* out) const {
+  assert(i >= 0 && i < m_);
+  if (format_ == export_format::fp16) {
+    fromHalf(half_.data() + i * n_, out, n_);
+  } else {
+    const int8_t* q = codes_.data() + i * n_;
+    const real scale = scales_[i];
+    for (int64_t j = 0; j < n_; j++) {
+      out[j] = q[j] * scale;
+    }
+  }
+}
+
+real CompactMatrix::dotRow(const Vector& vec, int64_t i) const {
+  assert(vec.size() == n_);
+  real d = 0.0;
+  if (format_ == export_format::fp16) {
+    // dequantise in small blocks that stay in registers / L1
+    const uint16_t* h = half_.data() + i * n_;
+    real buf[64];
+    for (int64_t j = 0; j < n_; j += 64) {
+      const int64_t len = std::min<int64_t>(64, n_ - j);
+      fromHalf(h + j, buf, len);
+      for (int64_t k = 0; k < len; k++) {
+        d += buf[k] * vec[j + k];
+      }
+    }
+  } else {
+    // integer codes first, one multiply by the row scale at the end
+    const int8_t* q = codes_.data() + i * n_;
+    for (int64_t j = 0; j < n_; j++) {
+      d += q[j] * vec[j];
+    }
+    d *= scales_[i];
+  }
+  return d;
+}
+
+std::shared_ptr<Matrix> CompactMatrix::toMatrix() const {
+  auto mat = std::make_shared<Matrix>(m_, n_);
+  for (int64_t i = 0; i < m_; i++) {
+    row(i, mat->row(i));
+  }
+  return mat;
+}
+
+} // namespace uni_vec
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "real.h"
+#include "vector.h"
+
+namespace uni_vec {
+
+enum class export_format : int { npy = 1, txt, fp16, int8 };
+
+namespace compact {
+
+// IEEE half precision conversion, round to nearest even.
+uint16_t floatToHalf(real);
+real halfToFloat(uint16_t);
+
+// npy version 1.0 header of a rows x cols array, or of a vector when cols is
+// negative, padded so that the data starts 64 byte aligned.
+std::string npyHeader(const char*, int64_t, int64_t);
+
+} // namespace compact
+
+/*
+ * fp16 or symmetric int8 copy of a matrix, dequantised row by row when it
+ * is used. fp16 is stored as <base>.fp16.npy ('<f2'); int8 as
+ * <base>.int8.npy ('|i1') plus one fp32 scale per row, max |x| / 127, in
+ * <base>.int8.scale.npy. Both load directly with numpy.
+ */
+class CompactMatrix {
+ protected:
+  export_format format_;
+  int64_t m_;
+  int64_t n_;
+  std::vector<uint16_t> half_;
+  std::vector<int8_t> codes_;
+  std::vector<real> scales_;
+
+ public:
+  CompactMatrix();
+
+  // Writes rows [begin, end) of a matrix and returns the files written.
+  static std::vector<std::string> save(
+      const Matrix&,
+      int64_t,
+      int64_t,
+      export_format,
+      const std::string&);
+
+  static std::vector<std::string> files(const std::string&, export_format);
+
+  void load(const std::string&, export_format);
+
+  inline int64_t rows() const {
+    return m_;
+  }
+  inline int64_t cols() const {
+    return n_;
+  }
+  inline export_format format() const {
+    return format_;
+  }
+
+  // Dequantises row i into out[0, cols).
+  void row(int64_t, real*) const;
+  real dotRow(const Vector&, int64_t) const;
+  std::shared_ptr<Matrix> toMatrix() const;
+};
+
+} // namespace uni_vec
@@ -7,6 +7,7 @@
 #include <assert.h>
 
 #include "dataLoader.h"
+#include "trace.h"
 
 namespace uni_vec {
 
@@ -24,10 +25,14 @@ SizeStats::SizeStats(DataLoader& data) {
 DataLoader::DataLoader(Args* args) {
   args_ = args;
 
-  item2Word = loadContextFromFile(args_->itemWordInput);
-  wordCount = computeWordCount(item2Word);
+  {
+    TraceScope trace("load item context", "load");
+    item2Word = loadContextFromFile(args_->itemWordInput);
+    wordCount = computeWordCount(item2Word);
+  }
 
   if (!args_->skipUserContext) {
+    TraceScope trace("load user context", "load");
     user2Word = loadContextFromFile(args_->userWordInput, false);
     userWordCount = computeWordCount(user2Word);
   }
@@ -35,11 +40,23 @@ DataLoader::DataLoader(Args* args) {
   std::cout << "Word Count computed" << std::endl; 
 
   if (!args_->skipTrxData) {
+    TraceScope trace("load trx history", "load");
     allUserHist = loadOrderedBasket(args_->userHistInput);
     std::cout << "basket history (trx) loaded!" << std::endl;
     std::cout << allUserHist.size() << std::endl;
     std::cout << std::endl;
 
+    if (args_->holdOutLast) {
+      // baskets keep at least two items to train on
+      for (auto& basket : allUserHist) {
+        if (basket.size() > 3) {
+          heldOutUserHist.push_back(basket);
+          basket.pop_back();
+        }
+      }
+      std::cout << "Held out the last item of " << heldOutUserHist.size() << " baskets" << std::endl;
+    }
+
     computeUserPool(userPool, allUserHist, 0);
 
     int32_t userSize = *(std::max_element(std::begin(userPool), std::end(userPool))) + 1;
@@ -56,6 +73,7 @@ DataLoader::DataLoader(Args* args) {
   }
 
   if (!args_->skipViewData) {
+    TraceScope trace("load view history", "load");
     allUserHistView = loadOrderedBasket(args_->userHistInputView);
     std::cout << "basket history (view) loaded!" << std::endl;
     std::cout << allUserHistView.size() << std::endl;
@@ -71,13 +89,15 @@ DataLoader::DataLoader(Args* args) {
   }
 
   if (!args_->skipSubData) {
-     allUserHistSub = loadTsvFromFile(args_->userHistInputSub, 1);
+    TraceScope trace("load sub history", "load");
+    allUserHistSub = loadTsvFromFile(args_->userHistInputSub, 1);
     std::cout << "basket history (sub) loaded!" << std::endl;
     std::cout << allUserHistSub.size() << std::endl;
     itemSubCount = computeSubItemCount(allUserHistSub, 1);
   }
 
   if (!args_->skipSearchData) {
+    TraceScope trace("load search history", "load");
     allUserHistSearch = loadTsvFromFile(args_->userHistInputSearch, -1);
     std::cout << "basket history (search) loaded!" << std::endl;
     std::cout << allUserHistSearch.size() << std::endl;
@@ -54,6 +54,7 @@ class DataLoader {
     int2VecOfInt user2Word;
     
     std::vector<std::vector<int32_t> > allUserHist; // trx
+    std::vector<std::vector<int32_t> > heldOutUserHist; // trx with -holdOutLast
     std::vector<std::vector<int32_t> > allUserHistView; // view
     std::vector<std::vector<int32_t> > allUserHistSub; // sub
     std::vector<std::vector<int32_t> > allUserHistSearch; // search
@@ -74,16 +75,16 @@ class DataLoader {
     
     void computeUserPool(std::set<int32_t>&, const std::vector<std::vector<int32_t> >&, int32_t);
 
-    int2VecOfInt loadContextFromFile(const std::string&, bool checkIdxGap=true);
+    static int2VecOfInt loadContextFromFile(const std::string&, bool checkIdxGap=true);
 
-    std::vector<std::vector<int32_t> > loadOrderedBasket(const std::string&);
+    static std::vector<std::vector<int32_t> > loadOrderedBasket(const std::string&);
     std::vector<std::vector<int32_t> > loadTsvFromFile(const std::string&, int32_t);
-    std::vector<std::vector<int32_t> > computeWindowedOrderedBasket(const std::vector<int32_t>&, int32_t, int32_t, bool, std::default_random_engine);
+    static std::vector<std::vector<int32_t> > computeWindowedOrderedBasket(const std::vector<int32_t>&, int32_t, int32_t, bool, std::default_random_engine);
 
     std::tuple<std::vector<int64_t>, std::vector<int64_t>> computeItemCountAndUserCount(const std::vector<std::vector<int32_t>>& hist, int32_t userSize, int32_t itemSize, int32_t userPos);
     void computeItemViewCount();
     std::vector<int64_t> computeSubItemCount(const std::vector<std::vector<int32_t>>&, int32_t);
-    std::vector<int64_t> computeWordCount(const int2VecOfInt&);
+    static std::vector<int64_t> computeWordCount(const int2VecOfInt&);
     std::vector<int64_t> computeSearchWordCount();
 
     DataLoader(Args* args);
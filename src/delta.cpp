@@ -0,0 +1,114 @@
+#include "delta.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "cnpy/cnpy.h"
+
+namespace uni_vec {
+
+namespace {
+
+const char DELTA_MAGIC[8] = {'U', 'V', 'D', 'E', 'L', 'T', 'A', '\0'};
+const int32_t DELTA_VERSION = 1;
+
+} // namespace
+
+MatrixDelta::MatrixDelta() : m_(0), n_(0) {}
+
+void MatrixDelta::save(
+    const Matrix& mat,
+    const std::vector<int64_t>& ids,
+    const std::string& filename) {
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for saving!");
+  }
+  const int64_t m = mat.rows();
+  const int64_t n = mat.cols();
+  const int64_t count = ids.size();
+  ofs.write(DELTA_MAGIC, sizeof(DELTA_MAGIC));
+  ofs.write((char*)&DELTA_VERSION, sizeof(int32_t));
+  ofs.write((char*)&m, sizeof(int64_t));
+  ofs.write((char*)&n, sizeof(int64_t));
+  ofs.write((char*)&count, sizeof(int64_t));
+  ofs.write((char*)ids.data(), count * sizeof(int64_t));
+  for (int64_t id : ids) {
+    ofs.write((char*)mat.row(id), n * sizeof(real));
+  }
+  if (!ofs) {
+    throw std::runtime_error(filename + " could not be written completely!");
+  }
+}
+
+void MatrixDelta::load(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for loading!");
+  }
+  char magic[sizeof(DELTA_MAGIC)];
+  int32_t version = 0;
+  int64_t count = 0;
+  ifs.read(magic, sizeof(magic));
+  ifs.read((char*)&version, sizeof(int32_t));
+  if (!ifs || std::memcmp(magic, DELTA_MAGIC, sizeof(magic)) != 0 ||
+      version != DELTA_VERSION) {
+    throw std::invalid_argument(filename + " is not a delta file!");
+  }
+  ifs.read((char*)&m_, sizeof(int64_t));
+  ifs.read((char*)&n_, sizeof(int64_t));
+  ifs.read((char*)&count, sizeof(int64_t));
+  if (!ifs || m_ < 0 || n_ < 0 || count < 0 || count > m_) {
+    throw std::invalid_argument(filename + " has a corrupted header!");
+  }
+  ids_.resize(count);
+  values_.resize(count * n_);
+  ifs.read((char*)ids_.data(), count * sizeof(int64_t));
+  ifs.read((char*)values_.data(), values_.size() * sizeof(real));
+  if (!ifs) {
+    throw std::invalid_argument(filename + " is truncated!");
+  }
+  for (int64_t id : ids_) {
+    if (id < 0 || id >= m_) {
+      throw std::invalid_argument(filename + " holds an out of range row!");
+    }
+  }
+}
+
+void MatrixDelta::apply(Matrix& mat) const {
+  if (mat.rows() != m_ || mat.cols() != n_) {
+    throw std::invalid_argument(
+        "Delta of a " + std::to_string(m_) + " x " + std::to_string(n_) +
+        " matrix cannot be applied to a " + std::to_string(mat.rows()) +
+        " x " + std::to_string(mat.cols()) + " one!");
+  }
+  for (size_t k = 0; k < ids_.size(); k++) {
+    std::memcpy(mat.row(ids_[k]), values_.data() + k * n_, n_ * sizeof(real));
+  }
+}
+
+int64_t MatrixDelta::merge(
+    const std::string& base,
+    const std::vector<std::string>& deltas,
+    const std::string& output) {
+  cnpy::NpyArray arr = cnpy::npy_load(base);
+  if (arr.word_size != sizeof(real) || arr.fortran_order ||
+      arr.shape.size() != 2) {
+    throw std::invalid_argument(base + " is not a float32 matrix!");
+  }
+  Matrix mat(arr.shape[0], arr.shape[1]);
+  std::memcpy(mat.data(), arr.data<real>(), arr.num_bytes());
+  int64_t replaced = 0;
+  for (const auto& filename : deltas) {
+    MatrixDelta delta;
+    delta.load(filename);
+    delta.apply(mat);
+    replaced += delta.count();
+  }
+  cnpy::npy_save(
+      output, mat.data(), {size_t(mat.rows()), size_t(mat.cols())}, "w");
+  return replaced;
+}
+
+} // namespace uni_vec
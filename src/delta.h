@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "real.h"
+
+namespace uni_vec {
+
+/*
+ * Rows of a matrix that changed since an earlier snapshot:
+ *
+ *   magic "UVDELTA\0" | int32 version | int64 rows | int64 cols |
+ *   int64 count | count int64 row ids | count * cols reals
+ *
+ * rows and cols are the shape of the whole matrix, so that a delta is only
+ * ever applied to the matrix it was taken from. Deltas are applied in the
+ * order they were written.
+ */
+class MatrixDelta {
+ protected:
+  int64_t m_;
+  int64_t n_;
+  std::vector<int64_t> ids_;
+  std::vector<real> values_;
+
+ public:
+  MatrixDelta();
+
+  // Writes the given rows of a matrix.
+  static void save(const Matrix&, const std::vector<int64_t>&, const std::string&);
+
+  void load(const std::string&);
+  // Overwrites the stored rows of a matrix of the same shape.
+  void apply(Matrix&) const;
+
+  // Applies deltas in order to a float32 .npy snapshot and writes the
+  // result as .npy; returns the number of rows replaced.
+  static int64_t merge(
+      const std::string&,
+      const std::vector<std::string>&,
+      const std::string&);
+
+  inline int64_t rows() const {
+    return m_;
+  }
+  inline int64_t cols() const {
+    return n_;
+  }
+  inline int64_t count() const {
+    return ids_.size();
+  }
+};
+
+} // namespace uni_vec
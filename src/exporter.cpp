@@ -0,0 +1,195 @@
+#include "exporter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "cnpy/cnpy.h"
+
+namespace uni_vec {
+
+Exporter::Exporter(
+    const std::vector<export_format>& formats,
+    int32_t shards,
+    int32_t thread)
+    : formats_(formats),
+      shards_(std::max(1, shards)),
+      thread_(std::max(1, thread)) {}
+
+export_format Exporter::formatFromString(const std::string& name) {
+  if (name == "npy") {
+    return export_format::npy;
+  } else if (name == "txt") {
+    return export_format::txt;
+  } else if (name == "fp16") {
+    return export_format::fp16;
+  } else if (name == "int8") {
+    return export_format::int8;
+  }
+  throw std::invalid_argument("Unknown export format: " + name);
+}
+
+std::string Exporter::formatToString(export_format format) {
+  switch (format) {
+    case export_format::npy:
+      return "npy";
+    case export_format::txt:
+      return "txt";
+    case export_format::fp16:
+      return "fp16";
+    case export_format::int8:
+      return "int8";
+  }
+  return "Unknown format!"; // should never happen
+}
+
+std::vector<export_format> Exporter::formatsFromString(const std::string& names) {
+  std::vector<export_format> formats;
+  std::istringstream in(names);
+  std::string name;
+  while (std::getline(in, name, ',')) {
+    formats.push_back(formatFromString(name));
+  }
+  return formats;
+}
+
+void Exporter::add(const std::string& path, std::shared_ptr<const Matrix> mat) {
+  for (export_format format : formats_) {
+    entries_.push_back(Entry{path, mat, format, {}});
+  }
+}
+
+std::string Exporter::shardBase(const std::string& path, int32_t shard) const {
+  if (shards_ == 1) {
+    return path;
+  }
+  return path + ".part" + std::to_string(shard) + "-of-" + std::to_string(shards_);
+}
+
+std::vector<std::string> Exporter::write() {
+  struct Task {
+    Entry* entry;
+    std::string base;
+    int64_t begin;
+    int64_t end;
+    std::vector<std::string> files;
+  };
+  std::vector<Task> tasks;
+  for (auto& entry : entries_) {
+    const int64_t m = entry.mat->rows();
+    for (int32_t k = 0; k < shards_; k++) {
+      tasks.push_back(Task{&entry, shardBase(entry.path, k), k * m / shards_,
+                           (k + 1) * m / shards_, {}});
+    }
+  }
+
+  auto run = [this](Task& task) {
+    const Matrix& mat = *task.entry->mat;
+    switch (task.entry->format) {
+      case export_format::txt: {
+        std::ofstream ofs(task.base);
+        if (!ofs.is_open()) {
+          throw std::invalid_argument(task.base + " cannot be opened for saving vectors!");
+        }
+        mat.dump(ofs, task.begin, task.end, thread_);
+        task.files = {task.base};
+        break;
+      }
+      case export_format::npy: {
+        const size_t n = mat.cols();
+        cnpy::npy_save(
+            task.base + ".npy",
+            mat.data() + task.begin * n,
+            {size_t(task.end - task.begin), n},
+            "w");
+        task.files = {task.base + ".npy"};
+        break;
+      }
+      case export_format::fp16:
+      case export_format::int8:
+        task.files = CompactMatrix::save(
+            mat, task.begin, task.end, task.entry->format, task.base);
+        break;
+    }
+  };
+
+  // text formats its row blocks in parallel already
+  std::vector<Task*> binary;
+  for (auto& task : tasks) {
+    if (task.entry->format == export_format::txt) {
+      run(task);
+    } else {
+      binary.push_back(&task);
+    }
+  }
+  // largest files first so the last threads do not finish alone
+  std::sort(binary.begin(), binary.end(), [](const Task* a, const Task* b) {
+    return (a->end - a->begin) * a->entry->mat->cols() >
+        (b->end - b->begin) * b->entry->mat->cols();
+  });
+  std::atomic<size_t> next(0);
+  const int32_t nthreads = std::min<int32_t>(thread_, binary.size());
+  // an error of a worker stops them all and is rethrown here, an exception
+  // leaving a std::thread would terminate
+  std::vector<std::exception_ptr> errors(nthreads);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      try {
+        for (size_t i = next++; i < binary.size() && !failed; i = next++) {
+          run(*binary[i]);
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+        failed = true;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  std::vector<std::string> paths;
+  for (auto& entry : entries_) {
+    entry.files.clear();
+  }
+  for (const auto& task : tasks) {
+    for (const auto& file : task.files) {
+      task.entry->files.push_back(file);
+      paths.push_back(file);
+    }
+  }
+  return paths;
+}
+
+void Exporter::writeManifest(std::ostream& out) const {
+  auto basename = [](const std::string& path) {
+    size_t pos = path.find_last_of('/');
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+  };
+  out << "{\"version\":1,\"shards\":" << shards_ << ",\"matrices\":[";
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const Entry& e = entries_[i];
+    out << (i ? "," : "") << "\n  {\"name\":\"" << basename(e.path)
+        << "\",\"format\":\"" << formatToString(e.format)
+        << "\",\"rows\":" << e.mat->rows() << ",\"cols\":" << e.mat->cols()
+        << ",\"files\":[";
+    for (size_t j = 0; j < e.files.size(); j++) {
+      out << (j ? "," : "") << "\"" << basename(e.files[j]) << "\"";
+    }
+    out << "]}";
+  }
+  out << "\n]}" << std::endl;
+}
+
+} // namespace uni_vec
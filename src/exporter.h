@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compact.h"
+#include "matrix.h"
+
+namespace uni_vec {
+
+/*
+ * Writes a set of matrices in one or more formats, each optionally split
+ * into row shards. Binary files are written concurrently, one (matrix,
+ * format, shard) per thread; text is written one file at a time with its
+ * row blocks formatted in parallel. With N > 1 shards every file name gets
+ * a .part<k>-of-<N> infix holding rows [k * m / N, (k + 1) * m / N).
+ */
+class Exporter {
+ protected:
+  struct Entry {
+    std::string path;
+    std::shared_ptr<const Matrix> mat;
+    export_format format;
+    std::vector<std::string> files;
+  };
+
+  std::vector<export_format> formats_;
+  int32_t shards_;
+  int32_t thread_;
+  std::vector<Entry> entries_;
+
+  std::string shardBase(const std::string&, int32_t) const;
+
+ public:
+  Exporter(const std::vector<export_format>&, int32_t, int32_t);
+
+  // path without any format suffix
+  void add(const std::string&, std::shared_ptr<const Matrix>);
+  // Writes every added matrix and returns the files written.
+  std::vector<std::string> write();
+  // JSON description of the files of the last write().
+  void writeManifest(std::ostream&) const;
+
+  static export_format formatFromString(const std::string&);
+  static std::string formatToString(export_format);
+  // comma separated list, e.g. "npy,fp16,int8"
+  static std::vector<export_format> formatsFromString(const std::string&);
+};
+
+} // namespace uni_vec
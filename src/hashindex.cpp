@@ -0,0 +1,348 @@
+#include "hashindex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "kernel.h"
+
+#if defined(__AVX512VPOPCNTDQ__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+namespace uni_vec {
+
+namespace {
+
+const char kHashMagic[8] = {'U', 'V', 'H', 'A', 'S', 'H', '\0', '\0'};
+
+// rows hashed by a thread at a time
+const int64_t HASH_CHUNK = 4096;
+// queries of a block share every tile of codes, tiles of 128KB stay in L2
+// while the block is scanned; distances are checked against the cutoffs
+// SELECT_CHUNK at a time
+const int64_t QUERY_BLOCK = 64;
+const int64_t TILE_BYTES = 128 << 10;
+const int64_t SELECT_CHUNK = 32;
+
+// Bit j set if d[j] < cutoff, for the SELECT_CHUNK distances from d.
+inline uint32_t below(const uint16_t* d, int32_t cutoff) {
+#if defined(__AVX512BW__)
+  return _mm512_cmplt_epu16_mask(
+      _mm512_loadu_si512(d), _mm512_set1_epi16(static_cast<short>(cutoff)));
+#else
+  uint32_t mask = 0;
+  for (int64_t j = 0; j < SELECT_CHUNK; j++) {
+    mask |= uint32_t(d[j] < cutoff) << j;
+  }
+  return mask;
+#endif
+}
+
+// Keeps the keep rows of smallest distance, the first ones among ties, in
+// their order, and returns the distance a later row must be below to be
+// nearer than one of them. Distances are small integers, they are counted
+// into counts, no sort.
+int32_t trim(
+    std::vector<std::pair<int32_t, int64_t>>& rows,
+    int64_t keep,
+    std::vector<int64_t>& counts) {
+  std::fill(counts.begin(), counts.end(), 0);
+  for (const auto& r : rows) {
+    counts[r.first]++;
+  }
+  int32_t cutoff = 0;
+  int64_t nearer = 0;
+  while (nearer + counts[cutoff] < keep) {
+    nearer += counts[cutoff++];
+  }
+  int64_t ties = keep - nearer;
+  int64_t kept = 0;
+  for (const auto& r : rows) {
+    if (r.first < cutoff || (r.first == cutoff && ties-- > 0)) {
+      rows[kept++] = r;
+    }
+  }
+  rows.resize(kept);
+  return cutoff;
+}
+
+} // namespace
+
+HashIndex::HashIndex(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim)
+    : base_(base),
+      offset_(offset),
+      dim_(dim),
+      n_(base->rows()),
+      bits_(0),
+      words_(0) {
+  if (offset < 0 || dim <= 0 || offset + dim > base->cols()) {
+    throw std::invalid_argument("Columns out of the range of the matrix.");
+  }
+}
+
+void HashIndex::hash(const real* x, real extra, uint64_t* code) const {
+  std::fill(code, code + words_, 0);
+  for (int32_t b = 0; b < bits_; b++) {
+    const real* projection = projections_.data() + b * (dim_ + 1);
+    const real s = kernel::dot<0>(projection, x, dim_) + projection[dim_] * extra;
+    if (s > 0) {
+      code[b / 64] |= uint64_t(1) << (b % 64);
+    }
+  }
+}
+
+void HashIndex::build(int32_t bits, int32_t seed, int32_t thread) {
+  if (bits < 1) {
+    throw std::invalid_argument("A hash needs at least one bit.");
+  }
+  words_ = (bits + 63) / 64;
+  bits_ = words_ * 64;
+
+  std::mt19937_64 rng(seed);
+  std::normal_distribution<real> normal(0.0, 1.0);
+  projections_.resize(bits_ * (dim_ + 1));
+  for (auto& v : projections_) {
+    v = normal(rng);
+  }
+
+  // norm augmentation
+  real maxNorm2 = 0.0;
+  for (int64_t i = 0; i < n_; i++) {
+    maxNorm2 = std::max(maxNorm2, kernel::dot<0>(vec(i), vec(i), dim_));
+  }
+
+  const int64_t panels = (n_ + PANEL - 1) / PANEL;
+  codes_.assign(panels * words_ * PANEL, 0);
+  const int64_t chunks = (n_ + HASH_CHUNK - 1) / HASH_CHUNK;
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    std::vector<uint64_t> code(words_);
+    for (int64_t c = next++; c < chunks; c = next++) {
+      const int64_t end = std::min(n_, (c + 1) * HASH_CHUNK);
+      for (int64_t i = c * HASH_CHUNK; i < end; i++) {
+        const real norm2 = kernel::dot<0>(vec(i), vec(i), dim_);
+        hash(vec(i), std::sqrt(std::max<real>(0.0, maxNorm2 - norm2)), code.data());
+        uint64_t* panel = codes_.data() + (i / PANEL) * words_ * PANEL;
+        for (int64_t w = 0; w < words_; w++) {
+          panel[w * PANEL + i % PANEL] = code[w];
+        }
+      }
+    }
+  };
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, chunks));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+}
+
+void HashIndex::save(const std::string& filename) const {
+  if (codes_.empty()) {
+    throw std::logic_error("The index has not been built.");
+  }
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for saving!");
+  }
+  const uint32_t version = VERSION;
+  const int64_t cols = base_->cols();
+  ofs.write(kHashMagic, sizeof(kHashMagic));
+  ofs.write((char*)&version, sizeof(uint32_t));
+  ofs.write((char*)&bits_, sizeof(int32_t));
+  ofs.write((char*)&n_, sizeof(int64_t));
+  ofs.write((char*)&cols, sizeof(int64_t));
+  ofs.write((char*)&offset_, sizeof(int64_t));
+  ofs.write((char*)&dim_, sizeof(int64_t));
+  ofs.write((char*)projections_.data(), projections_.size() * sizeof(real));
+  ofs.write((char*)codes_.data(), codes_.size() * sizeof(uint64_t));
+  if (!ofs) {
+    throw std::runtime_error(filename + " could not be written completely!");
+  }
+}
+
+void HashIndex::load(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for loading!");
+  }
+  char magic[sizeof(kHashMagic)];
+  uint32_t version = 0;
+  int32_t bits = 0;
+  int64_t rows = 0, cols = 0, offset = 0, dim = 0;
+  ifs.read(magic, sizeof(magic));
+  ifs.read((char*)&version, sizeof(uint32_t));
+  if (!ifs || std::memcmp(magic, kHashMagic, sizeof(magic)) != 0 ||
+      version != VERSION) {
+    throw std::invalid_argument(filename + " is not a hash index!");
+  }
+  ifs.read((char*)&bits, sizeof(int32_t));
+  ifs.read((char*)&rows, sizeof(int64_t));
+  ifs.read((char*)&cols, sizeof(int64_t));
+  ifs.read((char*)&offset, sizeof(int64_t));
+  ifs.read((char*)&dim, sizeof(int64_t));
+  if (rows != n_ || cols != base_->cols() || offset != offset_ || dim != dim_) {
+    throw std::invalid_argument(
+        filename + " was built for other vectors than those of the model!");
+  }
+  if (!ifs || bits <= 0 || bits % 64 != 0) {
+    throw std::invalid_argument(filename + " has a corrupted header!");
+  }
+  bits_ = bits;
+  words_ = bits / 64;
+  projections_.resize(bits_ * (dim_ + 1));
+  codes_.resize((n_ + PANEL - 1) / PANEL * words_ * PANEL);
+  ifs.read((char*)projections_.data(), projections_.size() * sizeof(real));
+  ifs.read((char*)codes_.data(), codes_.size() * sizeof(uint64_t));
+  if (!ifs) {
+    throw std::invalid_argument(filename + " is truncated or corrupted!");
+  }
+}
+
+bool HashIndex::isHashIndex(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  char magic[sizeof(kHashMagic)];
+  return ifs.read(magic, sizeof(magic)) &&
+      std::memcmp(magic, kHashMagic, sizeof(magic)) == 0;
+}
+
+void HashIndex::distances(
+    const uint64_t* query,
+    int64_t begin,
+    int64_t end,
+    uint16_t* out) const {
+  for (int64_t p = begin; p < end; p++) {
+    const uint64_t* panel = codes_.data() + p * words_ * PANEL;
+    uint16_t* d = out + (p - begin) * PANEL;
+#if defined(__AVX512VPOPCNTDQ__)
+    __m512i acc = _mm512_setzero_si512();
+    for (int64_t w = 0; w < words_; w++) {
+      const __m512i x = _mm512_xor_si512(
+          _mm512_loadu_si512(panel + w * PANEL),
+          _mm512_set1_epi64(static_cast<long long>(query[w])));
+      acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+    _mm512_mask_cvtepi64_storeu_epi16(d, 0xff, acc);
+#else
+    int32_t acc[PANEL] = {};
+    for (int64_t w = 0; w < words_; w++) {
+      for (int64_t r = 0; r < PANEL; r++) {
+        acc[r] += __builtin_popcountll(panel[w * PANEL + r] ^ query[w]);
+      }
+    }
+    std::copy(acc, acc + PANEL, d);
+#endif
+  }
+}
+
+std::vector<std::vector<ScoredId>> HashIndex::search(
+    const real* queries,
+    int64_t nq,
+    int32_t k,
+    int32_t shortlist,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  if (codes_.empty()) {
+    throw std::logic_error("The index has not been built.");
+  }
+  const int64_t keep = std::max(k, shortlist);
+  const int64_t panels = (n_ + PANEL - 1) / PANEL;
+  const int64_t tilePanels =
+      std::max<int64_t>(1, TILE_BYTES / (words_ * PANEL * sizeof(uint64_t)));
+  const int64_t blocks = (nq + QUERY_BLOCK - 1) / QUERY_BLOCK;
+  std::vector<std::vector<ScoredId>> results(nq);
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    std::vector<uint64_t> qcodes(QUERY_BLOCK * words_);
+    // rounded up to whole chunks, the rows past a tile never below a cutoff
+    std::vector<uint16_t> dist(
+        (tilePanels * PANEL + SELECT_CHUNK - 1) / SELECT_CHUNK * SELECT_CHUNK);
+    // (distance, row) of the rows kept for every query of a block
+    std::vector<std::vector<std::pair<int32_t, int64_t>>> kept(QUERY_BLOCK);
+    std::vector<int32_t> cutoffs(QUERY_BLOCK);
+    std::vector<int64_t> counts(bits_ + 1);
+    for (int64_t blk = next++; blk < blocks; blk = next++) {
+      const int64_t begin = blk * QUERY_BLOCK;
+      const int64_t nb = std::min(QUERY_BLOCK, nq - begin);
+      for (int64_t q = 0; q < nb; q++) {
+        // queries are augmented with 0
+        hash(queries + (begin + q) * dim_, 0.0, qcodes.data() + q * words_);
+        kept[q].clear();
+        cutoffs[q] = bits_ + 1;
+      }
+
+      for (int64_t t = 0; t < panels; t += tilePanels) {
+        const int64_t te = std::min(panels, t + tilePanels);
+        // the padding rows of the last panel are never candidates
+        const int64_t nt = std::min(n_, te * PANEL) - t * PANEL;
+        for (int64_t q = 0; q < nb; q++) {
+          distances(qcodes.data() + q * words_, t, te, dist.data());
+          std::fill(dist.begin() + nt, dist.end(), UINT16_MAX);
+          const std::vector<int64_t>* ban =
+              bans.empty() ? nullptr : &bans[begin + q];
+          auto& rows = kept[q];
+          int32_t& cutoff = cutoffs[q];
+          for (int64_t c = 0; c < nt; c += SELECT_CHUNK) {
+            // most chunks hold no candidate, one compare rejects them
+            for (uint32_t m = below(dist.data() + c, cutoff); m != 0;
+                 m &= m - 1) {
+              const int64_t j = c + __builtin_ctz(m);
+              const int64_t row = t * PANEL + j;
+              if (dist[j] >= cutoff ||
+                  (ban && std::binary_search(ban->begin(), ban->end(), row))) {
+                continue;
+              }
+              rows.emplace_back(dist[j], row);
+              // distances are small integers with many ties, a heap would be
+              // pushed to on every tie; rows are rather buffered and the
+              // keep nearest selected once the buffer is full
+              if (int64_t(rows.size()) == 2 * keep) {
+                cutoff = trim(rows, keep, counts);
+              }
+            }
+          }
+        }
+      }
+      for (int64_t q = 0; q < nb; q++) {
+        const real* x = queries + (begin + q) * dim_;
+        auto& rows = kept[q];
+        if (int64_t(rows.size()) > keep) {
+          trim(rows, keep, counts);
+        }
+        TopK exact(k);
+        for (const auto& p : rows) {
+          exact.push(kernel::dot<0>(vec(p.second), x, dim_), p.second);
+        }
+        results[begin + q] = exact.take();
+      }
+    }
+  };
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, blocks));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return results;
+}
+
+} // namespace uni_vec
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "neighbors.h"
+#include "real.h"
+
+namespace uni_vec {
+
+/*
+ * Binary hash prefilter for maximum inner product search over columns
+ * [offset, offset + dim) of the rows of a matrix. Rows are norm augmented
+ * as for HNSW, [x ; sqrt(M^2 - |x|^2)] with M the largest norm, so that the
+ * angle to a query [q ; 0] orders them as the inner product does, and
+ * hashed to the signs of bits Gaussian random projections: the Hamming
+ * distance of two codes estimates the angle of their vectors.
+ *
+ * A query is hashed the same way and the codes of all rows are scanned by
+ * XOR and popcount, bits / 8 bytes a row instead of 4 dim, in panels of
+ * PANEL rows whose words are interleaved so that AVX-512 VPOPCNTDQ counts a
+ * word of the whole panel at once. The shortlist rows of smallest distance
+ * are then scored exactly against the matrix.
+ */
+class HashIndex {
+ public:
+  static const int64_t PANEL = 8;
+
+ protected:
+  std::shared_ptr<const Matrix> base_;
+  int64_t offset_;
+  int64_t dim_;
+  int64_t n_;
+  int32_t bits_;
+  // 64 bit words of a code
+  int64_t words_;
+  // bits x (dim + 1), the last column for the augmented one
+  std::vector<real> projections_;
+  // panel p, word w, row r of the panel at (p * words_ + w) * PANEL + r,
+  // zero past n
+  std::vector<uint64_t> codes_;
+
+  inline const real* vec(int64_t i) const {
+    return base_->row(i) + offset_;
+  }
+
+  // Code of x augmented with extra, in words_ words.
+  void hash(const real*, real, uint64_t*) const;
+  // Hamming distances of the rows of panels [begin, end) to a query code.
+  void distances(const uint64_t*, int64_t, int64_t, uint16_t*) const;
+
+ public:
+  HashIndex(std::shared_ptr<const Matrix>, int64_t, int64_t);
+
+  // Codes of bits bits, rounded up to a multiple of 64, from projections
+  // drawn from seed, hashed on thread threads.
+  void build(int32_t, int32_t, int32_t);
+  void save(const std::string&) const;
+  // Loads an index saved for the same rows and columns of the matrix.
+  void load(const std::string&);
+
+  inline int32_t bits() const {
+    return bits_;
+  }
+
+  // Same as ExactSearch::search, approximate: the best k among the
+  // max(k, shortlist) rows nearest in Hamming distance, scored exactly.
+  std::vector<std::vector<ScoredId>> search(
+      const real*,
+      int64_t,
+      int32_t,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+
+  // True if the file starts with the magic of this format.
+  static bool isHashIndex(const std::string&);
+
+  static const uint32_t VERSION = 1;
+};
+
+} // namespace uni_vec
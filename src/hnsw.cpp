@@ -0,0 +1,488 @@
+#include "hnsw.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include "kernel.h"
+
+namespace uni_vec {
+
+namespace {
+
+const char kHnswMagic[8] = {'U', 'V', 'H', 'N', 'S', 'W', '\0', '\0'};
+const uint64_t kHnswAlignment = 64;
+const int32_t kMaxLevel = 30;
+
+uint64_t alignUp(uint64_t x, uint64_t a) {
+  return (x + a - 1) / a * a;
+}
+
+} // namespace
+
+HnswIndex::HnswIndex(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim)
+    : base_(base),
+      offset_(offset),
+      dim_(dim),
+      n_(base->rows()),
+      M_(0),
+      M0_(0),
+      maxLevel_(-1),
+      entry_(-1),
+      maxNorm_(0.0),
+      upperBlocks_(0),
+      levels_(nullptr),
+      upperStart_(nullptr),
+      extra_(nullptr),
+      layer0_(nullptr),
+      upper_(nullptr) {
+  if (offset < 0 || dim <= 0 || offset + dim > base->cols()) {
+    throw std::invalid_argument("Columns out of the range of the matrix.");
+  }
+}
+
+inline real HnswIndex::similarity(const real* q, real qExtra, int64_t i) const {
+  return kernel::dot<0>(q, vec(i), dim_) + qExtra * extra_[i];
+}
+
+void HnswIndex::readLinks(
+    int64_t i,
+    int32_t level,
+    std::vector<int32_t>& out) const {
+  const int32_t* l = links(i, level);
+  if (locks_) {
+    std::lock_guard<std::mutex> guard(lockOf(i));
+    out.assign(l + 1, l + 1 + l[0]);
+  } else {
+    out.assign(l + 1, l + 1 + l[0]);
+  }
+}
+
+HnswIndex::Candidate HnswIndex::greedy(
+    const real* q,
+    real qExtra,
+    Candidate cur,
+    int32_t level) const {
+  std::vector<int32_t> neighbors;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    readLinks(cur.second, level, neighbors);
+    for (int32_t nb : neighbors) {
+      real s = similarity(q, qExtra, nb);
+      if (s > cur.first) {
+        cur = Candidate(s, nb);
+        changed = true;
+      }
+    }
+  }
+  return cur;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::searchLayer(
+    const real* q,
+    real qExtra,
+    const std::vector<Candidate>& entries,
+    int32_t ef,
+    int32_t level,
+    Visited& visited) const {
+  visited.reset();
+  // best candidate first / worst kept result first
+  std::priority_queue<Candidate> candidates;
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>
+      found;
+  for (const auto& e : entries) {
+    if (visited.visit(e.second)) {
+      candidates.push(e);
+      found.push(e);
+    }
+  }
+  while (int32_t(found.size()) > ef) {
+    found.pop();
+  }
+  std::vector<int32_t> neighbors;
+  while (!candidates.empty()) {
+    const Candidate c = candidates.top();
+    if (int32_t(found.size()) >= ef && c.first < found.top().first) {
+      break;
+    }
+    candidates.pop();
+    readLinks(c.second, level, neighbors);
+    for (size_t j = 0; j < neighbors.size(); j++) {
+      if (j + 1 < neighbors.size()) {
+        __builtin_prefetch(vec(neighbors[j + 1]));
+      }
+      const int32_t nb = neighbors[j];
+      if (!visited.visit(nb)) {
+        continue;
+      }
+      real s = similarity(q, qExtra, nb);
+      if (int32_t(found.size()) < ef || s > found.top().first) {
+        candidates.push(Candidate(s, nb));
+        found.push(Candidate(s, nb));
+        if (int32_t(found.size()) > ef) {
+          found.pop();
+        }
+      }
+    }
+  }
+  std::vector<Candidate> result(found.size());
+  for (size_t j = result.size(); j > 0; j--) {
+    result[j - 1] = found.top();
+    found.pop();
+  }
+  return result;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::selectNeighbors(
+    std::vector<Candidate> candidates,
+    int32_t m) const {
+  // keep a candidate only if it is closer to the row being linked than to
+  // every neighbour kept so far, which spreads the links out
+  std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+  std::vector<Candidate> selected;
+  for (const auto& c : candidates) {
+    if (int32_t(selected.size()) >= m) {
+      break;
+    }
+    bool keep = true;
+    for (const auto& r : selected) {
+      if (similarity(vec(c.second), extra_[c.second], r.second) > c.first) {
+        keep = false;
+        break;
+      }
+    }
+    if (keep) {
+      selected.push_back(c);
+    }
+  }
+  return selected;
+}
+
+void HnswIndex::connect(
+    int64_t i,
+    int32_t level,
+    const std::vector<Candidate>& found) {
+  const int32_t maxM = level == 0 ? M0_ : M_;
+  std::vector<Candidate> candidates;
+  for (const auto& c : found) {
+    if (c.second != i) {
+      candidates.push_back(c);
+    }
+  }
+  const std::vector<Candidate> selected = selectNeighbors(candidates, M_);
+  {
+    std::lock_guard<std::mutex> guard(lockOf(i));
+    int32_t* l = links(i, level);
+    l[0] = selected.size();
+    for (size_t j = 0; j < selected.size(); j++) {
+      l[1 + j] = selected[j].second;
+    }
+  }
+  for (const auto& s : selected) {
+    const int64_t e = s.second;
+    std::lock_guard<std::mutex> guard(lockOf(e));
+    int32_t* l = links(e, level);
+    if (l[0] < maxM) {
+      l[1 + l[0]] = i;
+      l[0]++;
+      continue;
+    }
+    // full: keep the best links of the old ones and i, seen from e
+    std::vector<Candidate> pool;
+    pool.emplace_back(s.first, i);
+    for (int32_t j = 0; j < l[0]; j++) {
+      pool.emplace_back(similarity(vec(e), extra_[e], l[1 + j]), l[1 + j]);
+    }
+    const std::vector<Candidate> kept = selectNeighbors(pool, maxM);
+    l[0] = kept.size();
+    for (size_t j = 0; j < kept.size(); j++) {
+      l[1 + j] = kept[j].second;
+    }
+  }
+}
+
+void HnswIndex::insert(int64_t i, int32_t efConstruction, Visited& visited) {
+  const int32_t level = levels_[i];
+  std::unique_lock<std::mutex> entryGuard(entryLock_);
+  if (entry_ < 0) {
+    entry_ = i;
+    maxLevel_ = level;
+    return;
+  }
+  const int32_t top = maxLevel_;
+  const int64_t entry = entry_;
+  // a row that becomes the new entry point is linked under the lock
+  if (level <= top) {
+    entryGuard.unlock();
+  }
+  const real* q = vec(i);
+  const real qExtra = extra_[i];
+  Candidate cur(similarity(q, qExtra, entry), entry);
+  for (int32_t lev = top; lev > level; lev--) {
+    cur = greedy(q, qExtra, cur, lev);
+  }
+  std::vector<Candidate> entries = {cur};
+  for (int32_t lev = std::min(level, top); lev >= 0; lev--) {
+    std::vector<Candidate> found =
+        searchLayer(q, qExtra, entries, efConstruction, lev, visited);
+    connect(i, lev, found);
+    entries.swap(found);
+  }
+  if (level > top) {
+    entry_ = i;
+    maxLevel_ = level;
+  }
+}
+
+void HnswIndex::build(
+    int32_t M,
+    int32_t efConstruction,
+    int32_t seed,
+    int32_t thread) {
+  if (M < 2) {
+    throw std::invalid_argument("HNSW needs at least 2 links per row.");
+  }
+  M_ = M;
+  M0_ = 2 * M;
+  file_.reset();
+
+  // norm augmentation
+  std::vector<real> norms(n_);
+  real maxNorm2 = 0.0;
+  for (int64_t i = 0; i < n_; i++) {
+    norms[i] = kernel::dot<0>(vec(i), vec(i), dim_);
+    maxNorm2 = std::max(maxNorm2, norms[i]);
+  }
+  maxNorm_ = std::sqrt(maxNorm2);
+  extraStore_.resize(n_);
+  for (int64_t i = 0; i < n_; i++) {
+    extraStore_[i] = std::sqrt(std::max<real>(0.0, maxNorm2 - norms[i]));
+  }
+
+  // levels are drawn up front, so the layout of the links is fixed
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const double mult = 1.0 / std::log(double(M_));
+  levelStore_.resize(n_);
+  upperStartStore_.resize(n_);
+  upperBlocks_ = 0;
+  for (int64_t i = 0; i < n_; i++) {
+    levelStore_[i] = std::min<int32_t>(
+        kMaxLevel, int32_t(-std::log(1.0 - uniform(rng)) * mult));
+    upperStartStore_[i] = upperBlocks_;
+    upperBlocks_ += levelStore_[i];
+  }
+  layer0Store_.assign(n_ * (1 + M0_), 0);
+  upperStore_.assign(upperBlocks_ * (1 + M_), 0);
+  levels_ = levelStore_.data();
+  upperStart_ = upperStartStore_.data();
+  extra_ = extraStore_.data();
+  layer0_ = layer0Store_.data();
+  upper_ = upperStore_.data();
+  entry_ = -1;
+  maxLevel_ = -1;
+
+  locks_.reset(new std::mutex[LOCK_STRIPES]);
+  std::atomic<int64_t> next(0);
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < std::max(1, thread); t++) {
+    threads.push_back(std::thread([&]() {
+      Visited visited(n_);
+      for (int64_t i = next++; i < n_; i = next++) {
+        insert(i, efConstruction, visited);
+      }
+    }));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  locks_.reset();
+}
+
+void HnswIndex::layout(std::vector<uint64_t>& offsets) const {
+  const uint64_t sizes[] = {
+      n_ * sizeof(int32_t),
+      n_ * sizeof(int64_t),
+      n_ * sizeof(real),
+      n_ * (1 + M0_) * sizeof(int32_t),
+      upperBlocks_ * (1 + M_) * sizeof(int32_t)};
+  offsets.assign(1, alignUp(sizeof(Header), kHnswAlignment));
+  for (uint64_t size : sizes) {
+    offsets.push_back(alignUp(offsets.back() + size, kHnswAlignment));
+  }
+}
+
+void HnswIndex::save(const std::string& filename) const {
+  if (!levels_) {
+    throw std::logic_error("The index has not been built.");
+  }
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kHnswMagic, sizeof(kHnswMagic));
+  header.version = VERSION;
+  header.M = M_;
+  header.M0 = M0_;
+  header.maxLevel = maxLevel_;
+  header.entry = entry_;
+  header.rows = n_;
+  header.cols = base_->cols();
+  header.offset = offset_;
+  header.dim = dim_;
+  header.upperBlocks = upperBlocks_;
+  header.maxNorm = maxNorm_;
+
+  std::vector<uint64_t> offsets;
+  layout(offsets);
+  const char* payload[] = {
+      reinterpret_cast<const char*>(levels_),
+      reinterpret_cast<const char*>(upperStart_),
+      reinterpret_cast<const char*>(extra_),
+      reinterpret_cast<const char*>(layer0_),
+      reinterpret_cast<const char*>(upper_)};
+  const uint64_t bytes[] = {
+      n_ * sizeof(int32_t),
+      n_ * sizeof(int64_t),
+      n_ * sizeof(real),
+      n_ * (1 + M0_) * sizeof(int32_t),
+      upperBlocks_ * (1 + M_) * sizeof(int32_t)};
+
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for saving!");
+  }
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  const std::vector<char> zeros(kHnswAlignment, 0);
+  uint64_t pos = sizeof(header);
+  for (size_t i = 0; i < 5; i++) {
+    ofs.write(zeros.data(), offsets[i] - pos);
+    ofs.write(payload[i], bytes[i]);
+    pos = offsets[i] + bytes[i];
+  }
+  ofs.write(zeros.data(), offsets[5] - pos);
+  if (!ofs) {
+    throw std::runtime_error(filename + " could not be written completely!");
+  }
+}
+
+void HnswIndex::load(const std::string& filename) {
+  auto file = std::make_shared<MappedFile>(filename);
+  if (file->size() < sizeof(Header)) {
+    throw std::invalid_argument(filename + " is not an HNSW index!");
+  }
+  const Header* header = reinterpret_cast<const Header*>(file->data());
+  if (std::memcmp(header->magic, kHnswMagic, sizeof(kHnswMagic)) != 0 ||
+      header->version != VERSION) {
+    throw std::invalid_argument(filename + " is not an HNSW index!");
+  }
+  if (header->rows != n_ || header->cols != base_->cols() ||
+      header->offset != offset_ || header->dim != dim_) {
+    throw std::invalid_argument(
+        filename + " was built for other vectors than those of the model!");
+  }
+  M_ = header->M;
+  M0_ = header->M0;
+  maxLevel_ = header->maxLevel;
+  entry_ = header->entry;
+  maxNorm_ = header->maxNorm;
+  upperBlocks_ = header->upperBlocks;
+  std::vector<uint64_t> offsets;
+  layout(offsets);
+  if (file->size() < offsets[5] || entry_ >= n_ || maxLevel_ > kMaxLevel) {
+    throw std::invalid_argument(filename + " is truncated or corrupted!");
+  }
+  const char* data = file->data();
+  levels_ = reinterpret_cast<const int32_t*>(data + offsets[0]);
+  upperStart_ = reinterpret_cast<const int64_t*>(data + offsets[1]);
+  extra_ = reinterpret_cast<const real*>(data + offsets[2]);
+  // never written once mapped, the mapping is read-only
+  layer0_ = const_cast<int32_t*>(reinterpret_cast<const int32_t*>(data + offsets[3]));
+  upper_ = const_cast<int32_t*>(reinterpret_cast<const int32_t*>(data + offsets[4]));
+  levelStore_.clear();
+  upperStartStore_.clear();
+  extraStore_.clear();
+  layer0Store_.clear();
+  upperStore_.clear();
+  file_ = file;
+}
+
+std::unique_ptr<HnswIndex::Visited> HnswIndex::acquireVisited() const {
+  std::unique_ptr<Visited> visited;
+  {
+    std::lock_guard<std::mutex> lock(visitedLock_);
+    if (!visitedPool_.empty()) {
+      visited = std::move(visitedPool_.back());
+      visitedPool_.pop_back();
+    }
+  }
+  // sets of an index since rebuilt or reloaded over other rows are dropped
+  if (!visited || int64_t(visited->marks.size()) != n_) {
+    visited.reset(new Visited(n_));
+  }
+  return visited;
+}
+
+void HnswIndex::releaseVisited(std::unique_ptr<Visited> visited) const {
+  std::lock_guard<std::mutex> lock(visitedLock_);
+  visitedPool_.push_back(std::move(visited));
+}
+
+std::vector<std::vector<ScoredId>> HnswIndex::search(
+    const real* queries,
+    int64_t nq,
+    int32_t k,
+    int32_t ef,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  std::vector<std::vector<ScoredId>> results(nq);
+  if (entry_ < 0) {
+    return results;
+  }
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    std::unique_ptr<Visited> pooled = acquireVisited();
+    Visited& visited = *pooled;
+    for (int64_t q = next++; q < nq; q = next++) {
+      const real* x = queries + q * dim_;
+      const int32_t kq = k + (bans.empty() ? 0 : bans[q].size());
+      // queries are augmented with 0, the similarity is the inner product
+      Candidate cur(similarity(x, 0.0, entry_), entry_);
+      for (int32_t lev = maxLevel_; lev > 0; lev--) {
+        cur = greedy(x, 0.0, cur, lev);
+      }
+      for (const auto& c : searchLayer(x, 0.0, {cur}, std::max(ef, kq), 0, visited)) {
+        if (int32_t(results[q].size()) == k) {
+          break;
+        }
+        if (bans.empty() ||
+            !std::binary_search(bans[q].begin(), bans[q].end(), int64_t(c.second))) {
+          results[q].emplace_back(c.first, c.second);
+        }
+      }
+    }
+    releaseVisited(std::move(pooled));
+  };
+  const int32_t nthreads = std::max<int64_t>(1, std::min<int64_t>(thread, nq));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return results;
+}
+
+} // namespace uni_vec
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedModel.h"
+#include "matrix.h"
+#include "neighbors.h"
+#include "real.h"
+
+namespace uni_vec {
+
+/*
+ * HNSW graph for maximum inner product search over columns
+ * [offset, offset + dim) of the rows of a matrix. Inner product is not a
+ * metric, so every row x is augmented to [x ; sqrt(maxNorm^2 - |x|^2)] and
+ * queries to [q ; 0]: all augmented rows have the same norm, L2 order on
+ * them is the inner product order, and q.x is unchanged. Only the extra
+ * coordinate is stored, the rows stay in the matrix.
+ *
+ * The graph is kept in flat arrays, written to disk as they are and mapped
+ * back without parsing:
+ *
+ *   header | levels | upper block start | extra coordinate |
+ *   layer 0 links, 1 + M0 per row | upper links, 1 + M per block
+ *
+ * every link list being a count followed by row ids.
+ */
+class HnswIndex {
+ public:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    int32_t M;
+    int32_t M0;
+    int32_t maxLevel;
+    int64_t entry;
+    int64_t rows;
+    int64_t cols;
+    int64_t offset;
+    int64_t dim;
+    int64_t upperBlocks;
+    real maxNorm;
+    uint32_t reserved;
+  };
+
+ protected:
+  typedef std::pair<real, int32_t> Candidate;
+
+  // reused marks of visited rows, one set per searching thread
+  struct Visited {
+    std::vector<uint32_t> marks;
+    uint32_t tag;
+    explicit Visited(int64_t n) : marks(n, 0), tag(0) {}
+    inline void reset() {
+      if (++tag == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        tag = 1;
+      }
+    }
+    inline bool visit(int64_t i) {
+      if (marks[i] == tag) {
+        return false;
+      }
+      marks[i] = tag;
+      return true;
+    }
+  };
+
+  std::shared_ptr<const Matrix> base_;
+  int64_t offset_;
+  int64_t dim_;
+  int64_t n_;
+  int32_t M_;
+  int32_t M0_;
+  int32_t maxLevel_;
+  int64_t entry_;
+  real maxNorm_;
+  int64_t upperBlocks_;
+
+  // owned by a built index, empty when the file is mapped
+  std::vector<int32_t> levelStore_;
+  std::vector<int64_t> upperStartStore_;
+  std::vector<real> extraStore_;
+  std::vector<int32_t> layer0Store_;
+  std::vector<int32_t> upperStore_;
+  std::shared_ptr<const MappedFile> file_;
+
+  const int32_t* levels_;
+  const int64_t* upperStart_;
+  const real* extra_;
+  int32_t* layer0_;
+  int32_t* upper_;
+
+  // only while building: striped row locks and the entry point lock
+  std::unique_ptr<std::mutex[]> locks_;
+  std::mutex entryLock_;
+  // visited sets of finished searches, reused by later ones so that a small
+  // search does not clear n_ marks before its first query
+  mutable std::mutex visitedLock_;
+  mutable std::vector<std::unique_ptr<Visited>> visitedPool_;
+
+  inline int32_t* links(int64_t i, int32_t level) const {
+    return level == 0 ? layer0_ + i * (1 + M0_)
+                      : upper_ + (upperStart_[i] + level - 1) * (1 + M_);
+  }
+  inline const real* vec(int64_t i) const {
+    return base_->row(i) + offset_;
+  }
+  // inner product of the augmented vectors
+  inline real similarity(const real* q, real qExtra, int64_t i) const;
+  inline std::mutex& lockOf(int64_t i) const {
+    return locks_[i & (LOCK_STRIPES - 1)];
+  }
+
+  std::vector<Candidate> searchLayer(
+      const real*,
+      real,
+      const std::vector<Candidate>&,
+      int32_t,
+      int32_t,
+      Visited&) const;
+  void readLinks(int64_t, int32_t, std::vector<int32_t>&) const;
+  Candidate greedy(const real*, real, Candidate, int32_t) const;
+  std::vector<Candidate> selectNeighbors(std::vector<Candidate>, int32_t) const;
+  void connect(int64_t, int32_t, const std::vector<Candidate>&);
+  void insert(int64_t, int32_t, Visited&);
+  // A visited set of n_ rows from the pool, or a new one.
+  std::unique_ptr<Visited> acquireVisited() const;
+  void releaseVisited(std::unique_ptr<Visited>) const;
+  void layout(std::vector<uint64_t>&) const;
+
+  static const int64_t LOCK_STRIPES = 1 << 16;
+
+ public:
+  HnswIndex(std::shared_ptr<const Matrix>, int64_t, int64_t);
+
+  // M links per row on the upper layers and 2M on layer 0; efConstruction
+  // candidates are kept while linking a row. Rows are inserted by thread
+  // threads; the levels only depend on seed.
+  void build(int32_t, int32_t, int32_t, int32_t);
+
+  void save(const std::string&) const;
+  // Maps an index saved for the same rows and columns of the matrix.
+  void load(const std::string&);
+
+  inline int64_t rows() const {
+    return n_;
+  }
+  inline int32_t maxLevel() const {
+    return maxLevel_;
+  }
+
+  // Same as ExactSearch::search, approximate: ef candidates are kept on
+  // layer 0, more is slower and closer to exact.
+  std::vector<std::vector<ScoredId>> search(
+      const real*,
+      int64_t,
+      int32_t,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+
+  static const uint32_t VERSION = 1;
+};
+
+} // namespace uni_vec
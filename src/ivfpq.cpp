@@ -0,0 +1,434 @@
+#include "ivfpq.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "kernel.h"
+
+namespace uni_vec {
+
+namespace {
+
+const char kIvfPqMagic[8] = {'U', 'V', 'I', 'V', 'F', 'P', 'Q', '\0'};
+const int32_t kCoarseIterations = 20;
+// training points per coarse centroid, as for the sub-quantizers
+const int64_t kPointsPerCentroid = 256;
+const int64_t kMaxPqTrainingPoints = 1 << 16;
+// codes scored at once by scanList, the accumulators stay in L1
+const int64_t SCAN_BLOCK = 256;
+// rows assigned to the coarse centroids by one matrix product
+const int64_t NEAREST_BLOCK = 256;
+
+// Runs fn(begin, end) over [0, n) split into thread contiguous ranges.
+void parallelFor(
+    int64_t n,
+    int32_t thread,
+    const std::function<void(int64_t, int64_t)>& fn) {
+  const int32_t nthreads = std::max<int64_t>(1, std::min<int64_t>(thread, n));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(fn, t * n / nthreads, (t + 1) * n / nthreads));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+}
+
+typedef Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    RowMatrix;
+
+// Index of the centroid nearest in L2 to each of n rows of x, stride reals
+// apart. |c|^2 - 2 x.c is enough, the products of a block of rows with all
+// centroids are one matrix product.
+void nearest(
+    const real* x,
+    int64_t stride,
+    int64_t n,
+    const RowMatrix& centroids,
+    const std::vector<real>& sqNorms,
+    int32_t* out) {
+  const int64_t dim = centroids.cols();
+  RowMatrix products;
+  for (int64_t b = 0; b < n; b += NEAREST_BLOCK) {
+    const int64_t nb = std::min(NEAREST_BLOCK, n - b);
+    Eigen::Map<const RowMatrix, 0, Eigen::OuterStride<>> rows(
+        x + b * stride, nb, dim, Eigen::OuterStride<>(stride));
+    products.noalias() = rows * centroids.transpose();
+    for (int64_t i = 0; i < nb; i++) {
+      int32_t best = 0;
+      real bestDist = sqNorms[0] - 2 * products(i, 0);
+      for (int32_t c = 1; c < centroids.rows(); c++) {
+        real dist = sqNorms[c] - 2 * products(i, c);
+        if (dist < bestDist) {
+          best = c;
+          bestDist = dist;
+        }
+      }
+      out[b + i] = best;
+    }
+  }
+}
+
+// k x dim centroids as a matrix, and their squared norms
+RowMatrix centroidMatrix(
+    const std::vector<real>& centroids,
+    int32_t k,
+    int64_t dim,
+    std::vector<real>& sqNorms) {
+  RowMatrix mat = Eigen::Map<const RowMatrix>(centroids.data(), k, dim);
+  sqNorms.resize(k);
+  for (int32_t c = 0; c < k; c++) {
+    sqNorms[c] = mat.row(c).squaredNorm();
+  }
+  return mat;
+}
+
+} // namespace
+
+IvfPqIndex::IvfPqIndex(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim)
+    : base_(base), offset_(offset), dim_(dim), n_(base->rows()), nlist_(0) {
+  if (offset < 0 || dim <= 0 || offset + dim > base->cols()) {
+    throw std::invalid_argument("Columns out of the range of the matrix.");
+  }
+}
+
+void IvfPqIndex::kmeans(
+    const std::vector<real>& x,
+    int64_t n,
+    int32_t seed,
+    int32_t thread) {
+  std::mt19937_64 rng(seed);
+  std::vector<int64_t> perm(n);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), rng);
+  centroids_.resize(nlist_ * dim_);
+  for (int32_t c = 0; c < nlist_; c++) {
+    std::memcpy(
+        centroids_.data() + c * dim_, x.data() + perm[c] * dim_, dim_ * sizeof(real));
+  }
+
+  std::vector<int32_t> codes(n);
+  std::vector<real> sqNorms;
+  std::vector<int64_t> counts(nlist_);
+  std::uniform_int_distribution<int64_t> pick(0, n - 1);
+  for (int32_t it = 0; it < kCoarseIterations; it++) {
+    const RowMatrix centroids = centroidMatrix(centroids_, nlist_, dim_, sqNorms);
+    parallelFor(n, thread, [&](int64_t begin, int64_t end) {
+      nearest(
+          x.data() + begin * dim_, dim_, end - begin, centroids, sqNorms,
+          codes.data() + begin);
+    });
+    std::fill(centroids_.begin(), centroids_.end(), 0.0);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (int64_t i = 0; i < n; i++) {
+      kernel::add<0>(x.data() + i * dim_, centroids_.data() + codes[i] * dim_, dim_);
+      counts[codes[i]]++;
+    }
+    for (int32_t c = 0; c < nlist_; c++) {
+      real* y = centroids_.data() + c * dim_;
+      if (counts[c] > 0) {
+        kernel::scale<0>(1.0 / counts[c], y, dim_);
+      } else {
+        // an empty list restarts from a random training point
+        std::memcpy(y, x.data() + pick(rng) * dim_, dim_ * sizeof(real));
+      }
+    }
+  }
+}
+
+void IvfPqIndex::assign(std::vector<int32_t>& lists, int32_t thread) const {
+  std::vector<real> sqNorms;
+  const RowMatrix centroids = centroidMatrix(centroids_, nlist_, dim_, sqNorms);
+  lists.resize(n_);
+  parallelFor(n_, thread, [&](int64_t begin, int64_t end) {
+    nearest(
+        vec(begin), base_->cols(), end - begin, centroids, sqNorms,
+        lists.data() + begin);
+  });
+}
+
+void IvfPqIndex::build(int32_t nlist, int32_t dsub, int32_t seed, int32_t thread) {
+  if (dsub <= 0 || dsub > dim_) {
+    throw std::invalid_argument("dsub must be in [1, dim].");
+  }
+  if (n_ >= std::numeric_limits<int32_t>::max()) {
+    throw std::invalid_argument("Too many rows for an IVF-PQ index.");
+  }
+  if (nlist <= 0) {
+    nlist = std::lround(4 * std::sqrt(double(n_)));
+  }
+  nlist_ = std::max<int64_t>(1, std::min<int64_t>(nlist, n_));
+
+  // coarse centroids from a sample of the rows
+  std::mt19937_64 rng(seed);
+  std::vector<int64_t> perm(n_);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), rng);
+  const int64_t ns = std::min(n_, nlist_ * kPointsPerCentroid);
+  std::vector<real> sample(ns * dim_);
+  for (int64_t i = 0; i < ns; i++) {
+    std::memcpy(sample.data() + i * dim_, vec(perm[i]), dim_ * sizeof(real));
+  }
+  kmeans(sample, ns, seed, thread);
+  std::vector<int32_t> lists;
+  assign(lists, thread);
+
+  // sub-quantizers trained on the residuals of the same sample
+  const int64_t np = std::min(n_, kMaxPqTrainingPoints);
+  sample.resize(np * dim_);
+  for (int64_t i = 0; i < np; i++) {
+    real* r = sample.data() + i * dim_;
+    std::memcpy(r, vec(perm[i]), dim_ * sizeof(real));
+    kernel::axpy<0>(-1.0, centroids_.data() + lists[perm[i]] * dim_, r, dim_);
+  }
+  pq_.reset(new ProductQuantizer(dim_, dsub));
+  pq_->train(np, sample.data());
+  const int32_t nsubq = pq_->get_nsubq();
+
+  listStart_.assign(nlist_ + 1, 0);
+  for (int64_t i = 0; i < n_; i++) {
+    listStart_[lists[i] + 1]++;
+  }
+  std::partial_sum(listStart_.begin(), listStart_.end(), listStart_.begin());
+  ids_.resize(n_);
+  std::vector<int64_t> fill(listStart_.begin(), listStart_.end() - 1);
+  for (int64_t i = 0; i < n_; i++) {
+    ids_[fill[lists[i]]++] = i;
+  }
+
+  codes_.resize(n_ * nsubq);
+  parallelFor(nlist_, thread, [&](int64_t begin, int64_t end) {
+    std::vector<real> r(dim_);
+    std::vector<uint8_t> code(nsubq);
+    for (int64_t l = begin; l < end; l++) {
+      const int64_t len = listStart_[l + 1] - listStart_[l];
+      uint8_t* codes = codes_.data() + listStart_[l] * nsubq;
+      for (int64_t j = 0; j < len; j++) {
+        std::memcpy(r.data(), vec(ids_[listStart_[l] + j]), dim_ * sizeof(real));
+        kernel::axpy<0>(-1.0, centroids_.data() + l * dim_, r.data(), dim_);
+        pq_->compute_code(r.data(), code.data());
+        for (int32_t m = 0; m < nsubq; m++) {
+          codes[m * len + j] = code[m];
+        }
+      }
+    }
+  });
+}
+
+void IvfPqIndex::save(const std::string& filename) const {
+  if (!pq_) {
+    throw std::logic_error("The index has not been built.");
+  }
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for saving!");
+  }
+  const uint32_t version = VERSION;
+  const int64_t cols = base_->cols();
+  ofs.write(kIvfPqMagic, sizeof(kIvfPqMagic));
+  ofs.write((char*)&version, sizeof(uint32_t));
+  ofs.write((char*)&nlist_, sizeof(int32_t));
+  ofs.write((char*)&n_, sizeof(int64_t));
+  ofs.write((char*)&cols, sizeof(int64_t));
+  ofs.write((char*)&offset_, sizeof(int64_t));
+  ofs.write((char*)&dim_, sizeof(int64_t));
+  ofs.write((char*)centroids_.data(), centroids_.size() * sizeof(real));
+  pq_->save(ofs);
+  ofs.write((char*)listStart_.data(), listStart_.size() * sizeof(int64_t));
+  ofs.write((char*)ids_.data(), ids_.size() * sizeof(int32_t));
+  ofs.write((char*)codes_.data(), codes_.size());
+  if (!ofs) {
+    throw std::runtime_error(filename + " could not be written completely!");
+  }
+}
+
+void IvfPqIndex::load(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for loading!");
+  }
+  char magic[sizeof(kIvfPqMagic)];
+  uint32_t version = 0;
+  int32_t nlist = 0;
+  int64_t rows = 0, cols = 0, offset = 0, dim = 0;
+  ifs.read(magic, sizeof(magic));
+  ifs.read((char*)&version, sizeof(uint32_t));
+  if (!ifs || std::memcmp(magic, kIvfPqMagic, sizeof(magic)) != 0 ||
+      version != VERSION) {
+    throw std::invalid_argument(filename + " is not an IVF-PQ index!");
+  }
+  ifs.read((char*)&nlist, sizeof(int32_t));
+  ifs.read((char*)&rows, sizeof(int64_t));
+  ifs.read((char*)&cols, sizeof(int64_t));
+  ifs.read((char*)&offset, sizeof(int64_t));
+  ifs.read((char*)&dim, sizeof(int64_t));
+  if (rows != n_ || cols != base_->cols() || offset != offset_ || dim != dim_) {
+    throw std::invalid_argument(
+        filename + " was built for other vectors than those of the model!");
+  }
+  if (!ifs || nlist <= 0 || nlist > n_) {
+    throw std::invalid_argument(filename + " has a corrupted header!");
+  }
+  nlist_ = nlist;
+  centroids_.resize(nlist_ * dim_);
+  ifs.read((char*)centroids_.data(), centroids_.size() * sizeof(real));
+  std::unique_ptr<ProductQuantizer> pq(new ProductQuantizer());
+  pq->load(ifs);
+  if (!ifs || pq->get_nsubq() <= 0 || pq->get_dsub() <= 0) {
+    throw std::invalid_argument(filename + " is truncated or corrupted!");
+  }
+  listStart_.resize(nlist_ + 1);
+  ids_.resize(n_);
+  codes_.resize(n_ * pq->get_nsubq());
+  ifs.read((char*)listStart_.data(), listStart_.size() * sizeof(int64_t));
+  ifs.read((char*)ids_.data(), ids_.size() * sizeof(int32_t));
+  ifs.read((char*)codes_.data(), codes_.size());
+  if (!ifs || listStart_.front() != 0 || listStart_.back() != n_ ||
+      !std::is_sorted(listStart_.begin(), listStart_.end())) {
+    throw std::invalid_argument(filename + " is truncated or corrupted!");
+  }
+  for (int32_t id : ids_) {
+    if (id < 0 || id >= n_) {
+      throw std::invalid_argument(filename + " holds an out of range row!");
+    }
+  }
+  pq_ = std::move(pq);
+}
+
+bool IvfPqIndex::isIvfPqIndex(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  char magic[sizeof(kIvfPqMagic)];
+  return ifs.read(magic, sizeof(magic)) &&
+      std::memcmp(magic, kIvfPqMagic, sizeof(magic)) == 0;
+}
+
+void IvfPqIndex::lookupTable(const real* q, std::vector<real>& lut) const {
+  const int32_t nsubq = pq_->get_nsubq();
+  const int32_t dsub = pq_->get_dsub();
+  const int32_t ksub = pq_->get_ksub();
+  lut.resize(nsubq * ksub);
+  for (int32_t m = 0; m < nsubq; m++) {
+    const int32_t d = m == nsubq - 1 ? dim_ - m * dsub : dsub;
+    for (int32_t i = 0; i < ksub; i++) {
+      lut[m * ksub + i] = kernel::dot<0>(q + m * dsub, pq_->get_centroids(m, i), d);
+    }
+  }
+}
+
+void IvfPqIndex::scanList(
+    int32_t l,
+    real base,
+    const real* lut,
+    TopK& heap,
+    std::vector<real>& acc) const {
+  const int32_t nsubq = pq_->get_nsubq();
+  const int32_t ksub = pq_->get_ksub();
+  const int64_t begin = listStart_[l];
+  const int64_t len = listStart_[l + 1] - begin;
+  const uint8_t* codes = codes_.data() + begin * nsubq;
+  acc.resize(SCAN_BLOCK);
+  real* __restrict a = acc.data();
+  for (int64_t b = 0; b < len; b += SCAN_BLOCK) {
+    const int64_t nb = std::min(SCAN_BLOCK, len - b);
+    std::fill(a, a + nb, base);
+    for (int32_t m = 0; m < nsubq; m++) {
+      const uint8_t* __restrict c = codes + m * len + b;
+      const real* __restrict t = lut + m * ksub;
+      int64_t j = 0;
+#ifdef __AVX2__
+      for (; j + 8 <= nb; j += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(c + j)));
+        __m256 v = _mm256_i32gather_ps(t, idx, sizeof(real));
+        _mm256_storeu_ps(a + j, _mm256_add_ps(_mm256_loadu_ps(a + j), v));
+      }
+#endif
+      for (; j < nb; j++) {
+        a[j] += t[c[j]];
+      }
+    }
+    real threshold = heap.threshold();
+    for (int64_t j = 0; j < nb; j++) {
+      if (a[j] >= threshold) {
+        heap.push(a[j], ids_[begin + b + j]);
+        threshold = heap.threshold();
+      }
+    }
+  }
+}
+
+std::vector<std::vector<ScoredId>> IvfPqIndex::search(
+    const real* queries,
+    int64_t nq,
+    int32_t k,
+    int32_t nprobe,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  if (!pq_) {
+    throw std::logic_error("The index has not been built.");
+  }
+  nprobe = std::max(1, std::min(nprobe, nlist_));
+  std::vector<std::vector<ScoredId>> results(nq);
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    std::vector<real> lut;
+    std::vector<real> acc;
+    std::vector<std::pair<real, int32_t>> coarse(nlist_);
+    for (int64_t q = next++; q < nq; q = next++) {
+      const real* x = queries + q * dim_;
+      for (int32_t l = 0; l < nlist_; l++) {
+        coarse[l].first = kernel::dot<0>(x, centroids_.data() + l * dim_, dim_);
+        coarse[l].second = l;
+      }
+      std::partial_sort(
+          coarse.begin(),
+          coarse.begin() + nprobe,
+          coarse.end(),
+          std::greater<std::pair<real, int32_t>>());
+      lookupTable(x, lut);
+      TopK heap(k + (bans.empty() ? 0 : bans[q].size()));
+      for (int32_t p = 0; p < nprobe; p++) {
+        scanList(coarse[p].second, coarse[p].first, lut.data(), heap, acc);
+      }
+      for (const auto& c : heap.take()) {
+        if (int32_t(results[q].size()) == k) {
+          break;
+        }
+        if (bans.empty() ||
+            !std::binary_search(bans[q].begin(), bans[q].end(), c.second)) {
+          results[q].push_back(c);
+        }
+      }
+    }
+  };
+  const int32_t nthreads = std::max<int64_t>(1, std::min<int64_t>(thread, nq));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return results;
+}
+
+} // namespace uni_vec
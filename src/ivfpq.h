@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "neighbors.h"
+#include "productquantizer.h"
+#include "real.h"
+
+namespace uni_vec {
+
+/*
+ * IVF-PQ index for maximum inner product search over columns
+ * [offset, offset + dim) of the rows of a matrix. The rows are partitioned
+ * by k-means into nlist inverted lists, and the residual of every row to the
+ * centroid of its list is product quantized, one byte per sub-quantizer.
+ *
+ * For inner products the residual term does not depend on the list:
+ * q.x ~ q.c + sum_m q_m.r_m, so a query builds one table of q_m against
+ * every sub-quantizer centroid and scores a code with table lookups only.
+ * The codes of a list are stored sub-quantizer major, a block of rows is
+ * scored by adding one table row to a block of accumulators per
+ * sub-quantizer, eight rows per gather with AVX2.
+ */
+class IvfPqIndex {
+ protected:
+  std::shared_ptr<const Matrix> base_;
+  int64_t offset_;
+  int64_t dim_;
+  int64_t n_;
+  int32_t nlist_;
+
+  // nlist x dim coarse centroids
+  std::vector<real> centroids_;
+  std::unique_ptr<ProductQuantizer> pq_;
+  // rows of list l are ids_[listStart_[l], listStart_[l + 1])
+  std::vector<int64_t> listStart_;
+  std::vector<int32_t> ids_;
+  // codes of list l start at listStart_[l] * nsubq, sub-quantizer major
+  std::vector<uint8_t> codes_;
+
+  inline const real* vec(int64_t i) const {
+    return base_->row(i) + offset_;
+  }
+
+  void kmeans(const std::vector<real>&, int64_t, int32_t, int32_t);
+  void assign(std::vector<int32_t>&, int32_t) const;
+  void lookupTable(const real*, std::vector<real>&) const;
+  void scanList(int32_t, real, const real*, TopK&, std::vector<real>&) const;
+
+ public:
+  IvfPqIndex(std::shared_ptr<const Matrix>, int64_t, int64_t);
+
+  // nlist inverted lists, 0 for 4 sqrt(rows); residuals split into
+  // sub-vectors of dsub columns. K-means runs on thread threads from seed.
+  void build(int32_t, int32_t, int32_t, int32_t);
+
+  void save(const std::string&) const;
+  // Loads an index saved for the same rows and columns of the matrix.
+  void load(const std::string&);
+
+  inline int32_t nlist() const {
+    return nlist_;
+  }
+
+  // Same as ExactSearch::search, approximate: only the rows of the nprobe
+  // lists whose centroids score best are scanned, and scores are those of
+  // the quantized rows.
+  std::vector<std::vector<ScoredId>> search(
+      const real*,
+      int64_t,
+      int32_t,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+
+  // True if the file starts with the magic of this format.
+  static bool isIvfPqIndex(const std::string&);
+
+  static const uint32_t VERSION = 1;
+};
+
+} // namespace uni_vec
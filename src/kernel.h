@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+
+#include "real.h"
+
+namespace uni_vec {
+
+namespace kernel {
+
+// Embedding dimensions that get a dedicated training kernel; 0 is the
+// generic fallback used for every other dimension.
+#define UNI_VEC_FOR_EACH_KERNEL_DIM(X) X(0) X(32) X(64) X(100) X(128) X(256)
+
+/*
+ * Dense row primitives used by the training kernels. N > 0 is the row length
+ * known at compile time, so the loops get a constant trip count the compiler
+ * can fully unroll and vectorise; N == 0 falls back to the runtime length n.
+ */
+
+template <int32_t N>
+inline int64_t len(int64_t n) {
+  return N > 0 ? N : n;
+}
+
+template <int32_t N>
+inline real dot(const real* x, const real* y, int64_t n) {
+  const int64_t m = len<N>(n);
+  real d = 0.0;
+  for (int64_t j = 0; j < m; j++) {
+    d += x[j] * y[j];
+  }
+  return d;
+}
+
+// y += a * x
+template <int32_t N>
+inline void axpy(real a, const real* x, real* y, int64_t n) {
+  const int64_t m = len<N>(n);
+  for (int64_t j = 0; j < m; j++) {
+    y[j] += a * x[j];
+  }
+}
+
+// y += x
+template <int32_t N>
+inline void add(const real* x, real* y, int64_t n) {
+  const int64_t m = len<N>(n);
+  for (int64_t j = 0; j < m; j++) {
+    y[j] += x[j];
+  }
+}
+
+// y *= a
+template <int32_t N>
+inline void scale(real a, real* y, int64_t n) {
+  const int64_t m = len<N>(n);
+  for (int64_t j = 0; j < m; j++) {
+    y[j] *= a;
+  }
+}
+
+template <int32_t N>
+inline void zero(real* y, int64_t n) {
+  const int64_t m = len<N>(n);
+  for (int64_t j = 0; j < m; j++) {
+    y[j] = 0.0;
+  }
+}
+
+} // namespace kernel
+
+} // namespace uni_vec
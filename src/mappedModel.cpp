@@ -0,0 +1,271 @@
+#include "mappedModel.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace uni_vec {
+
+namespace {
+
+const char kMagic[8] = {'U', 'V', 'M', 'O', 'D', 'E', 'L', '\0'};
+
+uint64_t alignUp(uint64_t v, uint64_t alignment) {
+  return (v + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+MappedFile::MappedFile(const std::string& filename) : addr_(nullptr), size_(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::invalid_argument(filename + " cannot be opened for loading!");
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::invalid_argument(filename + " cannot be stat'ed!");
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    addr_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (addr_ == MAP_FAILED) {
+    addr_ = nullptr;
+    throw std::invalid_argument(filename + " cannot be memory mapped!");
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (addr_) {
+    munmap(addr_, size_);
+  }
+}
+
+uint64_t MappedModel::checksum(const char* data, size_t size, uint64_t seed) {
+  // multiply-rotate over 64 bit words, then the tail bytes
+  const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = seed ^ (size * prime);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, data + i, 8);
+    h ^= w;
+    h = ((h << 31) | (h >> 33)) * prime;
+  }
+  for (; i < size; i++) {
+    h = (h ^ uint8_t(data[i])) * prime;
+  }
+  return h ^ (h >> 29);
+}
+
+bool MappedModel::isMappedModel(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  char magic[sizeof(kMagic)];
+  if (!ifs.read(magic, sizeof(magic))) {
+    return false;
+  }
+  return std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+void MappedModel::save(
+    const std::string& filename,
+    const Args& args,
+    const std::vector<std::pair<std::string, std::shared_ptr<const Matrix>>>&
+        matrices,
+    const std::vector<std::pair<std::string, std::string>>& blobs) {
+  std::ostringstream argsStream;
+  Args(args).save(argsStream);
+  const std::string argsBlob = argsStream.str();
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  // files without byte sections stay readable by version 1 readers
+  header.version = blobs.empty() ? 1 : VERSION;
+  header.alignment = ALIGNMENT;
+  header.nsections = matrices.size() + blobs.size() + 1;
+  header.dim = args.dim;
+  header.userDim = args.userDim;
+  header.combine = int32_t(args.combine);
+
+  std::vector<Section> index(header.nsections);
+  std::vector<const char*> payload(header.nsections);
+  std::memset(index.data(), 0, index.size() * sizeof(Section));
+  uint64_t offset = alignUp(sizeof(Header) + index.size() * sizeof(Section), ALIGNMENT);
+  for (uint32_t i = 0; i < header.nsections; i++) {
+    Section& s = index[i];
+    if (i == 0) {
+      std::strncpy(s.name, "args", sizeof(s.name) - 1);
+      s.bytes = argsBlob.size();
+      payload[i] = argsBlob.data();
+    } else if (i > matrices.size()) {
+      const auto& named = blobs[i - 1 - matrices.size()];
+      if (named.first.size() >= sizeof(s.name)) {
+        throw std::invalid_argument("Section name too long: " + named.first);
+      }
+      std::strncpy(s.name, named.first.c_str(), sizeof(s.name) - 1);
+      s.bytes = named.second.size();
+      payload[i] = named.second.data();
+    } else {
+      const auto& named = matrices[i - 1];
+      if (named.first.size() >= sizeof(s.name)) {
+        throw std::invalid_argument("Section name too long: " + named.first);
+      }
+      std::strncpy(s.name, named.first.c_str(), sizeof(s.name) - 1);
+      s.rows = named.second->rows();
+      s.cols = named.second->cols();
+      s.bytes = s.rows * s.cols * sizeof(real);
+      payload[i] = reinterpret_cast<const char*>(named.second->data());
+    }
+    s.offset = offset;
+    s.checksum = checksum(payload[i], s.bytes);
+    offset = alignUp(offset + s.bytes, ALIGNMENT);
+  }
+  header.checksum = checksum(
+      reinterpret_cast<const char*>(index.data()),
+      index.size() * sizeof(Section),
+      checksum(reinterpret_cast<const char*>(&header), sizeof(header)));
+
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(filename + " cannot be opened for saving!");
+  }
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(Section));
+  const std::vector<char> zeros(ALIGNMENT, 0);
+  uint64_t pos = sizeof(Header) + index.size() * sizeof(Section);
+  for (uint32_t i = 0; i < header.nsections; i++) {
+    ofs.write(zeros.data(), index[i].offset - pos);
+    ofs.write(payload[i], index[i].bytes);
+    pos = index[i].offset + index[i].bytes;
+  }
+  // pad the last section so the file size is page aligned too
+  ofs.write(zeros.data(), alignUp(pos, ALIGNMENT) - pos);
+  if (!ofs) {
+    throw std::runtime_error(filename + " could not be written completely!");
+  }
+  ofs.close();
+}
+
+MappedModel::MappedModel(const std::string& filename)
+    : file_(std::make_shared<MappedFile>(filename)) {
+  const size_t size = file_->size();
+  if (size < sizeof(Header) ||
+      std::memcmp(file_->data(), kMagic, sizeof(kMagic)) != 0) {
+    throw std::invalid_argument(filename + " has wrong file format!");
+  }
+  header_ = reinterpret_cast<const Header*>(file_->data());
+  if (header_->version > VERSION) {
+    throw std::invalid_argument(filename + " has an unsupported version!");
+  }
+  const size_t indexBytes = size_t(header_->nsections) * sizeof(Section);
+  if (sizeof(Header) + indexBytes > size) {
+    throw std::invalid_argument(filename + " has a truncated section index!");
+  }
+  index_ = reinterpret_cast<const Section*>(file_->data() + sizeof(Header));
+
+  Header copy = *header_;
+  copy.checksum = 0;
+  uint64_t expected = checksum(
+      reinterpret_cast<const char*>(index_),
+      indexBytes,
+      checksum(reinterpret_cast<const char*>(&copy), sizeof(copy)));
+  if (expected != header_->checksum) {
+    throw std::invalid_argument(filename + " has a corrupted header!");
+  }
+  for (uint32_t i = 0; i < header_->nsections; i++) {
+    const Section& s = index_[i];
+    // names are compared as C strings
+    if (std::memchr(s.name, '\0', sizeof(s.name)) == nullptr) {
+      throw std::invalid_argument(
+          filename + " has a section with an unterminated name!");
+    }
+    if (s.offset % header_->alignment != 0 || s.offset + s.bytes > size) {
+      throw std::invalid_argument(
+          filename + " has an invalid section " + std::string(s.name));
+    }
+  }
+}
+
+const MappedModel::Section* MappedModel::find(const std::string& name) const {
+  for (uint32_t i = 0; i < header_->nsections; i++) {
+    if (name == index_[i].name) {
+      return &index_[i];
+    }
+  }
+  return nullptr;
+}
+
+bool MappedModel::hasMatrix(const std::string& name) const {
+  return find(name) != nullptr;
+}
+
+std::shared_ptr<Matrix> MappedModel::matrix(const std::string& name) const {
+  const Section* s = find(name);
+  if (!s) {
+    throw std::invalid_argument("Model has no matrix " + name);
+  }
+  // the view must not reach past its section, checked without overflow
+  if (s->rows < 0 || s->cols < 0 ||
+      (s->cols > 0 &&
+       uint64_t(s->rows) > s->bytes / sizeof(real) / uint64_t(s->cols)) ||
+      uint64_t(s->rows) * uint64_t(s->cols) * sizeof(real) != s->bytes) {
+    throw std::invalid_argument(
+        "Model matrix " + name + " does not match the size of its section!");
+  }
+  return std::make_shared<Matrix>(
+      s->rows,
+      s->cols,
+      reinterpret_cast<const real*>(file_->data() + s->offset),
+      file_);
+}
+
+std::string MappedModel::blob(const std::string& name) const {
+  const Section* s = find(name);
+  if (!s) {
+    throw std::invalid_argument("Model has no section " + name);
+  }
+  return std::string(file_->data() + s->offset, s->bytes);
+}
+
+void MappedModel::loadArgs(Args& args) const {
+  const Section* s = find("args");
+  if (!s) {
+    throw std::invalid_argument("Model has no args section");
+  }
+  std::istringstream in(std::string(file_->data() + s->offset, s->bytes));
+  args.load(in);
+  args.dim = header_->dim;
+  args.userDim = header_->userDim;
+  args.combine = combine_method(header_->combine);
+}
+
+std::vector<std::string> MappedModel::verify() const {
+  std::vector<char> ok(header_->nsections, 0);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < header_->nsections; i++) {
+    threads.push_back(std::thread([this, i, &ok]() {
+      const Section& s = index_[i];
+      ok[i] = checksum(file_->data() + s.offset, s.bytes) == s.checksum;
+    }));
+  }
+  std::vector<std::string> failed;
+  for (uint32_t i = 0; i < header_->nsections; i++) {
+    threads[i].join();
+    if (!ok[i]) {
+      failed.push_back(index_[i].name);
+    }
+  }
+  return failed;
+}
+
+} // namespace uni_vec
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+
+namespace uni_vec {
+
+// Read-only memory mapping of a whole file, unmapped on destruction.
+class MappedFile {
+ protected:
+  void* addr_;
+  size_t size_;
+
+ public:
+  explicit MappedFile(const std::string&);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  inline const char* data() const {
+    return static_cast<const char*>(addr_);
+  }
+  inline size_t size() const {
+    return size_;
+  }
+};
+
+/*
+ * Model file that is loaded by mapping it instead of reading it:
+ *
+ *   header | section index | pad | section 0 | pad | section 1 | ...
+ *
+ * The header records the combine method and dimensions the .bin format
+ * drops, and a checksum of itself and the index. Every section starts on a
+ * page boundary so its rows can be used in place, and carries the checksum
+ * of its bytes. Opening a model only validates the header; verify() reads
+ * the sections. Processes mapping the same file share its page cache.
+ */
+class MappedModel {
+ public:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t alignment;
+    uint32_t nsections;
+    int32_t dim;
+    int32_t userDim;
+    int32_t combine;
+    // checksum of the header with this field zeroed, followed by the index
+    uint64_t checksum;
+  };
+
+  struct Section {
+    char name[32];
+    int64_t rows;
+    int64_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+  };
+
+ protected:
+  std::shared_ptr<const MappedFile> file_;
+  const Header* header_;
+  const Section* index_;
+
+  const Section* find(const std::string&) const;
+
+ public:
+  explicit MappedModel(const std::string&);
+
+  // True if the file starts with the magic of this format.
+  static bool isMappedModel(const std::string&);
+
+  // Writes args, the named matrices and the named byte sections, such as
+  // quantized matrices.
+  static void save(
+      const std::string&,
+      const Args&,
+      const std::vector<std::pair<std::string, std::shared_ptr<const Matrix>>>&,
+      const std::vector<std::pair<std::string, std::string>>& blobs = {});
+
+  static uint64_t checksum(const char*, size_t, uint64_t seed = 0);
+
+  bool hasMatrix(const std::string&) const;
+  // Zero-copy view of a matrix section.
+  std::shared_ptr<Matrix> matrix(const std::string&) const;
+  // Copy of a byte section.
+  std::string blob(const std::string&) const;
+  void loadArgs(Args&) const;
+
+  // Checks the checksum of every section, returns the names that fail.
+  std::vector<std::string> verify() const;
+
+  const Header& header() const {
+    return *header_;
+  }
+  const Section& section(uint32_t i) const {
+    return index_[i];
+  }
+
+  // version 2 files have byte sections besides args
+  static const uint32_t VERSION = 2;
+  static const uint32_t ALIGNMENT = 4096;
+};
+
+} // namespace uni_vec
@@ -13,6 +13,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>  
+#include <thread>
 
 #include "utils.h"
 #include "vector.h"
@@ -21,7 +22,25 @@ namespace uni_vec {
 
 Matrix::Matrix() : Matrix(0, 0) {}
 
-Matrix::Matrix(int64_t m, int64_t n) : data_(m * n), m_(m), n_(n) {}
+Matrix::Matrix(int64_t m, int64_t n)
+    : storage_(m * n), data_(storage_.data()), m_(m), n_(n) {}
+
+Matrix::Matrix(
+    int64_t m,
+    int64_t n,
+    const real* data,
+    std::shared_ptr<const void> mapping)
+    // the mapping is read-only, writing through a view faults
+    : data_(const_cast<real*>(data)), m_(m), n_(n), mapping_(mapping) {}
+
+Matrix::Matrix(const Matrix& other)
+    : storage_(other.storage_),
+      data_(other.isView() ? other.data_ : storage_.data()),
+      m_(other.m_),
+      n_(other.n_),
+      adagrad_(other.adagrad_),
+      dirty_(other.dirty_),
+      mapping_(other.mapping_) {}
 
 std::ostream &operator<<( std::ostream &output, const Matrix &mat ) {
   output << std::fixed; 
@@ -37,7 +56,7 @@ std::ostream &operator<<( std::ostream &output, const Matrix &mat ) {
 }
 
 void Matrix::zero() {
-  std::fill(data_.begin(), data_.end(), 0.0);
+  std::fill(data_, data_ + m_ * n_, 0.0);
 }
 
 void Matrix::uniform(real a) {
@@ -85,6 +104,26 @@ void Matrix::addRow(const Vector& vec, int64_t i, real a) {
   for (int64_t j = 0; j < n_; j++) {
     data_[i * n_ + j] += a * vec[j];
   }
+  markDirty(i);
+}
+
+void Matrix::initAdagrad(real init) {
+  adagrad_.assign(m_, init);
+}
+
+void Matrix::trackDirty() {
+  dirty_.assign(m_, 0);
+}
+
+std::vector<int64_t> Matrix::takeDirty() {
+  std::vector<int64_t> ids;
+  for (int64_t i = 0; i < int64_t(dirty_.size()); i++) {
+    if (dirty_[i]) {
+      dirty_[i] = 0;
+      ids.push_back(i);
+    }
+  }
+  return ids;
 }
 
 void Matrix::multiplyRow(const Vector& nums, int64_t ib, int64_t ie) {
@@ -138,27 +177,69 @@ void Matrix::l2NormRow(Vector& norms) const {
 void Matrix::save(std::ostream& out) {
   out.write((char*)&m_, sizeof(int64_t));
   out.write((char*)&n_, sizeof(int64_t));
-  out.write((char*)data_.data(), m_ * n_ * sizeof(real));
+  out.write((char*)data_, m_ * n_ * sizeof(real));
 }
 
 void Matrix::load(std::istream& in) {
   in.read((char*)&m_, sizeof(int64_t));
   in.read((char*)&n_, sizeof(int64_t));
-  data_ = std::vector<real>(m_ * n_);
-  in.read((char*)data_.data(), m_ * n_ * sizeof(real));
+  storage_ = std::vector<real>(m_ * n_);
+  data_ = storage_.data();
+  mapping_.reset();
+  in.read((char*)data_, m_ * n_ * sizeof(real));
 }
 
 void Matrix::dump(std::ostream& out) const {
-  out << m_ << " " << n_ << std::endl;
-  for (int64_t i = 0; i < m_; i++) {
-    for (int64_t j = 0; j < n_; j++) {
-      if (j > 0) {
-        out << " ";
+  dump(out, 0, m_, 1);
+}
+
+void Matrix::dump(
+    std::ostream& out,
+    int64_t begin,
+    int64_t end,
+    int32_t nthreads) const {
+  const int64_t blockRows = 4096;
+  nthreads = std::max(1, nthreads);
+  out << (end - begin) << " " << n_ << std::endl;
+  std::vector<std::string> buffers(nthreads);
+  // rethrown after the join, an exception leaving a std::thread terminates
+  std::vector<std::exception_ptr> errors(nthreads);
+  for (int64_t round = begin; round < end; round += blockRows * nthreads) {
+    std::vector<std::thread> threads;
+    for (int32_t t = 0; t < nthreads; t++) {
+      const int64_t b = round + t * blockRows;
+      if (b >= end) {
+        break;
       }
-      out << at(i, j);
+      const int64_t e = std::min(end, b + blockRows);
+      threads.push_back(std::thread([this, b, e, &buffers, &errors, t]() {
+        try {
+          std::string& buf = buffers[t];
+          buf.clear();
+          for (int64_t i = b; i < e; i++) {
+            for (int64_t j = 0; j < n_; j++) {
+              if (j > 0) {
+                buf.push_back(' ');
+              }
+              utils::appendReal(buf, at(i, j));
+            }
+            buf.push_back('\n');
+          }
+        } catch (...) {
+          errors[t] = std::current_exception();
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      if (errors[t]) {
+        std::rethrow_exception(errors[t]);
+      }
+      out.write(buffers[t].data(), buffers[t].size());
     }
-    out << std::endl;
   }
-};
+}
 
 } // namespace uni_vec
\ No newline at end of file
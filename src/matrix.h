@@ -8,12 +8,19 @@
 
 #pragma once
 
+#include <cmath>
 #include <cstdint>
 #include <istream>
+#include <memory>
 #include <ostream>
 #include <vector>
 
+// GCC warns about Eigen's AVX-512 packing once it is inlined into our code,
+// where -isystem no longer silences it
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
 #include <Eigen/Dense>
+#pragma GCC diagnostic pop
 
 #include <assert.h>
 #include "real.h"
@@ -24,24 +31,47 @@ class Vector;
 
 class Matrix {
  protected:
-  std::vector<real> data_;
+  // owned rows; empty when the matrix is a view of a memory mapped model
+  std::vector<real> storage_;
+  real* data_;
   const int64_t m_;
   const int64_t n_;
+  // keeps the mapping of a view alive, null for owned matrices
+  std::shared_ptr<const void> mapping_;
+  // row-wise Adagrad accumulators, one per row; empty when training with SGD
+  std::vector<real> adagrad_;
+  // rows updated since the last takeDirty(), one byte per row so that
+  // concurrent writers never read-modify-write each other's flags; empty
+  // when updates are not tracked
+  std::vector<uint8_t> dirty_;
 
  public:
   Matrix();
   explicit Matrix(int64_t, int64_t);
-  Matrix(const Matrix&) = default;
+  // Read-only view of m x n rows owned by mapping; no copy is made.
+  Matrix(int64_t, int64_t, const real*, std::shared_ptr<const void>);
+  Matrix(const Matrix&);
   Matrix& operator=(const Matrix&) = delete;
   friend std::ostream &operator<<( std::ostream &, const Matrix &);
 
   static real matSelectDot(const Matrix& a, const Matrix& b, int64_t aPos, int64_t bPos);
 
   inline real* data() {
-    return data_.data();
+    return data_;
   }
   inline const real* data() const {
-    return data_.data();
+    return data_;
+  }
+
+  inline real* row(int64_t i) {
+    return data_ + i * n_;
+  }
+  inline const real* row(int64_t i) const {
+    return data_ + i * n_;
+  }
+
+  inline bool isView() const {
+    return mapping_ != nullptr;
   }
 
   inline const real& at(int64_t i, int64_t j) const {
@@ -69,6 +99,33 @@ class Matrix {
   real dotRow(const Vector&, int64_t) const;
   void addRow(const Vector&, int64_t, real);
 
+  void initAdagrad(real);
+  inline bool hasAdagrad() const {
+    return !adagrad_.empty();
+  }
+  // Accumulates the mean squared gradient sqnorm / n of row i and returns
+  // its Adagrad step size lr / sqrt(G_i). Updated lock-free like the rows.
+  inline real adagradStep(int64_t i, real sqnorm, real lr) {
+    real g = adagrad_[i] + sqnorm / n_;
+    adagrad_[i] = g;
+    return lr / std::sqrt(g);
+  }
+
+  void trackDirty();
+  inline bool tracksDirty() const {
+    return !dirty_.empty();
+  }
+  inline void markDirty(int64_t i) {
+    // test first so that hot rows do not keep invalidating the cache line
+    if (!dirty_.empty() && !dirty_[i]) {
+      dirty_[i] = 1;
+    }
+  }
+  // Ids of the rows updated since the last call, in increasing order, and
+  // clears their flags. A row written concurrently is reported again by the
+  // next call.
+  std::vector<int64_t> takeDirty();
+
   void multiplyRow(const Vector& nums, int64_t ib = 0, int64_t ie = -1);
   void divideRow(const Vector& denoms, int64_t ib = 0, int64_t ie = -1);
 
@@ -79,5 +136,8 @@ class Matrix {
   void load(std::istream&);
 
   void dump(std::ostream&) const;
+  // Text of rows [begin, end) behind a "rows cols" line; row blocks are
+  // formatted by nthreads threads and written in order.
+  void dump(std::ostream&, int64_t, int64_t, int32_t) const;
 };
 } // namespace uni_vec
\ No newline at end of file
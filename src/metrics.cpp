@@ -0,0 +1,181 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+namespace uni_vec {
+
+namespace {
+
+const char* const kStreamNames[ThreadMetrics::NSTREAMS] = {
+    "trx", "view", "sub", "search"};
+const char* const kPhaseNames[ThreadMetrics::NPHASES] = {
+    "window", "update", "userContext", "itemContext"};
+const char* const kModelNames[ThreadMetrics::NMODELS] = {
+    "itemWord", "userWord", "itemUser", "itemUserView", "itemSub", "itemSearch"};
+
+} // namespace
+
+ThreadMetrics::ThreadMetrics() {
+  for (int32_t i = 0; i < NSTREAMS; i++) {
+    examples[i] = 0;
+    streamNs[i] = 0;
+  }
+  for (int32_t i = 0; i < NPHASES; i++) {
+    phaseNs[i] = 0;
+  }
+  for (int32_t i = 0; i < NMODELS; i++) {
+    updates[i] = 0;
+    negatives[i] = 0;
+    loss[i] = 0.0;
+  }
+}
+
+void ThreadMetrics::publishModel(
+    train_model model,
+    int64_t nupdates,
+    int64_t nnegatives,
+    real avgLoss) {
+  const int i = int(model);
+  updates[i].store(nupdates, std::memory_order_relaxed);
+  negatives[i].store(nnegatives, std::memory_order_relaxed);
+  loss[i].store(avgLoss, std::memory_order_relaxed);
+}
+
+TrainMetrics::TrainMetrics(int32_t nthreads) {
+  for (int32_t i = 0; i < nthreads; i++) {
+    threads_.push_back(std::unique_ptr<ThreadMetrics>(new ThreadMetrics()));
+  }
+}
+
+ThreadMetrics* TrainMetrics::thread(int32_t threadId) {
+  return threads_[threadId].get();
+}
+
+void TrainMetrics::writeJson(
+    std::ostream& out,
+    double seconds,
+    real progress,
+    int64_t tokens) const {
+  const std::memory_order relaxed = std::memory_order_relaxed;
+  int64_t examples[ThreadMetrics::NSTREAMS] = {};
+  int64_t streamNs[ThreadMetrics::NSTREAMS] = {};
+  int64_t phaseNs[ThreadMetrics::NPHASES] = {};
+  int64_t updates[ThreadMetrics::NMODELS] = {};
+  int64_t negatives[ThreadMetrics::NMODELS] = {};
+  double lossSum[ThreadMetrics::NMODELS] = {};
+
+  for (const auto& t : threads_) {
+    for (int32_t i = 0; i < ThreadMetrics::NSTREAMS; i++) {
+      examples[i] += t->examples[i].load(relaxed);
+      streamNs[i] += t->streamNs[i].load(relaxed);
+    }
+    for (int32_t i = 0; i < ThreadMetrics::NPHASES; i++) {
+      phaseNs[i] += t->phaseNs[i].load(relaxed);
+    }
+    for (int32_t i = 0; i < ThreadMetrics::NMODELS; i++) {
+      int64_t n = t->updates[i].load(relaxed);
+      updates[i] += n;
+      negatives[i] += t->negatives[i].load(relaxed);
+      // weight each thread's running mean loss by its number of updates
+      lossSum[i] += double(t->loss[i].load(relaxed)) * n;
+    }
+  }
+
+  out << std::fixed << std::setprecision(6);
+  out << "{\"time\":" << seconds << ",\"progress\":" << progress
+      << ",\"tokens\":" << tokens << ",\"threads\":" << threads_.size();
+
+  out << ",\"streams\":{";
+  for (int32_t i = 0; i < ThreadMetrics::NSTREAMS; i++) {
+    double perSec = streamNs[i] > 0 ? examples[i] * 1e9 / streamNs[i] : 0.0;
+    out << (i ? "," : "") << "\"" << kStreamNames[i] << "\":{"
+        << "\"examples\":" << examples[i] << ",\"ns\":" << streamNs[i]
+        << ",\"examplesPerSec\":" << perSec << "}";
+  }
+  out << "},\"phases\":{";
+  for (int32_t i = 0; i < ThreadMetrics::NPHASES; i++) {
+    out << (i ? "," : "") << "\"" << kPhaseNames[i] << "\":{\"ns\":"
+        << phaseNs[i] << "}";
+  }
+  out << "},\"models\":{";
+  for (int32_t i = 0; i < ThreadMetrics::NMODELS; i++) {
+    double loss = updates[i] > 0 ? lossSum[i] / updates[i] : 0.0;
+    out << (i ? "," : "") << "\"" << kModelNames[i] << "\":{"
+        << "\"updates\":" << updates[i] << ",\"negatives\":" << negatives[i]
+        << ",\"loss\":" << loss << "}";
+  }
+  out << "}}" << std::endl;
+}
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_(0), max_(0) {
+  for (int32_t i = 0; i < NBUCKETS; i++) {
+    buckets_[i] = 0;
+  }
+}
+
+int32_t LatencyHistogram::bucket(int64_t us) {
+  if (us < SUB_BUCKETS) {
+    return std::max<int64_t>(us, 0);
+  }
+  // the three bits below the leading one pick the sub-bucket
+  const int32_t log = 63 - __builtin_clzll(us);
+  const int32_t sub = (us >> (log - 3)) & (SUB_BUCKETS - 1);
+  return std::min((log - 2) * SUB_BUCKETS + sub, NBUCKETS - 1);
+}
+
+int64_t LatencyHistogram::upperBound(int32_t b) {
+  if (b < SUB_BUCKETS) {
+    return b;
+  }
+  const int32_t log = b / SUB_BUCKETS + 2;
+  const int64_t sub = b % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << (log - 3)) - 1;
+}
+
+void LatencyHistogram::record(int64_t us) {
+  buckets_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(us, std::memory_order_relaxed);
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (us > max &&
+         !max_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+  }
+}
+
+int64_t LatencyHistogram::count() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+  const int64_t n = count();
+  return n > 0 ? double(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+}
+
+int64_t LatencyHistogram::max() const {
+  return max_.load(std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::percentile(double q) const {
+  int64_t counts[NBUCKETS];
+  int64_t total = 0;
+  for (int32_t i = 0; i < NBUCKETS; i++) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  const int64_t rank = std::max<int64_t>(1, std::ceil(q * total));
+  int64_t seen = 0;
+  for (int32_t i = 0; i < NBUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return std::min(upperBound(i), max());
+    }
+  }
+  return max();
+}
+
+} // namespace uni_vec
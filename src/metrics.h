@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "real.h"
+
+namespace uni_vec {
+
+// Task streams of the training loop.
+enum class train_stream : int { trx = 0, view, sub, search };
+// Phases inside one training iteration.
+enum class train_phase : int { window = 0, update, userContext, itemContext };
+// The models each training thread drives.
+enum class train_model : int {
+  itemWord = 0,
+  userWord,
+  itemUser,
+  itemUserView,
+  itemSub,
+  itemSearch
+};
+
+/*
+ * Counters of one training thread. Only the owning thread writes them, so
+ * they are bumped with relaxed load/store pairs instead of locked adds, and
+ * the reporter reads them concurrently without stopping training.
+ */
+struct ThreadMetrics {
+  static const int32_t NSTREAMS = 4;
+  static const int32_t NPHASES = 4;
+  static const int32_t NMODELS = 6;
+
+  ThreadMetrics();
+
+  std::atomic<int64_t> examples[NSTREAMS];
+  std::atomic<int64_t> streamNs[NSTREAMS];
+  std::atomic<int64_t> phaseNs[NPHASES];
+  std::atomic<int64_t> updates[NMODELS];
+  std::atomic<int64_t> negatives[NMODELS];
+  std::atomic<real> loss[NMODELS];
+  // keep the counters of different threads on different cache lines
+  char pad_[64];
+
+  static inline void bump(std::atomic<int64_t>& counter, int64_t v) {
+    counter.store(
+        counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  void publishModel(train_model, int64_t, int64_t, real);
+
+  // Counter pointers for ScopedTimer; null when metrics are disabled.
+  static inline std::atomic<int64_t>* stream(
+      ThreadMetrics* m,
+      train_stream s) {
+    return m ? &m->streamNs[int(s)] : nullptr;
+  }
+  static inline std::atomic<int64_t>* phase(ThreadMetrics* m, train_phase p) {
+    return m ? &m->phaseNs[int(p)] : nullptr;
+  }
+};
+
+// Adds the lifetime of the scope in nanoseconds to a counter, if any.
+class ScopedTimer {
+ protected:
+  std::atomic<int64_t>* counter_;
+  std::chrono::steady_clock::time_point start_;
+
+ public:
+  explicit ScopedTimer(std::atomic<int64_t>* counter) : counter_(counter) {
+    if (counter_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedTimer() {
+    if (counter_) {
+      ThreadMetrics::bump(
+          *counter_,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_)
+              .count());
+    }
+  }
+};
+
+// Owns the per-thread counters and writes their aggregate as JSON lines.
+class TrainMetrics {
+ protected:
+  std::vector<std::unique_ptr<ThreadMetrics>> threads_;
+
+ public:
+  explicit TrainMetrics(int32_t);
+
+  ThreadMetrics* thread(int32_t);
+
+  void writeJson(std::ostream&, double, real, int64_t) const;
+};
+
+// Next-item ranking quality at a cutoff k, see UniVec::test. A held-out
+// item ranked beyond k counts as a miss for all three.
+struct RankingMetrics {
+  int64_t count = 0;
+  double hitRate = 0.0;
+  double ndcg = 0.0;
+  double mrr = 0.0;
+};
+
+/*
+ * Latency histogram for concurrent writers: eight buckets per power of two
+ * microseconds, so a percentile is known within 12.5%, counted with relaxed
+ * atomic adds and read without stopping the writers.
+ */
+class LatencyHistogram {
+ public:
+  static const int32_t SUB_BUCKETS = 8;
+  static const int32_t NBUCKETS = 40 * SUB_BUCKETS;
+
+ protected:
+  std::atomic<int64_t> buckets_[NBUCKETS];
+  std::atomic<int64_t> count_;
+  std::atomic<int64_t> sum_;
+  std::atomic<int64_t> max_;
+
+  static int32_t bucket(int64_t);
+  static int64_t upperBound(int32_t);
+
+ public:
+  LatencyHistogram();
+
+  void record(int64_t);
+
+  int64_t count() const;
+  double mean() const;
+  int64_t max() const;
+  // Upper bound of the bucket holding quantile q in [0, 1], 0 when empty.
+  int64_t percentile(double) const;
+};
+
+} // namespace uni_vec
@@ -7,6 +7,8 @@
  */
 
 #include "model.h"
+#include "kernel.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <iostream>
@@ -28,14 +30,35 @@ Model::Model(
     std::shared_ptr<Args> args,
     bool wordModel,
     int32_t seed)
+    : Model(
+          wi,
+          wi_1,
+          wo,
+          wo_1,
+          args,
+          wordModel,
+          seed,
+          std::make_shared<TrainContext>(args->dim, args->userDim)) {}
 
-    : hidden_(args->dim),
-      exHidden_(args->dim + args->userDim),
-      output_(wo->size(0)),
-      exOutput_(wo->size(0)),
-      grad_(args->dim),
-      gradUser_(args->dim),
-      exGrad_(args->dim + args->userDim),
+Model::Model(
+    std::shared_ptr<Matrix> wi,
+    std::shared_ptr<Matrix> wi_1,
+    std::shared_ptr<Matrix> wo,
+    std::shared_ptr<Matrix> wo_1,
+    std::shared_ptr<Args> args,
+    bool wordModel,
+    int32_t seed,
+    std::shared_ptr<TrainContext> ctx)
+
+    : ctx_(ctx),
+      hidden_(ctx->hidden),
+      grad_(ctx->grad),
+      gradUser_(ctx->gradUser),
+      exHidden_(ctx->exHidden),
+      exGrad_(ctx->exGrad),
+      output_(0),
+      t_sigmoid_(initSigmoid()),
+      t_log_(initLog()),
       rng(seed),
       quant_(false){
   // I_i
@@ -59,15 +82,16 @@ Model::Model(
   }
 
   hsz_ = args->dim;
-  
+  neg_ = args->neg;
+  skipUserContext_ = args->skipUserContext;
+  adagrad_ = args->optimizer == optimizer_name::adagrad;
+  frozenOutput_ = false;
+  frozenItemInput_ = false;
+
   negpos = 0;
   loss_ = 0.0;
   nexamples_ = 1;
-  t_sigmoid_.reserve(SIGMOID_TABLE_SIZE + 1);
-  t_log_.reserve(LOG_TABLE_SIZE + 1);
-  initSigmoid();
-  initLog();
-
+  nnegatives_ = 0;
 }
 
 void Model::setQuantizePointer(
@@ -195,6 +219,9 @@ void Model::computeOutputSoftmax(Vector& hidden, Vector& output) const {
 }
 
 void Model::computeOutputSoftmax() {
+  if (output_.size() != osz_) {
+    output_ = Vector(osz_);
+  }
   computeOutputSoftmax(hidden_, output_);
 }
 
@@ -384,103 +411,272 @@ void Model::updateConcat(
     int32_t item_pos,
     real lr
     ) {
-  assert(user_hist.size() > 2);
-  computeConcat(user_hist, user_pos, item_pos, exHidden_);
-  loss_ += computeConcatLoss(user_hist, user_pos, item_pos, lr);
+  updateConcatKernel<0>(user_hist, user_pos, item_pos, lr);
+}
 
-  nexamples_ += 1;
+void Model::updateMean(
+    const std::vector<int32_t>& user_hist,
+    int32_t user_pos,
+    int32_t item_pos,
+    real lr
+    ) {
+  updateMeanKernel<0>(user_hist, user_pos, item_pos, lr);
+}
 
-  const int32_t user_idx = user_hist[user_pos];
-  const int32_t ui_ncols = ui_->cols();
-  const int32_t ii_ncols = ii_->cols();
-  const real inv_hist_item_size = 1.0 / (real)(user_hist.size() - 2);
+void Model::updateMeanSum(
+    const std::vector<int32_t>& user_hist,
+    int32_t user_pos,
+    int32_t item_pos,
+    real lr
+    ) {
+  updateMeanSumKernel<0>(user_hist, user_pos, item_pos, lr);
+}
 
-  if (!args_->skipUserContext) {
-    for (int32_t col_idx = 0; col_idx < ui_ncols; col_idx++) {
-      ui_->at(user_idx, col_idx) += exGrad_[col_idx];
-    }
+// Row i of m += a * g. With SGD the learning rate is already folded into a
+// and the gradient vectors; with row-wise Adagrad they hold raw gradients and
+// the step becomes lr / sqrt(G_i).
+template <int32_t N>
+void Model::addToRow(Matrix& m, int64_t i, const real* g, real a, real lr) {
+  const int64_t n = m.cols();
+  if (adagrad_) {
+    a *= m.adagradStep(i, a * a * kernel::dot<N>(g, g, n), lr);
   }
+  kernel::axpy<N>(a, g, m.row(i), n);
+  m.markDirty(i);
+}
 
-  for (int32_t col_idx = 0; col_idx < ii_ncols; col_idx++) {
-    exGrad_[ui_ncols + col_idx] *= inv_hist_item_size;
+template <int32_t N>
+real Model::binaryLogisticRow(
+    Matrix& out,
+    const Vector& hidden,
+    Vector& grad,
+    int32_t target,
+    bool label,
+    real lr) {
+  const int64_t n = out.cols();
+  real* row = out.row(target);
+  real score = sigmoid(kernel::dot<N>(row, hidden.data(), n));
+  real alpha = (adagrad_ ? 1.0 : lr) * (real(label) - score);
+  kernel::axpy<N>(alpha, row, grad.data(), n);
+  if (!frozenOutput_) {
+    addToRow<N>(out, target, hidden.data(), alpha, lr);
   }
+  if (label) {
+    return -log(score);
+  } else {
+    return -log(1.0 - score);
+  }
+}
 
-  for (int32_t pos = 0; pos < user_hist.size(); pos++) {
-    if (pos == user_pos || pos == item_pos) continue;
-    int32_t item_input_index = user_hist[pos];
-    for (int32_t col_idx = 0; col_idx < ii_ncols; col_idx++) {
-      ii_->at(item_input_index, col_idx) += exGrad_[ui_ncols + col_idx];
-    }
+template <int32_t D>
+real Model::binaryLogisticMeanSumRow(
+    int32_t targetIdx,
+    int32_t userIdx,
+    bool label,
+    real lr) {
+  const int64_t n = io_->cols();
+  real* itemIn = ii_->row(targetIdx);
+  real* itemOut = io_->row(targetIdx);
+  real userItemScore = kernel::dot<D>(itemIn, ui_->row(userIdx), n);
+  real itemInOutScore = kernel::dot<D>(itemOut, hidden_.data(), n);
+
+  real score = sigmoid(userItemScore + itemInOutScore);
+  real alpha = (adagrad_ ? 1.0 : lr) * (real(label) - score);
+
+  kernel::axpy<D>(alpha, itemOut, grad_.data(), n);
+  kernel::axpy<D>(alpha, itemIn, gradUser_.data(), n);
+
+  // only update I_o by hidden, skip update I_i
+  if (!frozenOutput_) {
+    addToRow<D>(*io_, targetIdx, hidden_.data(), alpha, lr);
+  }
+
+  if (label) {
+    return -log(score);
+  } else {
+    return -log(1.0 - score);
   }
 }
 
-void Model::updateMean(
+template <int32_t D>
+void Model::updateKernel(
+    const std::vector<int32_t>& input,
+    const std::vector<int32_t>& targets,
+    int32_t targetIndex,
+    real lr) {
+  if (input.size() == 0) {
+    return;
+  }
+  const int64_t n = wi_->cols();
+  assert(D == 0 || n == D);
+  assert(hidden_.size() == n);
+  assert(targetIndex >= 0);
+  assert(targetIndex < osz_);
+
+  real* hidden = hidden_.data();
+  kernel::zero<D>(hidden, n);
+  for (auto it = input.cbegin(); it != input.cend(); ++it) {
+    kernel::add<D>(wi_->row(*it), hidden, n);
+  }
+  kernel::scale<D>(1.0 / input.size(), hidden, n);
+
+  const int32_t target = targets[targetIndex];
+  kernel::zero<D>(grad_.data(), n);
+  real loss = binaryLogisticRow<D>(*wo_, hidden_, grad_, target, true, lr);
+  for (int32_t i = 0; i < neg_; i++) {
+    loss += binaryLogisticRow<D>(
+        *wo_, hidden_, grad_, getNegative(target), false, lr);
+  }
+  loss_ += loss;
+  nexamples_ += 1;
+
+  for (auto it = input.cbegin(); it != input.cend(); ++it) {
+    addToRow<D>(*wi_, *it, grad_.data(), 1.0, lr);
+  }
+}
+
+template <int32_t D>
+void Model::updateConcatKernel(
     const std::vector<int32_t>& user_hist,
     int32_t user_pos,
     int32_t item_pos,
-    real lr
-    ) {
+    real lr) {
   assert(user_hist.size() > 2);
-  computeMean(user_hist, user_pos, item_pos, hidden_, false);
-  loss_ += computeMeanLoss(user_hist, user_pos, item_pos, lr);
-
-  nexamples_ += 1;
+  assert(user_pos == int32_t(1));
+  assert(item_pos == int32_t(0));
+  const int64_t ui_ncols = ui_->cols();
+  const int64_t ii_ncols = ii_->cols();
+  assert(D == 0 || (ui_ncols == D && ii_ncols == D));
+  assert(exHidden_.size() == ui_ncols + ii_ncols);
 
-  // devide by the 1 + num_items = hist.size() - 1
   const int32_t user_idx = user_hist[user_pos];
-  const real inv_hist_item_size = 1.0 / (real)(user_hist.size() - 1);
-  for (int32_t col_idx = 0; col_idx < grad_.size(); col_idx++) {
-    grad_[col_idx] *= inv_hist_item_size;
-  }
+  const int32_t target = user_hist[item_pos];
+  const real inv_hist_item_size = 1.0 / (real)(user_hist.size() - 2);
 
-  ui_->addRow(grad_, user_idx, 1.0);
+  // [U_i ; mean I_i]
+  real* userHidden = exHidden_.data();
+  real* itemHidden = exHidden_.data() + ui_ncols;
+  kernel::zero<D>(userHidden, ui_ncols);
+  kernel::zero<D>(itemHidden, ii_ncols);
+  if (!skipUserContext_) {
+    kernel::add<D>(ui_->row(user_idx), userHidden, ui_ncols);
+  }
+  for (size_t pos = 2; pos < user_hist.size(); pos++) {
+    kernel::add<D>(ii_->row(user_hist[pos]), itemHidden, ii_ncols);
+  }
+  kernel::scale<D>(inv_hist_item_size, itemHidden, ii_ncols);
 
- // add gard to item input
-  for (int32_t pos = 0; pos < user_hist.size(); pos++) {
-    if (pos == user_pos || pos == item_pos) continue;
+  kernel::zero<2 * D>(exGrad_.data(), ui_ncols + ii_ncols);
+  real loss =
+      binaryLogisticRow<2 * D>(*io_, exHidden_, exGrad_, target, true, lr);
+  for (int32_t i = 0; i < neg_; i++) {
+    loss += binaryLogisticRow<2 * D>(
+        *io_, exHidden_, exGrad_, getNegative(target), false, lr);
+  }
+  loss_ += loss;
+  nexamples_ += 1;
 
-    ii_->addRow(grad_, user_hist[pos], 1.0);
+  real* userGrad = exGrad_.data();
+  real* itemGrad = exGrad_.data() + ui_ncols;
+  if (!skipUserContext_) {
+    addToRow<D>(*ui_, user_idx, userGrad, 1.0, lr);
+  }
+  if (frozenItemInput_) {
+    return;
+  }
+  kernel::scale<D>(inv_hist_item_size, itemGrad, ii_ncols);
+  for (size_t pos = 2; pos < user_hist.size(); pos++) {
+    addToRow<D>(*ii_, user_hist[pos], itemGrad, 1.0, lr);
   }
 }
 
-void Model::updateMeanSum(
+template <int32_t D>
+void Model::updateMeanKernel(
     const std::vector<int32_t>& user_hist,
     int32_t user_pos,
     int32_t item_pos,
-    real lr
-    ) {
+    real lr) {
   assert(user_hist.size() > 2);
-  computeMean(user_hist, user_pos, item_pos, hidden_, true);
+  assert(user_pos == int32_t(1));
+  assert(item_pos == int32_t(0));
+  const int64_t n = ii_->cols();
+  assert(D == 0 || n == D);
+  assert(hidden_.size() == n && ui_->cols() == n);
 
-  const int32_t item_output_idx = user_hist[item_pos];
-  const int32_t userIdx = user_hist[user_pos];
+  const int32_t user_idx = user_hist[user_pos];
+  const int32_t target = user_hist[item_pos];
+  // devide by the 1 + num_items = hist.size() - 1
+  const real inv_hist_size = 1.0 / (real)(user_hist.size() - 1);
 
-  real loss = 0.0;
-  grad_.zero();
-  gradUser_.zero();
-  for (int32_t n = 0; n <= args_->neg; n++) {
-    if (n == 0) {
-      loss += binaryLogisticMeanSum(item_output_idx, userIdx, true, lr, grad_, gradUser_);
-    } else {
-      loss += binaryLogisticMeanSum(getNegative(item_output_idx), userIdx, false, lr, grad_, gradUser_);
-    }
+  real* hidden = hidden_.data();
+  kernel::zero<D>(hidden, n);
+  kernel::add<D>(ui_->row(user_idx), hidden, n);
+  for (size_t pos = 2; pos < user_hist.size(); pos++) {
+    kernel::add<D>(ii_->row(user_hist[pos]), hidden, n);
   }
+  kernel::scale<D>(inv_hist_size, hidden, n);
 
+  kernel::zero<D>(grad_.data(), n);
+  real loss = binaryLogisticRow<D>(*io_, hidden_, grad_, target, true, lr);
+  for (int32_t i = 0; i < neg_; i++) {
+    loss += binaryLogisticRow<D>(
+        *io_, hidden_, grad_, getNegative(target), false, lr);
+  }
   loss_ += loss;
   nexamples_ += 1;
 
+  kernel::scale<D>(inv_hist_size, grad_.data(), n);
+  addToRow<D>(*ui_, user_idx, grad_.data(), 1.0, lr);
+  if (frozenItemInput_) {
+    return;
+  }
+  for (size_t pos = 2; pos < user_hist.size(); pos++) {
+    addToRow<D>(*ii_, user_hist[pos], grad_.data(), 1.0, lr);
+  }
+}
+
+template <int32_t D>
+void Model::updateMeanSumKernel(
+    const std::vector<int32_t>& user_hist,
+    int32_t user_pos,
+    int32_t item_pos,
+    real lr) {
+  assert(user_hist.size() > 2);
+  assert(user_pos == int32_t(1));
+  assert(item_pos == int32_t(0));
+  const int64_t n = ii_->cols();
+  assert(D == 0 || n == D);
+  assert(hidden_.size() == n && ui_->cols() == n);
+
+  const int32_t userIdx = user_hist[user_pos];
+  const int32_t target = user_hist[item_pos];
   // devide by the num_items = hist.size() - 2
   const real inv_hist_item_size = 1.0 / (real)(user_hist.size() - 2);
-  for (int32_t col_idx = 0; col_idx < grad_.size(); col_idx++) {
-    grad_[col_idx] *= inv_hist_item_size;
+
+  real* hidden = hidden_.data();
+  kernel::zero<D>(hidden, n);
+  for (size_t pos = 2; pos < user_hist.size(); pos++) {
+    kernel::add<D>(ii_->row(user_hist[pos]), hidden, n);
   }
+  kernel::scale<D>(inv_hist_item_size, hidden, n);
 
-  for (int32_t pos = 0; pos < user_hist.size(); pos++) {
-    if (pos == user_pos || pos == item_pos) continue;
-    ii_->addRow(grad_, user_hist[pos], 1.0);
+  kernel::zero<D>(grad_.data(), n);
+  kernel::zero<D>(gradUser_.data(), n);
+  real loss = binaryLogisticMeanSumRow<D>(target, userIdx, true, lr);
+  for (int32_t i = 0; i < neg_; i++) {
+    loss += binaryLogisticMeanSumRow<D>(
+        getNegative(target), userIdx, false, lr);
   }
+  loss_ += loss;
+  nexamples_ += 1;
 
-  ui_->addRow(gradUser_, userIdx, 1.0);
+  if (!frozenItemInput_) {
+    kernel::scale<D>(inv_hist_item_size, grad_.data(), n);
+    for (size_t pos = 2; pos < user_hist.size(); pos++) {
+      addToRow<D>(*ii_, user_hist[pos], grad_.data(), 1.0, lr);
+    }
+  }
+  addToRow<D>(*ui_, userIdx, gradUser_.data(), 1.0, lr);
 }
 
 void Model::update(
@@ -512,27 +708,50 @@ void Model::setTargetCounts(const std::vector<int64_t>& counts) {
   initTableNegatives(counts);
 }
 
+void Model::setNegativeTable(
+    std::shared_ptr<const NegativeTable> negatives,
+    size_t pos) {
+  assert(args_->loss == loss_name::ns);
+  assert(negatives->size() > 0);
+  negatives_ = negatives;
+  negpos = pos % negatives_->size();
+}
+
+void Model::freezeOutput(bool frozen) {
+  frozenOutput_ = frozen;
+}
+
+void Model::freezeItemInput(bool frozen) {
+  frozenItemInput_ = frozen;
+}
+
 void Model::initTableNegatives(const std::vector<int64_t>& counts) {
+  setNegativeTable(std::make_shared<NegativeTable>(counts, rng()), 0);
+}
+
+NegativeTable::NegativeTable(
+    const std::vector<int64_t>& counts,
+    int32_t seed,
+    int64_t size) {
+  TraceScope trace("initTableNegatives", "negatives");
   real z = 0.0;
   for (size_t i = 0; i < counts.size(); i++) {
     z += pow(counts[i], 0.5);
   }
+  negatives_.reserve(size + counts.size());
   for (size_t i = 0; i < counts.size(); i++) {
     real c = pow(counts[i], 0.5);
-    for (size_t j = 0; j < c * NEGATIVE_TABLE_SIZE / z; j++) {
+    for (size_t j = 0; j < c * size / z; j++) {
       negatives_.push_back(i);
     }
   }
+  std::minstd_rand rng(seed);
   std::shuffle(negatives_.begin(), negatives_.end(), rng);
 }
 
 int32_t Model::getNegative(int32_t target) {
-  int32_t negative;
-  do {
-    negative = negatives_[negpos];
-    negpos = (negpos + 1) % negatives_.size();
-  } while (target == negative);
-  return negative;
+  nnegatives_++;
+  return negatives_->get(negpos, target);
 }
 
 void Model::buildTree(const std::vector<int64_t>& counts) {
@@ -583,18 +802,40 @@ real Model::getLoss() const {
   return loss_ / nexamples_;
 }
 
-void Model::initSigmoid() {
-  for (int i = 0; i < SIGMOID_TABLE_SIZE + 1; i++) {
-    real x = real(i * 2 * MAX_SIGMOID) / SIGMOID_TABLE_SIZE - MAX_SIGMOID;
-    t_sigmoid_.push_back(1.0 / (1.0 + std::exp(-x)));
-  }
+int64_t Model::getNumExamples() const {
+  // nexamples_ starts at 1 to keep getLoss defined
+  return nexamples_ - 1;
 }
 
-void Model::initLog() {
-  for (int i = 0; i < LOG_TABLE_SIZE + 1; i++) {
-    real x = (real(i) + 1e-5) / LOG_TABLE_SIZE;
-    t_log_.push_back(std::log(x));
-  }
+int64_t Model::getNumNegatives() const {
+  return nnegatives_;
+}
+
+const std::vector<real>& Model::initSigmoid() {
+  // built once and shared read-only by all models
+  static const std::vector<real> t_sigmoid = []() {
+    std::vector<real> table;
+    table.reserve(SIGMOID_TABLE_SIZE + 1);
+    for (int i = 0; i < SIGMOID_TABLE_SIZE + 1; i++) {
+      real x = real(i * 2 * MAX_SIGMOID) / SIGMOID_TABLE_SIZE - MAX_SIGMOID;
+      table.push_back(1.0 / (1.0 + std::exp(-x)));
+    }
+    return table;
+  }();
+  return t_sigmoid;
+}
+
+const std::vector<real>& Model::initLog() {
+  static const std::vector<real> t_log = []() {
+    std::vector<real> table;
+    table.reserve(LOG_TABLE_SIZE + 1);
+    for (int i = 0; i < LOG_TABLE_SIZE + 1; i++) {
+      real x = (real(i) + 1e-5) / LOG_TABLE_SIZE;
+      table.push_back(std::log(x));
+    }
+    return table;
+  }();
+  return t_log;
 }
 
 real Model::log(real x) const {
@@ -621,4 +862,19 @@ real Model::sigmoid(real x) const {
   }
 }
 
+#define UNI_VEC_INSTANTIATE_MODEL_KERNELS(D)                              \
+  template void Model::updateKernel<D>(                                   \
+      const std::vector<int32_t>&, const std::vector<int32_t>&, int32_t,  \
+      real);                                                              \
+  template void Model::updateConcatKernel<D>(                             \
+      const std::vector<int32_t>&, int32_t, int32_t, real);               \
+  template void Model::updateMeanKernel<D>(                               \
+      const std::vector<int32_t>&, int32_t, int32_t, real);               \
+  template void Model::updateMeanSumKernel<D>(                            \
+      const std::vector<int32_t>&, int32_t, int32_t, real);
+
+UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_INSTANTIATE_MODEL_KERNELS)
+
+#undef UNI_VEC_INSTANTIATE_MODEL_KERNELS
+
 } // namespace uni_vec
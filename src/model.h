@@ -29,6 +29,54 @@ struct Node {
   bool binary;
 };
 
+// Unigram^0.5 table for negative sampling. It is built once per target
+// vocabulary and shared read-only by every model and thread; each model only
+// keeps its own read position.
+class NegativeTable {
+ protected:
+  std::vector<int32_t> negatives_;
+
+ public:
+  // size entries, drawn with probability proportional to count^0.5; every
+  // word gets at least one if size is not smaller than the vocabulary.
+  NegativeTable(
+      const std::vector<int64_t>&,
+      int32_t,
+      int64_t size = NEGATIVE_TABLE_SIZE);
+
+  inline int32_t get(size_t& pos, int32_t target) const {
+    int32_t negative;
+    do {
+      negative = negatives_[pos];
+      pos = (pos + 1) % negatives_.size();
+    } while (target == negative);
+    return negative;
+  }
+
+  inline size_t size() const {
+    return negatives_.size();
+  }
+
+  static const int32_t NEGATIVE_TABLE_SIZE = 50000000;
+};
+
+// Hidden and gradient scratch buffers of one training thread. All models
+// driven by the thread share one context, so per-thread memory is O(dim).
+struct TrainContext {
+  TrainContext(int32_t dim, int32_t userDim)
+      : hidden(dim),
+        grad(dim),
+        gradUser(dim),
+        exHidden(dim + userDim),
+        exGrad(dim + userDim) {}
+
+  Vector hidden;
+  Vector grad;
+  Vector gradUser;
+  Vector exHidden;
+  Vector exGrad;
+};
+
 class Model {
  protected:
   // I_i
@@ -48,23 +96,31 @@ class Model {
   std::shared_ptr<QMatrix> qwo_;
   std::shared_ptr<Args> args_;
 
-  Vector hidden_;
-  Vector output_;
-  Vector grad_;
-  Vector gradUser_;
+  std::shared_ptr<TrainContext> ctx_;
+  Vector& hidden_;
+  Vector& grad_;
+  Vector& gradUser_;
 
-  Vector exHidden_;
-  Vector exGrad_;
-  Vector exOutput_;
+  Vector& exHidden_;
+  Vector& exGrad_;
+  // only allocated by the full softmax loss
+  Vector output_;
 
   int32_t hsz_;
   int32_t osz_;
+  int32_t neg_;
+  bool skipUserContext_;
+  bool adagrad_;
+  // rows read but never updated, see freezeOutput and freezeItemInput
+  bool frozenOutput_;
+  bool frozenItemInput_;
   real loss_;
   int64_t nexamples_;
-  std::vector<real> t_sigmoid_;
-  std::vector<real> t_log_;
+  int64_t nnegatives_;
+  const std::vector<real>& t_sigmoid_;
+  const std::vector<real>& t_log_;
   // used for negative sampling:
-  std::vector<int32_t> negatives_;
+  std::shared_ptr<const NegativeTable> negatives_;
   size_t negpos;
   // used for hierarchical softmax:
   std::vector<std::vector<int32_t>> paths;
@@ -76,11 +132,16 @@ class Model {
       const std::pair<real, int32_t>&);
 
   int32_t getNegative(int32_t target);
-  void initSigmoid();
-  void initLog();
+  static const std::vector<real>& initSigmoid();
+  static const std::vector<real>& initLog();
   void computeOutput(Vector&, Vector&) const;
 
-  static const int32_t NEGATIVE_TABLE_SIZE = 50000000;
+  template <int32_t N>
+  void addToRow(Matrix&, int64_t, const real*, real, real);
+  template <int32_t N>
+  real binaryLogisticRow(Matrix&, const Vector&, Vector&, int32_t, bool, real);
+  template <int32_t D>
+  real binaryLogisticMeanSumRow(int32_t, int32_t, bool, real);
 
  public:
 //   Model(
@@ -98,6 +159,16 @@ class Model {
       bool,
       int32_t);
 
+  Model(
+      std::shared_ptr<Matrix>,
+      std::shared_ptr<Matrix>,
+      std::shared_ptr<Matrix>,
+      std::shared_ptr<Matrix>,
+      std::shared_ptr<Args>,
+      bool,
+      int32_t,
+      std::shared_ptr<TrainContext>);
+
   real binaryLogistic(int32_t, bool, real);
   real binaryLogisticConcat(int32_t, bool, real);
   real binaryLogisticMean(int32_t, bool, real);
@@ -139,6 +210,25 @@ class Model {
       int32_t, 
       real);
 
+  // Negative sampling kernels specialised on the embedding dimension D
+  // (D == 0 is the generic runtime-dimension path). For concat, D is the
+  // size of both the user and the item half of the hidden vector.
+  template <int32_t D>
+  void updateKernel(
+      const std::vector<int32_t>&,
+      const std::vector<int32_t>&,
+      int32_t,
+      real);
+
+  template <int32_t D>
+  void updateConcatKernel(const std::vector<int32_t>&, int32_t, int32_t, real);
+
+  template <int32_t D>
+  void updateMeanKernel(const std::vector<int32_t>&, int32_t, int32_t, real);
+
+  template <int32_t D>
+  void updateMeanSumKernel(const std::vector<int32_t>&, int32_t, int32_t, real);
+
   real computeLoss(const std::vector<int32_t>&, int32_t, real);
   real computeConcatLoss(const std::vector<int32_t>&, 
                  int32_t, 
@@ -166,9 +256,18 @@ class Model {
   void computeOutputSoftmax();
 
   void setTargetCounts(const std::vector<int64_t>&);
+  void setNegativeTable(std::shared_ptr<const NegativeTable>, size_t);
+  // Only the input rows learn, as when fitting new rows against a trained
+  // output matrix.
+  void freezeOutput(bool);
+  // The item input rows of the user-item kernels do not learn either, only
+  // the user rows, as when folding in users.
+  void freezeItemInput(bool);
   void initTableNegatives(const std::vector<int64_t>&);
   void buildTree(const std::vector<int64_t>&);
   real getLoss() const;
+  int64_t getNumExamples() const;
+  int64_t getNumNegatives() const;
   real sigmoid(real) const;
   real log(real) const;
   real std_log(real) const;
@@ -0,0 +1,295 @@
+#include "neighbors.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "kernel.h"
+
+namespace uni_vec {
+
+namespace {
+
+// rows scored against every query of a batch before moving on, as many as
+// fit in 128KB so that they stay in L2 whatever the dimension: 1024 rows at
+// dim 32, 128 at dim 256
+const int64_t ROW_BLOCK_BYTES = 128 << 10;
+
+int64_t rowBlock(int64_t dim) {
+  return std::max<int64_t>(1, ROW_BLOCK_BYTES / (dim * int64_t(sizeof(real))));
+}
+
+// BlockedSearch: queries of a block and base rows of a tile, the products of
+// a block and a tile, 1MB, are consumed while still in L2; scores are
+// checked against the heaps SELECT_CHUNK at a time
+const int64_t QUERY_BLOCK = 128;
+const int64_t TILE_ROWS = 2048;
+const int64_t SELECT_CHUNK = 32;
+
+typedef Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    RowMatrix;
+typedef Eigen::Map<const RowMatrix, 0, Eigen::OuterStride<>> RowMap;
+
+} // namespace
+
+ExactSearch::ExactSearch(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim,
+    bool cosine)
+    : base_(base), offset_(offset), dim_(dim), cosine_(cosine) {
+  if (offset < 0 || dim <= 0 || offset + dim > base->cols()) {
+    throw std::invalid_argument("Columns out of the range of the matrix.");
+  }
+  if (cosine_) {
+    invNorms_.resize(base_->rows());
+    for (int64_t i = 0; i < base_->rows(); i++) {
+      const real* x = base_->row(i) + offset_;
+      real norm = std::sqrt(kernel::dot<0>(x, x, dim_));
+      invNorms_[i] = norm > 0 ? 1.0 / norm : 0.0;
+    }
+  }
+}
+
+template <int32_t D>
+void ExactSearch::scan(
+    const real* queries,
+    int64_t nq,
+    int64_t begin,
+    int64_t end,
+    std::vector<TopK>& heaps) const {
+  const int64_t n = dim_;
+  const int64_t block = rowBlock(n);
+  for (int64_t b = begin; b < end; b += block) {
+    const int64_t e = std::min(end, b + block);
+    for (int64_t q = 0; q < nq; q++) {
+      const real* x = queries + q * n;
+      TopK& heap = heaps[q];
+      real threshold = heap.threshold();
+      for (int64_t i = b; i < e; i++) {
+        real score = kernel::dot<D>(base_->row(i) + offset_, x, n);
+        if (cosine_) {
+          score *= invNorms_[i];
+        }
+        if (score >= threshold) {
+          heap.push(score, i);
+          threshold = heap.threshold();
+        }
+      }
+    }
+  }
+}
+
+std::vector<std::vector<ScoredId>> ExactSearch::search(
+    const real* queries,
+    int64_t nq,
+    int32_t k,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  const int64_t m = base_->rows();
+  std::vector<real> normalized;
+  if (cosine_) {
+    normalized.assign(queries, queries + nq * dim_);
+    for (int64_t q = 0; q < nq; q++) {
+      real* x = normalized.data() + q * dim_;
+      real norm = std::sqrt(kernel::dot<0>(x, x, dim_));
+      if (norm > 0) {
+        kernel::scale<0>(1.0 / norm, x, dim_);
+      }
+    }
+    queries = normalized.data();
+  }
+
+  void (ExactSearch::*scanFn)(
+      const real*, int64_t, int64_t, int64_t, std::vector<TopK>&) const;
+  switch (dim_) {
+#define UNI_VEC_SELECT_SCAN(D)           \
+    case D:                              \
+      scanFn = &ExactSearch::scan<D>;    \
+      break;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_SELECT_SCAN)
+#undef UNI_VEC_SELECT_SCAN
+    default:
+      scanFn = &ExactSearch::scan<0>;
+  }
+
+  // banned rows are dropped after the scan, keep enough to still have k
+  const int64_t block = rowBlock(dim_);
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, (m + block - 1) / block));
+  std::vector<std::vector<TopK>> heaps(nthreads);
+  for (auto& threadHeaps : heaps) {
+    threadHeaps.reserve(nq);
+    for (int64_t q = 0; q < nq; q++) {
+      threadHeaps.emplace_back(k + (bans.empty() ? 0 : bans[q].size()));
+    }
+  }
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      (this->*scanFn)(
+          queries, nq, t * m / nthreads, (t + 1) * m / nthreads, heaps[t]);
+    }));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  std::vector<std::vector<ScoredId>> results(nq);
+  for (int64_t q = 0; q < nq; q++) {
+    for (int32_t t = 1; t < nthreads; t++) {
+      heaps[0][q].merge(heaps[t][q]);
+    }
+    for (const auto& p : heaps[0][q].take()) {
+      if (int32_t(results[q].size()) == k) {
+        break;
+      }
+      if (bans.empty() ||
+          !std::binary_search(bans[q].begin(), bans[q].end(), p.second)) {
+        results[q].push_back(p);
+      }
+    }
+  }
+  return results;
+}
+
+BlockedSearch::BlockedSearch(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim)
+    : BlockedSearch(std::vector<Part>{{base, offset, dim}}) {}
+
+BlockedSearch::BlockedSearch(const std::vector<Part>& parts)
+    : parts_(parts), dim_(0) {
+  if (parts_.empty()) {
+    throw std::invalid_argument("Nothing to search.");
+  }
+  for (const auto& part : parts_) {
+    if (part.offset < 0 || part.dim <= 0 ||
+        part.offset + part.dim > part.base->cols()) {
+      throw std::invalid_argument("Columns out of the range of the matrix.");
+    }
+    if (part.base->rows() != parts_[0].base->rows()) {
+      throw std::invalid_argument("Parts of the base differ in rows.");
+    }
+    dim_ += part.dim;
+  }
+}
+
+std::vector<std::vector<ScoredId>> BlockedSearch::search(
+    const Matrix& queries,
+    int64_t qOffset,
+    const std::vector<int64_t>& ids,
+    int32_t k,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  const int64_t nq = ids.size();
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  if (qOffset < 0 || qOffset + dim_ > queries.cols()) {
+    throw std::invalid_argument("Query columns out of the range of the matrix.");
+  }
+  for (int64_t id : ids) {
+    if (id < 0 || id >= queries.rows()) {
+      throw std::invalid_argument(
+          "Query " + std::to_string(id) + " is out of range.");
+    }
+  }
+  const int64_t m = parts_[0].base->rows();
+  const int64_t blocks = (nq + QUERY_BLOCK - 1) / QUERY_BLOCK;
+  std::vector<std::vector<ScoredId>> results(nq);
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    RowMatrix gathered(QUERY_BLOCK, dim_);
+    RowMatrix products(QUERY_BLOCK, TILE_ROWS);
+    for (int64_t blk = next++; blk < blocks; blk = next++) {
+      const int64_t begin = blk * QUERY_BLOCK;
+      const int64_t nb = std::min(QUERY_BLOCK, nq - begin);
+      // consecutive rows are used in place, others copied to one block
+      const real* qData = queries.row(ids[begin]) + qOffset;
+      int64_t qStride = queries.cols();
+      int64_t run = 1;
+      while (run < nb && ids[begin + run] == ids[begin] + run) {
+        run++;
+      }
+      if (run < nb) {
+        for (int64_t q = 0; q < nb; q++) {
+          std::copy(
+              queries.row(ids[begin + q]) + qOffset,
+              queries.row(ids[begin + q]) + qOffset + dim_,
+              gathered.row(q).data());
+        }
+        qData = gathered.data();
+        qStride = dim_;
+      }
+      RowMap block(qData, nb, dim_, Eigen::OuterStride<>(qStride));
+
+      std::vector<TopK> heaps(nb, TopK(k));
+      for (int64_t t = 0; t < m; t += TILE_ROWS) {
+        const int64_t nt = std::min(TILE_ROWS, m - t);
+        int64_t col = 0;
+        for (size_t p = 0; p < parts_.size(); p++) {
+          const Part& part = parts_[p];
+          RowMap tile(
+              part.base->row(t) + part.offset,
+              nt,
+              part.dim,
+              Eigen::OuterStride<>(part.base->cols()));
+          if (p == 0) {
+            products.topLeftCorner(nb, nt).noalias() =
+                block.middleCols(col, part.dim) * tile.transpose();
+          } else {
+            products.topLeftCorner(nb, nt).noalias() +=
+                block.middleCols(col, part.dim) * tile.transpose();
+          }
+          col += part.dim;
+        }
+        for (int64_t q = 0; q < nb; q++) {
+          const real* scores = products.row(q).data();
+          const std::vector<int64_t>* ban = bans.empty() ? nullptr : &bans[begin + q];
+          TopK& heap = heaps[q];
+          real threshold = heap.threshold();
+          for (int64_t c = 0; c < nt; c += SELECT_CHUNK) {
+            const int64_t ce = std::min(nt, c + SELECT_CHUNK);
+            // most chunks hold no candidate, one vectorised max rejects them
+            real best = scores[c];
+            for (int64_t j = c + 1; j < ce; j++) {
+              best = std::max(best, scores[j]);
+            }
+            if (best < threshold) {
+              continue;
+            }
+            for (int64_t j = c; j < ce; j++) {
+              if (scores[j] >= threshold &&
+                  !(ban && std::binary_search(ban->begin(), ban->end(), t + j))) {
+                heap.push(scores[j], t + j);
+                threshold = heap.threshold();
+              }
+            }
+          }
+        }
+      }
+      for (int64_t q = 0; q < nb; q++) {
+        results[begin + q] = heaps[q].take();
+      }
+    }
+  };
+  const int32_t nthreads = std::max<int64_t>(1, std::min<int64_t>(thread, blocks));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return results;
+}
+
+} // namespace uni_vec
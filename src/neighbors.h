@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "real.h"
+
+namespace uni_vec {
+
+// (score, row id) of a retrieved row
+typedef std::pair<real, int64_t> ScoredId;
+
+// Higher score first, lower id first among equal scores, so that results do
+// not depend on how the scan was split between threads.
+inline bool betterScore(const ScoredId& a, const ScoredId& b) {
+  return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+/*
+ * The k best (score, id) pairs pushed so far. The heap is ordered so that
+ * its top is the current k-th best, most candidates are rejected by a single
+ * compare against it.
+ */
+class TopK {
+ protected:
+  size_t k_;
+  std::vector<ScoredId> heap_;
+
+ public:
+  explicit TopK(int32_t k) : k_(std::max(0, k)) {
+    heap_.reserve(k_);
+  }
+
+  inline size_t size() const {
+    return heap_.size();
+  }
+
+  // score a candidate has to beat to be kept
+  inline real threshold() const {
+    return heap_.size() < k_ ? -std::numeric_limits<real>::infinity()
+                             : heap_.front().first;
+  }
+
+  inline void push(real score, int64_t id) {
+    if (heap_.size() < k_) {
+      heap_.emplace_back(score, id);
+      std::push_heap(heap_.begin(), heap_.end(), betterScore);
+    } else if (k_ > 0 && betterScore(ScoredId(score, id), heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), betterScore);
+      heap_.back() = ScoredId(score, id);
+      std::push_heap(heap_.begin(), heap_.end(), betterScore);
+    }
+  }
+
+  inline void merge(const TopK& other) {
+    for (const auto& p : other.heap_) {
+      push(p.first, p.second);
+    }
+  }
+
+  // best first; leaves the heap empty
+  std::vector<ScoredId> take() {
+    std::vector<ScoredId> out;
+    out.swap(heap_);
+    std::sort(out.begin(), out.end(), betterScore);
+    return out;
+  }
+};
+
+/*
+ * Exact top-k retrieval by inner product, or cosine, over columns
+ * [offset, offset + dim) of every row of a matrix. Rows are scanned in
+ * blocks small enough to stay in L1/L2 while all queries of a batch are
+ * scored against them; every thread scans its own range of rows into its
+ * own heaps, merged once at the end.
+ */
+class ExactSearch {
+ protected:
+  std::shared_ptr<const Matrix> base_;
+  int64_t offset_;
+  int64_t dim_;
+  bool cosine_;
+  // 1 / |row| of the scanned columns, only for cosine
+  std::vector<real> invNorms_;
+
+  template <int32_t D>
+  void scan(const real*, int64_t, int64_t, int64_t, std::vector<TopK>&) const;
+
+ public:
+  ExactSearch(std::shared_ptr<const Matrix>, int64_t, int64_t, bool);
+
+  inline int64_t dim() const {
+    return dim_;
+  }
+  inline bool cosine() const {
+    return cosine_;
+  }
+
+  // Best k rows for each of nq queries of dim reals each, stored one after
+  // the other. bans, empty or one sorted list per query, holds rows that
+  // must not be returned.
+  std::vector<std::vector<ScoredId>> search(
+      const real*,
+      int64_t,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+};
+
+/*
+ * Exact top-k retrieval by inner product for many queries at once, as
+ * blocked matrix products. A block of query rows is multiplied with tiles
+ * of base rows small enough to stay in cache, both mapped in place as Eigen
+ * matrices, and every product is folded into the running heaps of the
+ * block before the next tile. Each thread takes whole query blocks, so the
+ * base is streamed once per block.
+ *
+ * The base may be split in parts, column ranges of matrices with the same
+ * rows: row i is then the concatenation of row i of every part.
+ */
+class BlockedSearch {
+ public:
+  struct Part {
+    std::shared_ptr<const Matrix> base;
+    int64_t offset;
+    int64_t dim;
+  };
+
+ protected:
+  std::vector<Part> parts_;
+  int64_t dim_;
+
+ public:
+  BlockedSearch(std::shared_ptr<const Matrix>, int64_t, int64_t);
+  explicit BlockedSearch(const std::vector<Part>&);
+
+  inline int64_t dim() const {
+    return dim_;
+  }
+
+  // Best k base rows for each of the rows ids of queries, whose columns
+  // [qOffset, qOffset + dim) are the query vectors. bans is empty or one
+  // sorted list per query, banned rows never enter the heaps.
+  std::vector<std::vector<ScoredId>> search(
+      const Matrix&,
+      int64_t,
+      const std::vector<int64_t>&,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+};
+
+} // namespace uni_vec
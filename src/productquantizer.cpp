@@ -9,13 +9,41 @@
 #include "productquantizer.h"
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <numeric>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 namespace uni_vec {
 
+namespace {
+
+// Calls fn(begin, end) over chunks of [0, n) on up to thread threads.
+template <typename Fn>
+void forEachChunk(int64_t n, int32_t thread, Fn fn) {
+  const int64_t CHUNK = 1024;
+  const int32_t nthreads = std::max<int64_t>(
+      1, std::min<int64_t>(thread, (n + CHUNK - 1) / CHUNK));
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    for (int64_t b = next.fetch_add(CHUNK); b < n; b = next.fetch_add(CHUNK)) {
+      fn(b, std::min(n, b + CHUNK));
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int32_t t = 1; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto& th : threads) {
+    th.join();
+  }
+}
+
+} // namespace
+
 real distL2(const real* x, const real* y, int32_t d) {
   real dist = 0;
   for (auto i = 0; i < d; i++) {
@@ -29,8 +57,7 @@ ProductQuantizer::ProductQuantizer(int32_t dim, int32_t dsub)
     : dim_(dim),
       nsubq_(dim / dsub),
       dsub_(dsub),
-      centroids_(dim * ksub_),
-      rng(seed_) {
+      centroids_(dim * ksub_) {
   lastdsub_ = dim_ % dsub;
   if (lastdsub_ == 0) {
     lastdsub_ = dsub_;
@@ -72,15 +99,64 @@ real ProductQuantizer::assign_centroid(
   return dis;
 }
 
+void ProductQuantizer::transposeCentroids(
+    const real* c,
+    int32_t d,
+    real* ct,
+    real* norms) const {
+  for (auto k = 0; k < ksub_; k++) {
+    norms[k] = 0.0;
+    for (auto j = 0; j < d; j++) {
+      ct[j * ksub_ + k] = c[k * d + j];
+      norms[k] += c[k * d + j] * c[k * d + j];
+    }
+  }
+}
+
+uint8_t ProductQuantizer::nearest(
+    const real* x,
+    const real* ct,
+    const real* norms,
+    int32_t d,
+    real* dist) const {
+  for (auto k = 0; k < ksub_; k++) {
+    dist[k] = norms[k];
+  }
+  for (auto j = 0; j < d; j++) {
+    const real a = -2.0 * x[j];
+    const real* row = ct + j * ksub_;
+    for (auto k = 0; k < ksub_; k++) {
+      dist[k] += a * row[k];
+    }
+  }
+  real best = dist[0];
+  for (auto k = 1; k < ksub_; k++) {
+    best = std::min(best, dist[k]);
+  }
+  for (auto k = 0; k < ksub_; k++) {
+    if (dist[k] == best) {
+      return k;
+    }
+  }
+  return 0;
+}
+
 void ProductQuantizer::Estep(
     const real* x,
     const real* centroids,
     uint8_t* codes,
     int32_t d,
-    int32_t n) const {
-  for (auto i = 0; i < n; i++) {
-    assign_centroid(x + i * d, centroids, codes + i, d);
-  }
+    int32_t n,
+    int32_t thread) const {
+  std::vector<real> ct(d * ksub_);
+  std::vector<real> norms(ksub_);
+  transposeCentroids(centroids, d, ct.data(), norms.data());
+  forEachChunk(n, thread, [&](int64_t begin, int64_t end) {
+    std::vector<real> dist(ksub_);
+    for (auto i = begin; i < end; i++) {
+      codes[i] = nearest(x + i * d, ct.data(), norms.data(), d, dist.data());
+    }
+  });
 }
 
 void ProductQuantizer::MStep(
@@ -88,7 +164,8 @@ void ProductQuantizer::MStep(
     real* centroids,
     const uint8_t* codes,
     int32_t d,
-    int32_t n) {
+    int32_t n,
+    std::minstd_rand& rng) const {
   std::vector<int32_t> nelts(ksub_, 0);
   memset(centroids, 0, sizeof(real) * d * ksub_);
   const real* x = x0;
@@ -132,7 +209,13 @@ void ProductQuantizer::MStep(
   }
 }
 
-void ProductQuantizer::kmeans(const real* x, real* c, int32_t n, int32_t d) {
+void ProductQuantizer::kmeans(
+    const real* x,
+    real* c,
+    int32_t n,
+    int32_t d,
+    std::minstd_rand& rng,
+    int32_t thread) const {
   std::vector<int32_t> perm(n, 0);
   std::iota(perm.begin(), perm.end(), 0);
   std::shuffle(perm.begin(), perm.end(), rng);
@@ -141,36 +224,48 @@ void ProductQuantizer::kmeans(const real* x, real* c, int32_t n, int32_t d) {
   }
   auto codes = std::vector<uint8_t>(n);
   for (auto i = 0; i < niter_; i++) {
-    Estep(x, c, codes.data(), d, n);
-    MStep(x, c, codes.data(), d, n);
+    Estep(x, c, codes.data(), d, n, thread);
+    MStep(x, c, codes.data(), d, n, rng);
   }
 }
 
-void ProductQuantizer::train(int32_t n, const real* x) {
+void ProductQuantizer::train(int32_t n, const real* x, int32_t thread) {
   if (n < ksub_) {
     throw std::invalid_argument(
         "Matrix too small for quantization, must have at least " +
         std::to_string(ksub_) + " rows");
   }
-  std::vector<int32_t> perm(n, 0);
-  std::iota(perm.begin(), perm.end(), 0);
-  auto d = dsub_;
-  auto np = std::min(n, max_points_);
-  auto xslice = std::vector<real>(np * dsub_);
-  for (auto m = 0; m < nsubq_; m++) {
-    if (m == nsubq_ - 1) {
-      d = lastdsub_;
-    }
-    if (np != n) {
-      std::shuffle(perm.begin(), perm.end(), rng);
-    }
-    for (auto j = 0; j < np; j++) {
-      memcpy(
-          xslice.data() + j * d,
-          x + perm[j] * dim_ + m * dsub_,
-          d * sizeof(real));
+  const auto np = std::min(n, max_points_);
+  // threads left over by the sub-quantizers split their E-steps
+  const int32_t workers = std::max(1, std::min(thread, nsubq_));
+  const int32_t estepThreads = std::max(1, thread / workers);
+  std::atomic<int32_t> next(0);
+  auto worker = [&]() {
+    std::vector<int32_t> perm(n, 0);
+    auto xslice = std::vector<real>(np * dsub_);
+    for (int32_t m = next++; m < nsubq_; m = next++) {
+      const int32_t d = m == nsubq_ - 1 ? lastdsub_ : dsub_;
+      std::minstd_rand rng(seed_ + m);
+      std::iota(perm.begin(), perm.end(), 0);
+      if (np != n) {
+        std::shuffle(perm.begin(), perm.end(), rng);
+      }
+      for (auto j = 0; j < np; j++) {
+        memcpy(
+            xslice.data() + j * d,
+            x + int64_t(perm[j]) * dim_ + m * dsub_,
+            d * sizeof(real));
+      }
+      kmeans(xslice.data(), get_centroids(m, 0), np, d, rng, estepThreads);
     }
-    kmeans(xslice.data(), get_centroids(m, 0), np, d);
+  };
+  std::vector<std::thread> threads;
+  for (int32_t t = 1; t < workers; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto& th : threads) {
+    th.join();
   }
 }
 
@@ -222,14 +317,38 @@ void ProductQuantizer::compute_code(const real* x, uint8_t* code) const {
   }
 }
 
-void ProductQuantizer::compute_codes(const real* x, uint8_t* codes, int32_t n)
-    const {
-  for (auto i = 0; i < n; i++) {
-    compute_code(x + i * dim_, codes + i * nsubq_);
+void ProductQuantizer::compute_codes(
+    const real* x,
+    uint8_t* codes,
+    int32_t n,
+    int32_t thread) const {
+  std::vector<real> ct(dim_ * ksub_);
+  std::vector<real> norms(nsubq_ * ksub_);
+  for (auto m = 0; m < nsubq_; m++) {
+    const int32_t d = m == nsubq_ - 1 ? lastdsub_ : dsub_;
+    transposeCentroids(
+        get_centroids(m, 0),
+        d,
+        ct.data() + m * dsub_ * ksub_,
+        norms.data() + m * ksub_);
   }
+  forEachChunk(n, thread, [&](int64_t begin, int64_t end) {
+    std::vector<real> dist(ksub_);
+    for (auto i = begin; i < end; i++) {
+      for (auto m = 0; m < nsubq_; m++) {
+        const int32_t d = m == nsubq_ - 1 ? lastdsub_ : dsub_;
+        codes[i * nsubq_ + m] = nearest(
+            x + i * dim_ + m * dsub_,
+            ct.data() + m * dsub_ * ksub_,
+            norms.data() + m * ksub_,
+            d,
+            dist.data());
+      }
+    }
+  });
 }
 
-void ProductQuantizer::save(std::ostream& out) {
+void ProductQuantizer::save(std::ostream& out) const {
   out.write((char*)&dim_, sizeof(dim_));
   out.write((char*)&nsubq_, sizeof(nsubq_));
   out.write((char*)&dsub_, sizeof(dsub_));
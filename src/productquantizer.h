@@ -36,27 +36,53 @@ class ProductQuantizer {
 
   std::vector<real> centroids_;
 
-  std::minstd_rand rng;
+  // The ksub centroids of d columns at c, laid out by column, ct[j * ksub +
+  // k], and their squared norms.
+  void transposeCentroids(const real*, int32_t, real*, real*) const;
+  // Nearest centroid to x by ||c||^2 - 2 x.c, both loops running over the
+  // transposed centroids so that they vectorize; dist has ksub entries.
+  uint8_t nearest(const real*, const real*, const real*, int32_t, real*) const;
 
  public:
   ProductQuantizer() {}
   ProductQuantizer(int32_t, int32_t);
 
+  inline int32_t get_nsubq() const {
+    return nsubq_;
+  }
+  inline int32_t get_dsub() const {
+    return dsub_;
+  }
+  inline int32_t get_ksub() const {
+    return ksub_;
+  }
+
   real* get_centroids(int32_t, uint8_t);
   const real* get_centroids(int32_t, uint8_t) const;
 
   real assign_centroid(const real*, const real*, uint8_t*, int32_t) const;
-  void Estep(const real*, const real*, uint8_t*, int32_t, int32_t) const;
-  void MStep(const real*, real*, const uint8_t*, int32_t, int32_t);
-  void kmeans(const real*, real*, int32_t, int32_t);
-  void train(int, const real*);
+  // Rows are spread over the last argument, a number of threads.
+  void Estep(const real*, const real*, uint8_t*, int32_t, int32_t, int32_t)
+      const;
+  void MStep(
+      const real*,
+      real*,
+      const uint8_t*,
+      int32_t,
+      int32_t,
+      std::minstd_rand&) const;
+  void kmeans(const real*, real*, int32_t, int32_t, std::minstd_rand&, int32_t)
+      const;
+  // Sub-quantizers are trained in parallel, each from its own seed, so the
+  // result does not depend on thread.
+  void train(int, const real*, int32_t thread = 1);
 
   real mulcode(const Vector&, const uint8_t*, int32_t, real) const;
   void addcode(Vector&, const uint8_t*, int32_t, real) const;
   void compute_code(const real*, uint8_t*) const;
-  void compute_codes(const real*, uint8_t*, int32_t) const;
+  void compute_codes(const real*, uint8_t*, int32_t, int32_t thread = 1) const;
 
-  void save(std::ostream&);
+  void save(std::ostream&) const;
   void load(std::istream&);
 };
 
@@ -9,13 +9,18 @@
 #include "qmatrix.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 
 namespace uni_vec {
 
 QMatrix::QMatrix() : qnorm_(false), m_(0), n_(0), codesize_(0) {}
 
-QMatrix::QMatrix(const Matrix& mat, int32_t dsub, bool qnorm)
+QMatrix::QMatrix(
+    const Matrix& mat,
+    int32_t dsub,
+    bool qnorm,
+    int32_t thread)
     : qnorm_(qnorm),
       m_(mat.size(0)),
       n_(mat.size(1)),
@@ -26,7 +31,7 @@ QMatrix::QMatrix(const Matrix& mat, int32_t dsub, bool qnorm)
     norm_codes_.resize(m_);
     npq_ = std::unique_ptr<ProductQuantizer>(new ProductQuantizer(1, 1));
   }
-  quantize(mat);
+  quantize(mat, thread);
 }
 
 void QMatrix::quantizeNorm(const Vector& norms) {
@@ -37,19 +42,22 @@ void QMatrix::quantizeNorm(const Vector& norms) {
   npq_->compute_codes(dataptr, norm_codes_.data(), m_);
 }
 
-void QMatrix::quantize(const Matrix& matrix) {
+void QMatrix::quantize(const Matrix& matrix, int32_t thread) {
   assert(m_ == matrix.size(0));
   assert(n_ == matrix.size(1));
-  Matrix temp(matrix);
+  const real* dataptr = matrix.data();
+  // a copy of the rows to normalize, the matrix may be a read-only mapping
+  Matrix temp(qnorm_ ? m_ : 0, n_);
   if (qnorm_) {
+    std::copy(dataptr, dataptr + m_ * n_, temp.data());
     Vector norms(temp.size(0));
     temp.l2NormRow(norms);
     temp.divideRow(norms);
     quantizeNorm(norms);
+    dataptr = temp.data();
   }
-  auto dataptr = temp.data();
-  pq_->train(m_, dataptr);
-  pq_->compute_codes(dataptr, codes_.data(), m_);
+  pq_->train(m_, dataptr, thread);
+  pq_->compute_codes(dataptr, codes_.data(), m_, thread);
 }
 
 void QMatrix::addToVector(Vector& x, int32_t t) const {
@@ -71,6 +79,17 @@ real QMatrix::dotRow(const Vector& vec, int64_t i) const {
   return pq_->mulcode(vec, codes_.data(), i, norm);
 }
 
+std::shared_ptr<Matrix> QMatrix::decode() const {
+  auto matrix = std::make_shared<Matrix>(m_, n_);
+  Vector row(n_);
+  for (int64_t i = 0; i < m_; i++) {
+    row.zero();
+    addToVector(row, i);
+    std::copy(row.data(), row.data() + n_, matrix->row(i));
+  }
+  return matrix;
+}
+
 int64_t QMatrix::getM() const {
   return m_;
 }
@@ -79,7 +98,7 @@ int64_t QMatrix::getN() const {
   return n_;
 }
 
-void QMatrix::save(std::ostream& out) {
+void QMatrix::save(std::ostream& out) const {
   out.write((char*)&qnorm_, sizeof(qnorm_));
   out.write((char*)&m_, sizeof(m_));
   out.write((char*)&n_, sizeof(n_));
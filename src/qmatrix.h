@@ -42,18 +42,22 @@ class QMatrix {
 
  public:
   QMatrix();
-  QMatrix(const Matrix&, int32_t, bool);
+  // Quantizes the matrix with sub-quantizers of dsub columns, on thread
+  // threads.
+  QMatrix(const Matrix&, int32_t, bool, int32_t thread = 1);
 
   int64_t getM() const;
   int64_t getN() const;
 
   void quantizeNorm(const Vector&);
-  void quantize(const Matrix&);
+  void quantize(const Matrix&, int32_t thread = 1);
 
   void addToVector(Vector& x, int32_t t) const;
   real dotRow(const Vector&, int64_t) const;
+  // The reconstructed rows.
+  std::shared_ptr<Matrix> decode() const;
 
-  void save(std::ostream&);
+  void save(std::ostream&) const;
   void load(std::istream&);
 };
 
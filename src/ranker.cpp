@@ -0,0 +1,219 @@
+#include "ranker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "kernel.h"
+
+namespace uni_vec {
+
+namespace {
+
+// candidates scored between the prefetch of a row and its use
+const size_t PREFETCH_DISTANCE = 16;
+
+inline void prefetchRow(const real* row, int64_t n) {
+  const char* p = reinterpret_cast<const char*>(row);
+  for (int64_t off = 0; off < n * int64_t(sizeof(real)); off += 64) {
+    __builtin_prefetch(p + off);
+  }
+}
+
+} // namespace
+
+Ranker::Ranker(
+    combine_method combine,
+    bool userContext,
+    std::shared_ptr<const Matrix> userInput,
+    std::shared_ptr<const Matrix> itemInput,
+    std::shared_ptr<const Matrix> itemOutput)
+    : combine_(combine),
+      userContext_(userContext),
+      userInput_(userInput),
+      itemInput_(itemInput),
+      itemOutput_(itemOutput) {
+  const int64_t dim = itemInput_->cols();
+  const int64_t userDim = userInput_->cols();
+  const int64_t hidden =
+      combine_ == combine_method::concat ? userDim + dim : dim;
+  if (itemOutput_->cols() != hidden ||
+      (combine_ != combine_method::concat && userDim != dim) ||
+      itemOutput_->rows() != itemInput_->rows()) {
+    throw std::invalid_argument(
+        "The matrices of the model do not match its combine method.");
+  }
+  // the user part of a concat hidden vector takes its own kernel
+  switch (userDim == dim ? dim : -1) {
+#define UNI_VEC_SELECT_SCORE(D)      \
+    case D:                          \
+      scoreFn_ = &Ranker::score<D>;  \
+      break;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_SELECT_SCORE)
+#undef UNI_VEC_SELECT_SCORE
+    default:
+      scoreFn_ = &Ranker::score<0>;
+  }
+}
+
+void Ranker::check(const RankRequest& request) const {
+  if (request.user < -1 || request.user >= userInput_->rows()) {
+    throw std::invalid_argument(
+        "User " + std::to_string(request.user) + " is out of range.");
+  }
+  for (const auto* items : {&request.context, &request.candidates}) {
+    for (int64_t item : *items) {
+      if (item < 0 || item >= itemInput_->rows()) {
+        throw std::invalid_argument(
+            "Item " + std::to_string(item) + " is out of range.");
+      }
+    }
+  }
+}
+
+template <int32_t D>
+const real* Ranker::hidden(
+    const RankRequest& request,
+    std::vector<real>& hidden) const {
+  const int64_t n = itemInput_->cols();
+  const int64_t un = userInput_->cols();
+  const bool concat = combine_ == combine_method::concat;
+  const bool hasUser = request.user >= 0 && (userContext_ || !concat);
+  const real* user = hasUser ? userInput_->row(request.user) : nullptr;
+
+  // [U_i ; mean I_i] for concat, the mean of the context alone for meanSum
+  // and of the user and the context for mean
+  hidden.assign(concat ? un + n : n, 0.0);
+  real* itemHidden = concat ? hidden.data() + un : hidden.data();
+  for (int64_t item : request.context) {
+    kernel::add<D>(itemInput_->row(item), itemHidden, n);
+  }
+  if (combine_ == combine_method::mean) {
+    if (user) {
+      kernel::add<D>(user, itemHidden, n);
+    }
+    const size_t count = request.context.size() + (user ? 1 : 0);
+    if (count > 0) {
+      kernel::scale<D>(1.0 / count, itemHidden, n);
+    }
+  } else if (!request.context.empty()) {
+    kernel::scale<D>(1.0 / request.context.size(), itemHidden, n);
+  }
+  if (concat && user) {
+    std::copy(user, user + un, hidden.data());
+  }
+  return user;
+}
+
+template <int32_t D>
+void Ranker::score(
+    const RankRequest& request,
+    real* scores,
+    std::vector<real>& hidden) const {
+  const int64_t n = itemInput_->cols();
+  const bool concat = combine_ == combine_method::concat;
+  const real* user = this->hidden<D>(request, hidden);
+
+  const std::vector<int64_t>& candidates = request.candidates;
+  const bool meanSum = combine_ == combine_method::meanSum;
+  const int64_t width = hidden.size();
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (i + PREFETCH_DISTANCE < candidates.size()) {
+      const int64_t ahead = candidates[i + PREFETCH_DISTANCE];
+      prefetchRow(itemOutput_->row(ahead), width);
+      if (meanSum && user) {
+        prefetchRow(itemInput_->row(ahead), n);
+      }
+    }
+    const int64_t c = candidates[i];
+    real s;
+    if (concat) {
+      s = kernel::dot<2 * D>(itemOutput_->row(c), hidden.data(), width);
+    } else {
+      s = kernel::dot<D>(itemOutput_->row(c), hidden.data(), n);
+      if (meanSum && user) {
+        s += kernel::dot<D>(itemInput_->row(c), user, n);
+      }
+    }
+    scores[i] = s;
+  }
+}
+
+std::vector<real> Ranker::score(const RankRequest& request) const {
+  check(request);
+  std::vector<real> scores(request.candidates.size());
+  std::vector<real> hidden;
+  (this->*scoreFn_)(request, scores.data(), hidden);
+  return scores;
+}
+
+std::vector<std::vector<real>> Ranker::score(
+    const std::vector<RankRequest>& requests,
+    int32_t thread) const {
+  for (const auto& request : requests) {
+    check(request);
+  }
+  std::vector<std::vector<real>> scores(requests.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    std::vector<real> hidden;
+    for (size_t r = next++; r < requests.size(); r = next++) {
+      scores[r].resize(requests[r].candidates.size());
+      (this->*scoreFn_)(requests[r], scores[r].data(), hidden);
+    }
+  };
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, requests.size()));
+  if (nthreads == 1) {
+    worker();
+    return scores;
+  }
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return scores;
+}
+
+std::vector<std::vector<ScoredId>> Ranker::complete(
+    const std::vector<RankRequest>& requests,
+    int32_t k,
+    int32_t thread) const {
+  for (const auto& request : requests) {
+    check(request);
+  }
+  const int64_t n = itemInput_->cols();
+  const bool meanSum = combine_ == combine_method::meanSum;
+  // meanSum scores [mean I_i ; U_i] against [I_o[c] ; I_i[c]]
+  std::vector<BlockedSearch::Part> parts;
+  parts.push_back({itemOutput_, 0, itemOutput_->cols()});
+  if (meanSum) {
+    parts.push_back({itemInput_, 0, n});
+  }
+  BlockedSearch search(parts);
+
+  Matrix queries(requests.size(), search.dim());
+  queries.zero();
+  std::vector<int64_t> ids(requests.size());
+  std::vector<std::vector<int64_t>> bans(requests.size());
+  std::vector<real> hidden;
+  for (size_t r = 0; r < requests.size(); r++) {
+    const real* user = this->hidden<0>(requests[r], hidden);
+    real* query = queries.row(r);
+    std::copy(hidden.begin(), hidden.end(), query);
+    if (meanSum && user) {
+      std::copy(user, user + n, query + n);
+    }
+    ids[r] = r;
+    bans[r] = requests[r].context;
+    std::sort(bans[r].begin(), bans[r].end());
+  }
+  return search.search(queries, 0, ids, k, bans, thread);
+}
+
+} // namespace uni_vec
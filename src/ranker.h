@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+#include "neighbors.h"
+#include "real.h"
+
+namespace uni_vec {
+
+// A user, -1 when unknown, the items of their basket or recent history, and
+// the candidate items to score for them.
+struct RankRequest {
+  int64_t user;
+  std::vector<int64_t> context;
+  std::vector<int64_t> candidates;
+};
+
+/*
+ * Scores candidates with the logit the model is trained on, the hidden
+ * vector being built as in Model::computeConcat / computeMean:
+ *
+ *   concat   I_o[c] . [U_i[user] ; mean I_i[context]]
+ *   mean     I_o[c] . mean(U_i[user], I_i[context]...)
+ *   meanSum  I_i[c] . U_i[user] + I_o[c] . mean I_i[context]
+ *
+ * a missing user or an empty context contributing nothing. Candidate rows
+ * are scattered, so the rows a few candidates ahead are prefetched while
+ * the current one is scored.
+ */
+class Ranker {
+ protected:
+  combine_method combine_;
+  bool userContext_;
+  std::shared_ptr<const Matrix> userInput_;
+  std::shared_ptr<const Matrix> itemInput_;
+  std::shared_ptr<const Matrix> itemOutput_;
+
+  typedef void (Ranker::*ScoreFn)(const RankRequest&, real*, std::vector<real>&)
+      const;
+  ScoreFn scoreFn_;
+
+  void check(const RankRequest&) const;
+  // Builds the hidden vector of the request, returns the user row if it
+  // takes part in the score.
+  template <int32_t D>
+  const real* hidden(const RankRequest&, std::vector<real>&) const;
+  template <int32_t D>
+  void score(const RankRequest&, real*, std::vector<real>&) const;
+
+ public:
+  // Without userContext the user part of the concat hidden vector is zero,
+  // as when the model was trained with -skipUserContext.
+  Ranker(
+      combine_method,
+      bool,
+      std::shared_ptr<const Matrix>,
+      std::shared_ptr<const Matrix>,
+      std::shared_ptr<const Matrix>);
+
+  // One score per candidate, in the order of the request.
+  std::vector<real> score(const RankRequest&) const;
+
+  // Requests are spread over thread threads.
+  std::vector<std::vector<real>> score(
+      const std::vector<RankRequest>&,
+      int32_t) const;
+
+  // Basket completion: the best k items of the whole catalog for every
+  // request, candidates ignored, the items of the context excluded. The
+  // hidden vectors are scored by BlockedSearch on thread threads.
+  std::vector<std::vector<ScoredId>> complete(
+      const std::vector<RankRequest>&,
+      int32_t,
+      int32_t) const;
+};
+
+} // namespace uni_vec
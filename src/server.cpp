@@ -0,0 +1,674 @@
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "trace.h"
+#include "utils.h"
+
+namespace uni_vec {
+
+namespace {
+
+const char* const kKindNames[4] = {"item", "user", "basket", "foldin"};
+// longest request line accepted
+const size_t MAX_LINE = 1 << 20;
+// negatives per item in the table of foldin requests
+const int64_t FOLD_IN_NEGATIVES_PER_ITEM = 16;
+// how often blocked threads look at the stop flag
+const std::chrono::milliseconds POLL_INTERVAL(100);
+
+std::runtime_error socketError(const std::string& what) {
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+int64_t parseInt(const std::string& token) {
+  size_t end = 0;
+  int64_t v;
+  try {
+    v = std::stoll(token, &end);
+  } catch (const std::exception&) {
+    end = 0;
+  }
+  if (end == 0 || end != token.size()) {
+    throw std::invalid_argument("not an integer: " + token);
+  }
+  return v;
+}
+
+bool sendAll(int fd, const std::string& text) {
+  size_t sent = 0;
+  while (sent < text.size()) {
+    const ssize_t n =
+        ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Reads one value per page of the matrices a query reads, so that the
+// first queries of a mapped model do not fault them in one by one.
+real touchPages(const UniVec& model) {
+  const int64_t stride = 4096 / sizeof(real);
+  real sum = 0.0;
+  for (const auto& matrix :
+       {model.getItemInputMatrix(),
+        model.getItemOutputMatrix(),
+        model.getUserInputMatrix()}) {
+    const real* data = matrix->data();
+    const int64_t size = matrix->rows() * matrix->cols();
+    for (int64_t i = 0; i < size; i += stride) {
+      sum += data[i];
+    }
+  }
+  return sum;
+}
+
+std::shared_ptr<const Generation> loadGeneration(
+    int64_t id,
+    const std::string& modelPath,
+    const std::string& indexPath,
+    const ServerArgs& args) {
+  auto model = std::make_shared<UniVec>();
+  model->loadModel(modelPath);
+  if (!indexPath.empty()) {
+    model->loadIndex(indexPath);
+  }
+  if (args.int8Rerank >= 0) {
+    model->buildInt8(args.int8Rerank, args.thread);
+  }
+  volatile real sink = touchPages(*model);
+  (void)sink;
+  auto generation = std::make_shared<Generation>();
+  generation->id = id;
+  generation->model = model;
+  return generation;
+}
+
+std::string formatResults(const std::vector<ScoredId>& results) {
+  std::string text = "ok";
+  for (const auto& p : results) {
+    text += ' ';
+    text += std::to_string(p.second);
+    text += ':';
+    utils::appendReal(text, p.first);
+  }
+  return text;
+}
+
+} // namespace
+
+ResultCache::ResultCache(int64_t capacity) : capacity_(capacity) {}
+
+bool ResultCache::get(
+    int64_t generation,
+    query_kind kind,
+    int64_t id,
+    int32_t k,
+    std::vector<ScoredId>& results) {
+  if (capacity_ <= 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(Key{generation, kind, id});
+  // an entry computed for a smaller k cannot answer
+  if (it == index_.end() || it->second->second.size() < size_t(k)) {
+    misses_++;
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  const std::vector<ScoredId>& cached = it->second->second;
+  results.assign(cached.begin(), cached.begin() + k);
+  hits_++;
+  return true;
+}
+
+void ResultCache::put(
+    int64_t generation,
+    query_kind kind,
+    int64_t id,
+    const std::vector<ScoredId>& results) {
+  if (capacity_ <= 0) {
+    return;
+  }
+  const Key key{generation, kind, id};
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    if (it->second->second.size() < results.size()) {
+      it->second->second = results;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  entries_.emplace_front(key, results);
+  index_[key] = entries_.begin();
+  if (int64_t(index_.size()) > capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+int64_t ResultCache::size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_.size();
+}
+
+int64_t ResultCache::hits() const {
+  return hits_;
+}
+
+int64_t ResultCache::misses() const {
+  return misses_;
+}
+
+Server::Server(const ServerArgs& args)
+    : args_(args), cache_(args.cacheSize), listenFd_(-1), drained_(false) {
+  if (args_.socket.empty() && (args_.port <= 0 || args_.port > 65535)) {
+    throw std::invalid_argument("A socket path or a port is required.");
+  }
+  if (args_.thread < 1 || args_.maxBatch < 1 || args_.batchWait < 0 ||
+      args_.maxK < 1) {
+    throw std::invalid_argument("Invalid server arguments.");
+  }
+  generation_ = loadGeneration(1, args_.model, args_.index, args_);
+}
+
+Server::~Server() {
+  if (listenFd_ >= 0) {
+    ::close(listenFd_);
+  }
+}
+
+std::shared_ptr<const Generation> Server::generation() const {
+  return std::atomic_load(&generation_);
+}
+
+int64_t Server::reload(const std::string& model, const std::string& index) {
+  TraceScope trace("reload", "serve");
+  std::lock_guard<std::mutex> lock(reloadMutex_);
+  auto next = loadGeneration(generation()->id + 1, model, index, args_);
+  std::atomic_store(&generation_, next);
+  args_.model = model;
+  args_.index = index;
+  reloads_++;
+  return next->id;
+}
+
+void Server::requestReload() {
+  reloadRequested_ = true;
+}
+
+void Server::listen() {
+  if (!args_.socket.empty()) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (args_.socket.size() >= sizeof(addr.sun_path)) {
+      throw std::invalid_argument("Socket path too long: " + args_.socket);
+    }
+    std::strcpy(addr.sun_path, args_.socket.c_str());
+    listenFd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd_ < 0) {
+      throw socketError("socket");
+    }
+    ::unlink(args_.socket.c_str());
+    if (::bind(listenFd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      throw socketError("bind " + args_.socket);
+    }
+  } else {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(args_.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listenFd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd_ < 0) {
+      throw socketError("socket");
+    }
+    int one = 1;
+    ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (::bind(listenFd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      throw socketError("bind port " + std::to_string(args_.port));
+    }
+  }
+  if (::listen(listenFd_, 128) < 0) {
+    throw socketError("listen");
+  }
+}
+
+void Server::run() {
+  listen();
+  start_ = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < args_.thread; i++) {
+    workers_.push_back(std::thread([this]() { workerLoop(); }));
+  }
+
+  pollfd pfd;
+  pfd.fd = listenFd_;
+  pfd.events = POLLIN;
+  while (!stop_) {
+    const int ready = ::poll(&pfd, 1, POLL_INTERVAL.count());
+    reapConnections(false);
+    if (!reloading_ && reloadRequested_.exchange(false)) {
+      if (reloader_.joinable()) {
+        reloader_.join();
+      }
+      reloading_ = true;
+      reloader_ = std::thread([this]() {
+        std::string model, index;
+        {
+          std::lock_guard<std::mutex> lock(reloadMutex_);
+          model = args_.model;
+          index = args_.index;
+        }
+        try {
+          std::cerr << "Loaded generation " << reload(model, index)
+                    << std::endl;
+        } catch (const std::exception& e) {
+          std::cerr << "Reload failed: " << e.what() << std::endl;
+        }
+        reloading_ = false;
+      });
+    }
+    if (ready <= 0 || !(pfd.revents & POLLIN)) {
+      continue;
+    }
+    const int fd = ::accept(listenFd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    connections_.emplace_back(new Connection());
+    Connection* connection = connections_.back().get();
+    connection->fd = fd;
+    connection->thread =
+        std::thread([this, connection]() { serveConnection(connection); });
+  }
+
+  // readers first, they may wait for queued queries, then the workers
+  ::close(listenFd_);
+  listenFd_ = -1;
+  if (!args_.socket.empty()) {
+    ::unlink(args_.socket.c_str());
+  }
+  reapConnections(true);
+  if (reloader_.joinable()) {
+    reloader_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    drained_ = true;
+  }
+  queueCv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+void Server::stop() {
+  stop_ = true;
+}
+
+void Server::reapConnections(bool all) {
+  for (auto it = connections_.begin(); it != connections_.end();) {
+    Connection* connection = it->get();
+    if (all && !connection->done) {
+      ::shutdown(connection->fd, SHUT_RDWR);
+    }
+    if (all || connection->done) {
+      connection->thread.join();
+      ::close(connection->fd);
+      it = connections_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Server::serveConnection(Connection* connection) {
+  std::string buffer;
+  char chunk[4096];
+  bool open = true;
+  while (open && !stop_) {
+    const ssize_t n = ::recv(connection->fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    buffer.append(chunk, n);
+    size_t begin = 0;
+    size_t eol;
+    while (open && (eol = buffer.find('\n', begin)) != std::string::npos) {
+      std::string line = buffer.substr(begin, eol - begin);
+      begin = eol + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line == "quit") {
+        open = false;
+      } else if (!line.empty()) {
+        open = sendAll(connection->fd, handle(line) + '\n');
+      }
+    }
+    buffer.erase(0, begin);
+    if (buffer.size() > MAX_LINE) {
+      sendAll(connection->fd, "error request line too long\n");
+      break;
+    }
+  }
+  connection->done = true;
+}
+
+std::vector<ScoredId> Server::submit(std::shared_ptr<Query> query) {
+  std::future<std::vector<ScoredId>> result = query->result.get_future();
+  query->arrival = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    queue_.push_back(query);
+  }
+  queueCv_.notify_one();
+  return result.get();
+}
+
+std::string Server::handle(const std::string& line) {
+  std::istringstream in(line);
+  std::vector<std::string> tokens;
+  std::string token;
+  while (in >> token) {
+    tokens.push_back(token);
+  }
+  if (tokens.empty()) {
+    return "error empty request";
+  }
+  if (tokens[0] == "stats" && tokens.size() == 1) {
+    return stats();
+  }
+  const auto arrival = std::chrono::steady_clock::now();
+  std::vector<ScoredId> results;
+  try {
+    if (tokens[0] == "reload" && tokens.size() <= 3) {
+      std::string model, index;
+      if (tokens.size() == 1) {
+        std::lock_guard<std::mutex> lock(reloadMutex_);
+        model = args_.model;
+        index = args_.index;
+      } else {
+        model = tokens[1];
+        index = tokens.size() == 3 ? tokens[2] : "";
+      }
+      return "ok generation=" + std::to_string(reload(model, index));
+    }
+    if (tokens[0] == "foldin" && tokens.size() >= 4) {
+      results = foldIn(tokens);
+      latency_[int32_t(query_kind::foldin)].record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - arrival)
+              .count());
+      return formatResults(results);
+    }
+    auto query = std::make_shared<Query>();
+    query->generation = generation();
+    const UniVec& model = *query->generation->model;
+    if (tokens[0] == "item" && tokens.size() == 3) {
+      query->kind = query_kind::item;
+    } else if (tokens[0] == "user" && tokens.size() == 3) {
+      query->kind = query_kind::user;
+    } else if (tokens[0] == "basket" && tokens.size() >= 3) {
+      query->kind = query_kind::basket;
+    } else {
+      throw std::invalid_argument("unknown request: " + tokens[0]);
+    }
+    query->id = parseInt(tokens[1]);
+    const int64_t k = parseInt(tokens[2]);
+    if (k < 1 || k > args_.maxK) {
+      throw std::invalid_argument(
+          "k must be in [1, " + std::to_string(args_.maxK) + "]");
+    }
+    query->k = k;
+
+    const int64_t nitems = model.getItemInputMatrix()->rows();
+    const int64_t nusers = model.getUserInputMatrix()->rows();
+    const bool user = query->kind != query_kind::item;
+    const int64_t lowest = query->kind == query_kind::basket ? -1 : 0;
+    if (query->id < lowest || query->id >= (user ? nusers : nitems)) {
+      throw std::invalid_argument(
+          (user ? "user " : "item ") + tokens[1] + " is out of range");
+    }
+    if (query->kind == query_kind::basket) {
+      query->request.user = query->id;
+      for (size_t i = 3; i < tokens.size(); i++) {
+        const int64_t item = parseInt(tokens[i]);
+        if (item < 0 || item >= nitems) {
+          throw std::invalid_argument("item " + tokens[i] + " is out of range");
+        }
+        query->request.context.push_back(item);
+      }
+    }
+    if (query->kind != query_kind::basket &&
+        cache_.get(
+            query->generation->id, query->kind, query->id, k, results)) {
+      latency_[int32_t(query->kind)].record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - arrival)
+              .count());
+    } else {
+      results = submit(query);
+    }
+  } catch (const std::exception& e) {
+    errors_++;
+    return std::string("error ") + e.what();
+  }
+  return formatResults(results);
+}
+
+std::vector<ScoredId> Server::foldIn(const std::vector<std::string>& tokens) {
+  auto current = generation();
+  const UniVec& model = *current->model;
+  const int64_t nitems = model.getItemInputMatrix()->rows();
+  const int64_t nusers = model.getUserInputMatrix()->rows();
+  int64_t user = parseInt(tokens[1]);
+  const int64_t k = parseInt(tokens[2]);
+  if (k < 1 || k > args_.maxK) {
+    throw std::invalid_argument(
+        "k must be in [1, " + std::to_string(args_.maxK) + "]");
+  }
+  if (user < -1 || user >= nusers) {
+    throw std::invalid_argument("user " + tokens[1] + " is out of range");
+  }
+  // any id past the last row starts from zero
+  if (user == -1) {
+    user = nusers;
+  }
+  std::vector<std::vector<int32_t>> baskets;
+  std::vector<int64_t> bans;
+  for (size_t i = 3; i < tokens.size(); i++) {
+    baskets.emplace_back();
+    std::istringstream items(tokens[i]);
+    std::string token;
+    while (std::getline(items, token, ',')) {
+      const int64_t item = parseInt(token);
+      if (item < 0 || item >= nitems) {
+        throw std::invalid_argument("item " + token + " is out of range");
+      }
+      baskets.back().push_back(item);
+      bans.push_back(item);
+    }
+  }
+
+  std::call_once(current->negativesOnce, [&]() {
+    current->negatives = std::make_shared<const NegativeTable>(
+        std::vector<int64_t>(nitems, 1),
+        0,
+        std::min<int64_t>(
+            NegativeTable::NEGATIVE_TABLE_SIZE,
+            FOLD_IN_NEGATIVES_PER_ITEM * nitems));
+  });
+  std::shared_ptr<const Matrix> rows = model.foldInUsers(
+      {user},
+      {baskets},
+      current->negatives,
+      args_.foldInEpoch,
+      model.getArgs().lr,
+      1);
+  std::sort(bans.begin(), bans.end());
+  bans.erase(std::unique(bans.begin(), bans.end()), bans.end());
+  return model.recommend(*rows, k, {bans}, 1)[0];
+}
+
+std::string Server::stats() {
+  const double uptime = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start_)
+                            .count();
+  const int64_t batches = batches_;
+  std::ostringstream out;
+  out << "ok uptime=" << uptime << " batches=" << batches << " meanBatch="
+      << (batches > 0 ? double(batchedQueries_) / batches : 0.0)
+      << " errors=" << errors_ << " generation=" << generation()->id
+      << " reloads=" << reloads_;
+  const int64_t hits = cache_.hits();
+  const int64_t lookups = hits + cache_.misses();
+  out << " cache.size=" << cache_.size() << " cache.hits=" << hits
+      << " cache.misses=" << cache_.misses() << " cache.hitRate="
+      << (lookups > 0 ? double(hits) / lookups : 0.0);
+  for (int32_t kind = 0; kind < 4; kind++) {
+    const LatencyHistogram& latency = latency_[kind];
+    const std::string name = kKindNames[kind];
+    out << ' ' << name << ".count=" << latency.count() << ' ' << name
+        << ".meanUs=" << int64_t(latency.mean()) << ' ' << name
+        << ".p50Us=" << latency.percentile(0.5) << ' ' << name
+        << ".p90Us=" << latency.percentile(0.9) << ' ' << name
+        << ".p99Us=" << latency.percentile(0.99) << ' ' << name
+        << ".maxUs=" << latency.max();
+  }
+  return out.str();
+}
+
+std::vector<std::shared_ptr<Server::Query>> Server::nextBatch() {
+  std::unique_lock<std::mutex> lock(queueMutex_);
+  while (true) {
+    queueCv_.wait(lock, [this]() { return drained_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      // only once drained, an empty batch stops the worker
+      return {};
+    }
+    // give concurrent queries until the oldest one is due to join the batch
+    const auto due = queue_.front()->arrival +
+        std::chrono::microseconds(args_.batchWait);
+    queueCv_.wait_until(lock, due, [this]() {
+      return drained_ || queue_.size() >= size_t(args_.maxBatch);
+    });
+    // another worker waiting on the same query may have taken it
+    if (!queue_.empty()) {
+      break;
+    }
+  }
+  const size_t n = std::min(queue_.size(), size_t(args_.maxBatch));
+  std::vector<std::shared_ptr<Query>> batch(queue_.begin(), queue_.begin() + n);
+  queue_.erase(queue_.begin(), queue_.begin() + n);
+  if (!queue_.empty()) {
+    queueCv_.notify_one();
+  }
+  return batch;
+}
+
+void Server::workerLoop() {
+  while (true) {
+    std::vector<std::shared_ptr<Query>> batch = nextBatch();
+    if (batch.empty()) {
+      return;
+    }
+    batches_++;
+    batchedQueries_ += batch.size();
+    // one group per kind and generation, a reload splits a batch
+    while (!batch.empty()) {
+      const query_kind kind = batch[0]->kind;
+      const Generation* generation = batch[0]->generation.get();
+      std::vector<std::shared_ptr<Query>> group;
+      std::vector<std::shared_ptr<Query>> rest;
+      for (const auto& query : batch) {
+        if (query->kind == kind && query->generation.get() == generation) {
+          group.push_back(query);
+        } else {
+          rest.push_back(query);
+        }
+      }
+      runBatch(kind, group);
+      batch.swap(rest);
+    }
+  }
+}
+
+void Server::runBatch(
+    query_kind kind,
+    const std::vector<std::shared_ptr<Query>>& group) {
+  TraceScope trace(kKindNames[int32_t(kind)], "serve");
+  const Generation& generation = *group[0]->generation;
+  const UniVec& model = *generation.model;
+  int32_t k = 0;
+  std::vector<int64_t> ids;
+  std::vector<RankRequest> requests;
+  for (const auto& query : group) {
+    k = std::max(k, query->k);
+    ids.push_back(query->id);
+    requests.push_back(query->request);
+  }
+  std::vector<std::vector<ScoredId>> results;
+  try {
+    if (kind == query_kind::item) {
+      std::vector<std::vector<int64_t>> bans(ids.size());
+      for (size_t q = 0; q < ids.size(); q++) {
+        bans[q].push_back(ids[q]);
+      }
+      results = model.hasIndex()
+          ? model.getApproxNN(
+                ids, k, args_.efSearch, args_.nprobe, args_.shortlist, bans, 1)
+          : model.recommend(ids, false, k, bans, 1);
+    } else if (kind == query_kind::user) {
+      results = model.recommend(ids, true, k, {}, 1);
+    } else {
+      results = model.complete(requests, k, 1);
+    }
+  } catch (...) {
+    for (const auto& query : group) {
+      query->result.set_exception(std::current_exception());
+    }
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < group.size(); q++) {
+    Query& query = *group[q];
+    if (kind != query_kind::basket) {
+      cache_.put(generation.id, kind, query.id, results[q]);
+    }
+    if (results[q].size() > size_t(query.k)) {
+      results[q].resize(query.k);
+    }
+    latency_[int32_t(kind)].record(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            now - query.arrival)
+            .count());
+    query.result.set_value(std::move(results[q]));
+  }
+}
+
+} // namespace uni_vec
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.h"
+#include "neighbors.h"
+#include "ranker.h"
+#include "uniVec.h"
+
+namespace uni_vec {
+
+enum class query_kind : int { item = 0, user, basket, foldin };
+
+struct ServerArgs {
+  // the model, and optionally an index of it, loaded again on reload
+  std::string model;
+  std::string index;
+  // a Unix socket path, or else a port on 127.0.0.1
+  std::string socket;
+  int32_t port = 0;
+  int32_t thread = 1;
+  // a batch is run once it has maxBatch queries or its oldest query waited
+  // batchWait microseconds
+  int32_t maxBatch = 64;
+  int32_t batchWait = 500;
+  // item queries go through the index of the model when it has one
+  int32_t efSearch = 64;
+  int32_t nprobe = 16;
+  int32_t shortlist = 200;
+  // item queries without an index and user queries scan int8 copies of the
+  // model when >= 0, the best max(k, int8Rerank) scored again in fp32
+  int32_t int8Rerank = -1;
+  // results larger than this are refused
+  int32_t maxK = 1000;
+  // item and user results kept, 0 to disable the cache
+  int64_t cacheSize = 100000;
+  // passes over the baskets of a foldin request
+  int32_t foldInEpoch = 5;
+};
+
+// A loaded model, immutable once published. Queries hold the generation
+// they were validated against until they are answered.
+struct Generation {
+  int64_t id;
+  std::shared_ptr<const UniVec> model;
+  // uniform item negatives of foldin requests, built by the first one
+  mutable std::once_flag negativesOnce;
+  mutable std::shared_ptr<const NegativeTable> negatives;
+};
+
+/*
+ * Bounded LRU cache of item and user results. Keys include the model
+ * generation, so results of a replaced model are never returned and are
+ * evicted as they age. An entry answers any k up to the one it was
+ * computed for.
+ */
+class ResultCache {
+ protected:
+  struct Key {
+    int64_t generation;
+    query_kind kind;
+    int64_t id;
+    bool operator==(const Key& o) const {
+      return generation == o.generation && kind == o.kind && id == o.id;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<int64_t>()(
+          (key.generation * 31 + int64_t(key.kind)) * 1000003 + key.id);
+    }
+  };
+  typedef std::pair<Key, std::vector<ScoredId>> Entry;
+
+  int64_t capacity_;
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+  std::atomic<int64_t> hits_{};
+  std::atomic<int64_t> misses_{};
+
+ public:
+  explicit ResultCache(int64_t);
+
+  // The best k results, true if cached for at least k.
+  bool get(int64_t, query_kind, int64_t, int32_t, std::vector<ScoredId>&);
+  void put(int64_t, query_kind, int64_t, const std::vector<ScoredId>&);
+
+  int64_t size();
+  int64_t hits() const;
+  int64_t misses() const;
+};
+
+/*
+ * Query daemon over a line protocol, one request and one response per line:
+ *
+ *   item <id> <k>                   complements of an item
+ *   user <id> <k>                   items for a user
+ *   basket <user> <k> <item>...     completion of a basket, user -1 if unknown
+ *   foldin <user> <k> <basket>...   items for a user refitted to their recent
+ *                                   baskets, given as item,item,... and the
+ *                                   user -1 if unknown
+ *   stats                           counters and latency percentiles
+ *   reload [<model> [<index>]]      swaps in a new model, by default the
+ *                                   files the server was started with
+ *   quit                            closes the connection
+ *
+ * answered by "ok <id>:<score> ..." best first, or "error <message>".
+ *
+ * Every connection has a reader thread that parses and validates requests
+ * and waits for their results. A fixed pool of workers takes the queued
+ * queries in micro-batches: concurrent queries of one kind are scored
+ * together by one blocked product over the catalog, see UniVec::recommend,
+ * which costs about as much as a single one since the catalog is streamed
+ * once per batch.
+ *
+ * Reloads are read-copy-update: the new model is loaded and its pages
+ * touched while the current one keeps serving, then the generation pointer
+ * is swapped atomically. Queries already validated finish on the
+ * generation they hold, which is freed with its last query.
+ *
+ * foldin requests are not batched: the reader thread refits the user
+ * vector, see UniVec::foldInUsers, and recommends for it. The refitted
+ * vector is not kept; fold-in to save them is for the fold-in command.
+ */
+class Server {
+ protected:
+  struct Query {
+    query_kind kind;
+    std::shared_ptr<const Generation> generation;
+    // the item or user, the basket in request
+    int64_t id;
+    RankRequest request;
+    int32_t k;
+    std::chrono::steady_clock::time_point arrival;
+    std::promise<std::vector<ScoredId>> result;
+  };
+
+  struct Connection {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{};
+  };
+
+  ServerArgs args_;
+  // read and replaced with the atomic shared_ptr functions only
+  std::shared_ptr<const Generation> generation_;
+  // serializes reloads, and guards the model and index paths in args_
+  std::mutex reloadMutex_;
+  std::thread reloader_;
+  std::atomic<bool> reloadRequested_{};
+  std::atomic<bool> reloading_{};
+  ResultCache cache_;
+  int listenFd_;
+  std::atomic<bool> stop_{};
+
+  std::mutex queueMutex_;
+  std::condition_variable queueCv_;
+  std::deque<std::shared_ptr<Query>> queue_;
+  // set once no connection is left to queue queries
+  bool drained_;
+  std::vector<std::thread> workers_;
+
+  // only touched by the thread in run
+  std::list<std::unique_ptr<Connection>> connections_;
+
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<int64_t> batches_{};
+  std::atomic<int64_t> batchedQueries_{};
+  std::atomic<int64_t> errors_{};
+  std::atomic<int64_t> reloads_{};
+  LatencyHistogram latency_[4];
+
+  std::shared_ptr<const Generation> generation() const;
+
+  void listen();
+  void serveConnection(Connection*);
+  void reapConnections(bool);
+  std::vector<ScoredId> submit(std::shared_ptr<Query>);
+  std::string handle(const std::string&);
+  std::vector<ScoredId> foldIn(const std::vector<std::string>&);
+  std::string stats();
+  void workerLoop();
+  std::vector<std::shared_ptr<Query>> nextBatch();
+  void runBatch(query_kind, const std::vector<std::shared_ptr<Query>>&);
+
+ public:
+  // Loads the model of args.
+  explicit Server(const ServerArgs&);
+  ~Server();
+
+  // Serves until stop is called.
+  void run();
+  // Safe to call from a signal handler.
+  void stop();
+
+  // Loads a new generation of the model, and the index if not empty, and
+  // publishes it. Returns its id; the current generation stays in use if
+  // loading fails.
+  int64_t reload(const std::string&, const std::string&);
+  // Reload of the current files in the background, safe to call from a
+  // signal handler.
+  void requestReload();
+};
+
+} // namespace uni_vec
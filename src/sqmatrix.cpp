@@ -0,0 +1,383 @@
+#include "sqmatrix.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "kernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace uni_vec {
+
+namespace {
+
+// rows quantized by a thread at a time
+const int64_t QUANTIZE_CHUNK = 4096;
+// queries of a block share every tile of panels, 256 panels of 64 columns
+// are 128KB and stay in L2 while the block is scored
+const int64_t QUERY_BLOCK = 64;
+const int64_t TILE_PANELS = 256;
+const int64_t SELECT_CHUNK = 32;
+// the query is shifted from [-63, 63] to [1, 127]
+const int32_t QUERY_SHIFT = 64;
+// queries and panels scored together by the SIMD kernel, as many
+// accumulators as the registers allow: 32 with AVX-512, 16 with AVX2
+const int32_t QUERY_UNROLL = 4;
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+const int32_t PANEL_UNROLL = 4;
+#else
+const int32_t PANEL_UNROLL = 2;
+#endif
+
+} // namespace
+
+SQMatrix::SQMatrix(
+    std::shared_ptr<const Matrix> base,
+    int64_t offset,
+    int64_t dim,
+    int32_t thread)
+    : base_(base), offset_(offset), dim_(dim), m_(base->rows()) {
+  if (offset < 0 || dim <= 0 || offset + dim > base->cols()) {
+    throw std::invalid_argument("Columns out of the range of the matrix.");
+  }
+  groups_ = (dim_ + GROUP - 1) / GROUP;
+  const int64_t panels = (m_ + PANEL - 1) / PANEL;
+  codes_.assign(panels * groups_ * PANEL * GROUP, 0);
+  scales_.assign(panels * PANEL, 0.0);
+  sums_.assign(panels * PANEL, 0);
+
+  const int64_t chunks = (m_ + QUANTIZE_CHUNK - 1) / QUANTIZE_CHUNK;
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    for (int64_t c = next++; c < chunks; c = next++) {
+      quantizeRows(
+          c * QUANTIZE_CHUNK, std::min(m_, (c + 1) * QUANTIZE_CHUNK));
+    }
+  };
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, chunks));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+}
+
+void SQMatrix::quantizeRows(int64_t begin, int64_t end) {
+  for (int64_t i = begin; i < end; i++) {
+    const real* x = base_->row(i) + offset_;
+    real maxAbs = 0.0;
+    for (int64_t j = 0; j < dim_; j++) {
+      maxAbs = std::max(maxAbs, std::abs(x[j]));
+    }
+    const real inv = maxAbs > 0 ? 127.0 / maxAbs : 0.0;
+    int8_t* panel = codes_.data() + (i / PANEL) * groups_ * PANEL * GROUP;
+    int32_t sum = 0;
+    for (int64_t j = 0; j < dim_; j++) {
+      const int32_t q = std::max(
+          -127, std::min(127, int32_t(std::lrint(x[j] * inv))));
+      panel[((j / GROUP) * PANEL + i % PANEL) * GROUP + j % GROUP] = q;
+      sum += q;
+    }
+    scales_[i] = maxAbs / 127.0;
+    sums_[i] = sum;
+  }
+}
+
+int64_t SQMatrix::size() const {
+  return codes_.size() + scales_.size() * sizeof(real) +
+      sums_.size() * sizeof(int32_t);
+}
+
+real SQMatrix::quantizeQuery(
+    const real* x,
+    std::vector<uint32_t>& words) const {
+  real maxAbs = 0.0;
+  for (int64_t j = 0; j < dim_; j++) {
+    maxAbs = std::max(maxAbs, std::abs(x[j]));
+  }
+  const real inv = maxAbs > 0 ? 63.0 / maxAbs : 0.0;
+  std::vector<uint8_t> bytes(groups_ * GROUP, 0);
+  for (int64_t j = 0; j < dim_; j++) {
+    bytes[j] = std::max(-63, std::min(63, int32_t(std::lrint(x[j] * inv)))) +
+        QUERY_SHIFT;
+  }
+  // padding columns have zero codes in every row, any value works there
+  words.resize(groups_);
+  std::memcpy(words.data(), bytes.data(), bytes.size());
+  return maxAbs / 63.0;
+}
+
+#if defined(__AVX2__)
+template <int32_t Q, int32_t N>
+void SQMatrix::scoreSimd(
+    const uint32_t* queries,
+    const real* qscales,
+    int64_t first,
+    real* scores,
+    int64_t stride) const {
+  const int64_t panelBytes = groups_ * PANEL * GROUP;
+  const int8_t* panels = codes_.data() + first * panelBytes;
+  __m256i acc[Q][N];
+  for (int32_t q = 0; q < Q; q++) {
+    for (int32_t n = 0; n < N; n++) {
+      acc[q][n] = _mm256_setzero_si256();
+    }
+  }
+#if !(defined(__AVX512VNNI__) && defined(__AVX512VL__))
+  const __m256i ones = _mm256_set1_epi16(1);
+#endif
+  for (int64_t g = 0; g < groups_; g++) {
+    __m256i rows[N];
+    for (int32_t n = 0; n < N; n++) {
+      rows[n] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+          panels + n * panelBytes + g * PANEL * GROUP));
+    }
+    for (int32_t q = 0; q < Q; q++) {
+      const __m256i words = _mm256_set1_epi32(queries[q * groups_ + g]);
+      for (int32_t n = 0; n < N; n++) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        acc[q][n] = _mm256_dpbusd_epi32(acc[q][n], words, rows[n]);
+#else
+        acc[q][n] = _mm256_add_epi32(
+            acc[q][n],
+            _mm256_madd_epi16(_mm256_maddubs_epi16(words, rows[n]), ones));
+#endif
+      }
+    }
+  }
+  for (int32_t n = 0; n < N; n++) {
+    const int64_t row = (first + n) * PANEL;
+    // QUERY_SHIFT times the sum of the codes of each row
+    const __m256i shift = _mm256_slli_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sums_.data() + row)),
+        6);
+    const __m256 scales = _mm256_loadu_ps(scales_.data() + row);
+    for (int32_t q = 0; q < Q; q++) {
+      const __m256 dots = _mm256_cvtepi32_ps(_mm256_sub_epi32(acc[q][n], shift));
+      _mm256_storeu_ps(
+          scores + q * stride + n * PANEL,
+          _mm256_mul_ps(dots, _mm256_mul_ps(_mm256_set1_ps(qscales[q]), scales)));
+    }
+  }
+}
+#endif
+
+void SQMatrix::scanPanels(
+    const uint32_t* queries,
+    const real* qscales,
+    int64_t nq,
+    int64_t begin,
+    int64_t end,
+    real* scores,
+    int64_t stride) const {
+#if defined(__AVX2__)
+  // every panel loaded is used by QUERY_UNROLL queries, and the independent
+  // accumulators of PANEL_UNROLL panels hide the latency of the multiply adds
+  int64_t q = 0;
+  for (; q + QUERY_UNROLL <= nq; q += QUERY_UNROLL) {
+    int64_t p = begin;
+    for (; p + PANEL_UNROLL <= end; p += PANEL_UNROLL) {
+      scoreSimd<QUERY_UNROLL, PANEL_UNROLL>(
+          queries + q * groups_, qscales + q, p,
+          scores + q * stride + (p - begin) * PANEL, stride);
+    }
+    for (; p < end; p++) {
+      scoreSimd<QUERY_UNROLL, 1>(
+          queries + q * groups_, qscales + q, p,
+          scores + q * stride + (p - begin) * PANEL, stride);
+    }
+  }
+  for (; q < nq; q++) {
+    int64_t p = begin;
+    for (; p + PANEL_UNROLL <= end; p += PANEL_UNROLL) {
+      scoreSimd<1, PANEL_UNROLL>(
+          queries + q * groups_, qscales + q, p,
+          scores + q * stride + (p - begin) * PANEL, stride);
+    }
+    for (; p < end; p++) {
+      scoreSimd<1, 1>(
+          queries + q * groups_, qscales + q, p,
+          scores + q * stride + (p - begin) * PANEL, stride);
+    }
+  }
+#else
+  const int64_t panelBytes = groups_ * PANEL * GROUP;
+  for (int64_t q = 0; q < nq; q++) {
+    const uint32_t* query = queries + q * groups_;
+    for (int64_t p = begin; p < end; p++) {
+      const int8_t* panel = codes_.data() + p * panelBytes;
+      int32_t acc[PANEL] = {};
+      for (int64_t g = 0; g < groups_; g++) {
+        uint8_t words[GROUP];
+        std::memcpy(words, &query[g], GROUP);
+        const int8_t* rows = panel + g * PANEL * GROUP;
+        for (int64_t r = 0; r < PANEL; r++) {
+          for (int64_t j = 0; j < GROUP; j++) {
+            acc[r] += int32_t(words[j]) * rows[r * GROUP + j];
+          }
+        }
+      }
+      real* out = scores + q * stride + (p - begin) * PANEL;
+      for (int64_t r = 0; r < PANEL; r++) {
+        out[r] = qscales[q] * scales_[p * PANEL + r] *
+            (acc[r] - QUERY_SHIFT * sums_[p * PANEL + r]);
+      }
+    }
+  }
+#endif
+}
+
+real SQMatrix::dotRow(const Vector& vec, int64_t i) const {
+  if (vec.size() != dim_ || i < 0 || i >= m_) {
+    throw std::invalid_argument("Row or vector out of the range of the matrix.");
+  }
+  std::vector<uint32_t> words;
+  const real qscale = quantizeQuery(vec.data(), words);
+  const uint8_t* q = reinterpret_cast<const uint8_t*>(words.data());
+  int32_t acc = 0;
+  for (int64_t j = 0; j < dim_; j++) {
+    acc += int32_t(q[j]) * code(i, j);
+  }
+  return qscale * scales_[i] * (acc - QUERY_SHIFT * sums_[i]);
+}
+
+void SQMatrix::scan(
+    const real* query,
+    int64_t begin,
+    int64_t end,
+    real* scores) const {
+  if (begin < 0 || end > m_ || begin > end) {
+    throw std::invalid_argument("Rows out of the range of the matrix.");
+  }
+  std::vector<uint32_t> words;
+  const real qscale = quantizeQuery(query, words);
+  const int64_t first = begin / PANEL;
+  const int64_t last = (end + PANEL - 1) / PANEL;
+  std::vector<real> panels((last - first) * PANEL);
+  scanPanels(words.data(), &qscale, 1, first, last, panels.data(), 0);
+  std::copy(
+      panels.begin() + (begin - first * PANEL),
+      panels.begin() + (end - first * PANEL),
+      scores);
+}
+
+std::vector<std::vector<ScoredId>> SQMatrix::search(
+    const Matrix& queries,
+    int64_t qOffset,
+    const std::vector<int64_t>& ids,
+    int32_t k,
+    int32_t rerank,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  const int64_t nq = ids.size();
+  if (!bans.empty() && int64_t(bans.size()) != nq) {
+    throw std::invalid_argument("Need one ban list per query.");
+  }
+  if (qOffset < 0 || qOffset + dim_ > queries.cols()) {
+    throw std::invalid_argument("Query columns out of the range of the matrix.");
+  }
+  for (int64_t id : ids) {
+    if (id < 0 || id >= queries.rows()) {
+      throw std::invalid_argument(
+          "Query " + std::to_string(id) + " is out of range.");
+    }
+  }
+  const int32_t candidates = std::max(k, rerank);
+  const int64_t panels = (m_ + PANEL - 1) / PANEL;
+  const int64_t blocks = (nq + QUERY_BLOCK - 1) / QUERY_BLOCK;
+  std::vector<std::vector<ScoredId>> results(nq);
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    std::vector<uint32_t> words;
+    std::vector<uint32_t> qcodes(QUERY_BLOCK * groups_);
+    std::vector<real> qscales(QUERY_BLOCK);
+    const int64_t stride = TILE_PANELS * PANEL;
+    std::vector<real> scores(QUERY_UNROLL * stride);
+    for (int64_t blk = next++; blk < blocks; blk = next++) {
+      const int64_t begin = blk * QUERY_BLOCK;
+      const int64_t nb = std::min(QUERY_BLOCK, nq - begin);
+      for (int64_t q = 0; q < nb; q++) {
+        qscales[q] =
+            quantizeQuery(queries.row(ids[begin + q]) + qOffset, words);
+        std::copy(words.begin(), words.end(), qcodes.begin() + q * groups_);
+      }
+
+      std::vector<TopK> heaps(nb, TopK(candidates));
+      for (int64_t t = 0; t < panels; t += TILE_PANELS) {
+        const int64_t te = std::min(panels, t + TILE_PANELS);
+        // the padding rows of the last panel are never candidates
+        const int64_t nt = std::min(m_, te * PANEL) - t * PANEL;
+        for (int64_t q0 = 0; q0 < nb; q0 += QUERY_UNROLL) {
+          const int64_t nu = std::min<int64_t>(QUERY_UNROLL, nb - q0);
+          scanPanels(
+              qcodes.data() + q0 * groups_, qscales.data() + q0, nu, t, te,
+              scores.data(), stride);
+          for (int64_t q = q0; q < q0 + nu; q++) {
+            const real* qScores = scores.data() + (q - q0) * stride;
+            const std::vector<int64_t>* ban =
+                bans.empty() ? nullptr : &bans[begin + q];
+            TopK& heap = heaps[q];
+            real threshold = heap.threshold();
+            for (int64_t c = 0; c < nt; c += SELECT_CHUNK) {
+              const int64_t ce = std::min(nt, c + SELECT_CHUNK);
+              // most chunks hold no candidate, one vectorised max rejects them
+              real best = qScores[c];
+              for (int64_t j = c + 1; j < ce; j++) {
+                best = std::max(best, qScores[j]);
+              }
+              if (best < threshold) {
+                continue;
+              }
+              for (int64_t j = c; j < ce; j++) {
+                const int64_t row = t * PANEL + j;
+                if (qScores[j] >= threshold &&
+                    !(ban &&
+                      std::binary_search(ban->begin(), ban->end(), row))) {
+                  heap.push(qScores[j], row);
+                  threshold = heap.threshold();
+                }
+              }
+            }
+          }
+        }
+      }
+      for (int64_t q = 0; q < nb; q++) {
+        std::vector<ScoredId> best = heaps[q].take();
+        if (rerank > 0) {
+          const real* query = queries.row(ids[begin + q]) + qOffset;
+          for (auto& p : best) {
+            p.first =
+                kernel::dot<0>(base_->row(p.second) + offset_, query, dim_);
+          }
+          std::sort(best.begin(), best.end(), betterScore);
+        }
+        if (int64_t(best.size()) > k) {
+          best.resize(std::max(0, k));
+        }
+        results[begin + q] = std::move(best);
+      }
+    }
+  };
+  const int32_t nthreads =
+      std::max<int64_t>(1, std::min<int64_t>(thread, blocks));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  return results;
+}
+
+} // namespace uni_vec
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "matrix.h"
+#include "neighbors.h"
+#include "real.h"
+#include "vector.h"
+
+namespace uni_vec {
+
+/*
+ * Int8 copy of columns [offset, offset + dim) of the rows of a matrix,
+ * scored with integer dot products. Every row has its own scale,
+ * max |x| / 127 as for CompactMatrix. Queries are quantized on the fly to 7
+ * bits, shifted by 64 to be unsigned as the u8 x s8 instructions want them;
+ * the shift is taken back with the sum of the codes of each row. With 7 bits
+ * the pairwise sums of AVX2 maddubs cannot saturate, so AVX-512 VNNI, AVX2
+ * and the scalar loop give the same scores.
+ *
+ * Rows are stored in panels of PANEL rows, the GROUP byte column groups of
+ * the rows of a panel next to each other: one dpbusd (VNNI), or maddubs and
+ * madd (AVX2), of a broadcast query group adds to the dot products of a
+ * whole panel, with no horizontal sum. A row takes a quarter of the bytes
+ * it takes in fp32, so a scan of the catalog streams four times less.
+ */
+class SQMatrix {
+ public:
+  static const int64_t PANEL = 8;
+  static const int64_t GROUP = 4;
+
+ protected:
+  // kept for re-ranking in fp32
+  std::shared_ptr<const Matrix> base_;
+  int64_t offset_;
+  int64_t dim_;
+  int64_t m_;
+  // column groups of a row, dim rounded up to GROUP
+  int64_t groups_;
+  // panel p, group g, row r of the panel: GROUP bytes at
+  // ((p * groups_ + g) * PANEL + r) * GROUP, zero past dim and m
+  std::vector<int8_t> codes_;
+  std::vector<real> scales_;
+  std::vector<int32_t> sums_;
+
+  inline int8_t code(int64_t i, int64_t j) const {
+    return codes_[(((i / PANEL) * groups_ + j / GROUP) * PANEL + i % PANEL) *
+                      GROUP +
+                  j % GROUP];
+  }
+
+  void quantizeRows(int64_t, int64_t);
+  // Codes of a query, GROUP per word, returns their scale.
+  real quantizeQuery(const real*, std::vector<uint32_t>&) const;
+  // Scores of the rows of N panels from first for Q queries, with AVX2 or
+  // VNNI, those of query q stride reals after those of query q - 1.
+  template <int32_t Q, int32_t N>
+  void scoreSimd(const uint32_t*, const real*, int64_t, real*, int64_t) const;
+  // Scores of the rows of panels [begin, end) for nq queries.
+  void scanPanels(
+      const uint32_t*,
+      const real*,
+      int64_t,
+      int64_t,
+      int64_t,
+      real*,
+      int64_t) const;
+
+ public:
+  SQMatrix(std::shared_ptr<const Matrix>, int64_t, int64_t, int32_t thread = 1);
+
+  inline int64_t rows() const {
+    return m_;
+  }
+  inline int64_t dim() const {
+    return dim_;
+  }
+  // bytes of the codes, scales and sums
+  int64_t size() const;
+
+  // Int8 estimate of the dot product of row i and vec.
+  real dotRow(const Vector&, int64_t) const;
+  // Int8 estimates for rows [begin, end) and one query of dim reals.
+  void scan(const real*, int64_t, int64_t, real*) const;
+
+  // Best k rows for each of the rows ids of queries, whose columns
+  // [qOffset, qOffset + dim) are the query vectors, by int8 scores. With
+  // rerank > 0 the best max(k, rerank) are scored again in fp32 and the
+  // scores returned are exact. bans is empty or one sorted list per query.
+  // Threads take blocks of queries.
+  std::vector<std::vector<ScoredId>> search(
+      const Matrix&,
+      int64_t,
+      const std::vector<int64_t>&,
+      int32_t,
+      int32_t,
+      const std::vector<std::vector<int64_t>>&,
+      int32_t) const;
+};
+
+} // namespace uni_vec
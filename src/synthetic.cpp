@@ -0,0 +1,214 @@
+#include "synthetic.h"
+
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+namespace uni_vec {
+
+namespace {
+
+void appendInt(std::string& out, int64_t v) {
+  char buf[24];
+  int32_t n = 0;
+  do {
+    buf[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  while (n > 0) {
+    out.push_back(buf[--n]);
+  }
+}
+
+// 1 + Poisson(mean - 1), so every line gets at least one token.
+int32_t tokenCount(double mean, std::mt19937_64& rng) {
+  if (mean <= 1.0) {
+    return 1;
+  }
+  return 1 + std::poisson_distribution<int32_t>(mean - 1.0)(rng);
+}
+
+} // namespace
+
+ZipfSampler::ZipfSampler(int64_t n, double s, uint32_t seed) {
+  cdf_.resize(n);
+  double sum = 0.0;
+  for (int64_t k = 0; k < n; k++) {
+    sum += 1.0 / std::pow(double(k + 1), s);
+    cdf_[k] = sum;
+  }
+  ids_.resize(n);
+  std::iota(ids_.begin(), ids_.end(), 0);
+  std::shuffle(ids_.begin(), ids_.end(), std::mt19937_64(seed));
+}
+
+SyntheticData::SyntheticData(const SyntheticConfig& config)
+    : config_(config),
+      items_(config.items, config.zipf, config.seed),
+      words_(config.words, config.zipf, config.seed + 1),
+      userWords_(config.userWords, config.zipf, config.seed + 2) {
+  // DataLoader requires gap-free item, user and word indices, which the
+  // generator guarantees by giving each item / user / first basket one of
+  // them in turn.
+  if (config.items < config.words || config.users < config.userWords) {
+    throw std::invalid_argument(
+        "Synthetic data needs at least as many items as words and as many users as user words.");
+  }
+  if (config.baskets < config.users) {
+    throw std::invalid_argument(
+        "Synthetic data needs at least one trx basket per user.");
+  }
+  if (config.maxBasket < 2) {
+    throw std::invalid_argument("maxBasket must be at least 2.");
+  }
+}
+
+std::vector<std::string> SyntheticData::write(const std::string& prefix) const {
+  std::vector<std::string> paths;
+  auto file = [&](const char* suffix, int64_t lines, int32_t fileId,
+                  void (SyntheticData::*line)(int64_t, std::mt19937_64&, std::string&) const) {
+    if (lines <= 0) {
+      return;
+    }
+    paths.push_back(prefix + suffix);
+    writeFile(paths.back(), lines, fileId, line);
+  };
+  file("_item_word.txt", config_.items, 0, &SyntheticData::itemWordLine);
+  file("_user_word.txt", config_.users, 1, &SyntheticData::userWordLine);
+  file("_trx.txt", config_.baskets, 2, &SyntheticData::trxLine);
+  file("_view.txt", config_.views, 3, &SyntheticData::viewLine);
+  file("_sub.txt", config_.subs, 4, &SyntheticData::subLine);
+  file("_search.txt", config_.searches, 5, &SyntheticData::searchLine);
+  return paths;
+}
+
+void SyntheticData::writeFile(
+    const std::string& path,
+    int64_t lines,
+    int32_t fileId,
+    void (SyntheticData::*line)(int64_t, std::mt19937_64&, std::string&) const)
+    const {
+  std::ofstream ofs(path, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(path + " cannot be opened for writing!");
+  }
+  const int32_t nthreads = std::max(1, config_.thread);
+  const int64_t nblocks = (lines + BLOCK_LINES - 1) / BLOCK_LINES;
+  std::vector<std::string> buffers(nthreads);
+
+  for (int64_t round = 0; round < nblocks; round += nthreads) {
+    std::vector<std::thread> threads;
+    for (int32_t t = 0; t < nthreads && round + t < nblocks; t++) {
+      threads.push_back(std::thread([&, t]() {
+        const int64_t block = round + t;
+        std::seed_seq seq{uint32_t(config_.seed), uint32_t(fileId), uint32_t(block)};
+        std::mt19937_64 rng(seq);
+        std::string& out = buffers[t];
+        out.clear();
+        const int64_t end = std::min(lines, (block + 1) * BLOCK_LINES);
+        for (int64_t i = block * BLOCK_LINES; i < end; i++) {
+          (this->*line)(i, rng, out);
+        }
+      }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+      ofs.write(buffers[t].data(), buffers[t].size());
+    }
+  }
+  ofs.close();
+}
+
+void SyntheticData::itemWordLine(int64_t i, std::mt19937_64& rng, std::string& out) const {
+  appendInt(out, i);
+  out.push_back('\t');
+  appendInt(out, i % config_.words);
+  const int32_t n = tokenCount(config_.wordsPerItem, rng);
+  for (int32_t j = 1; j < n; j++) {
+    out.push_back('\t');
+    appendInt(out, words_(rng));
+  }
+  out.push_back('\n');
+}
+
+void SyntheticData::userWordLine(int64_t i, std::mt19937_64& rng, std::string& out) const {
+  appendInt(out, i);
+  out.push_back('\t');
+  appendInt(out, i % config_.userWords);
+  const int32_t n = tokenCount(config_.wordsPerUser, rng);
+  for (int32_t j = 1; j < n; j++) {
+    out.push_back('\t');
+    appendInt(out, userWords_(rng));
+  }
+  out.push_back('\n');
+}
+
+void SyntheticData::basketLine(
+    int32_t user,
+    double mu,
+    std::mt19937_64& rng,
+    std::string& out) const {
+  double len = std::lognormal_distribution<double>(mu, config_.basketSigma)(rng);
+  const int32_t n = std::max<int32_t>(
+      2, std::min<int32_t>(config_.maxBasket, std::lround(len)));
+  appendInt(out, user);
+  out.push_back('\t');
+  // increasing timestamps in seconds with exponential gaps
+  std::exponential_distribution<double> gap(1.0 / 60.0);
+  int64_t ts = std::uniform_int_distribution<int64_t>(0, 1 << 30)(rng);
+  for (int32_t j = 0; j < n; j++) {
+    ts += 1 + int64_t(gap(rng));
+    if (j > 0) out.push_back(',');
+    appendInt(out, ts);
+  }
+  out.push_back('\t');
+  for (int32_t j = 0; j < n; j++) {
+    if (j > 0) out.push_back(',');
+    appendInt(out, items_(rng));
+  }
+  out.push_back('\n');
+}
+
+void SyntheticData::trxLine(int64_t i, std::mt19937_64& rng, std::string& out) const {
+  // every user owns at least one basket
+  int32_t user = i < config_.users
+      ? i
+      : std::uniform_int_distribution<int32_t>(0, config_.users - 1)(rng);
+  basketLine(user, config_.basketMu, rng, out);
+}
+
+void SyntheticData::viewLine(int64_t, std::mt19937_64& rng, std::string& out) const {
+  // view sessions are longer than purchase baskets
+  int32_t user = std::uniform_int_distribution<int32_t>(0, config_.users - 1)(rng);
+  basketLine(user, config_.basketMu + 0.5, rng, out);
+}
+
+void SyntheticData::subLine(int64_t, std::mt19937_64& rng, std::string& out) const {
+  // item, user, substitute item
+  int32_t item = items_(rng);
+  int32_t sub = items_(rng);
+  if (sub == item) {
+    sub = (item + 1) % config_.items;
+  }
+  appendInt(out, item);
+  out.push_back('\t');
+  appendInt(out, std::uniform_int_distribution<int32_t>(0, config_.users - 1)(rng));
+  out.push_back('\t');
+  appendInt(out, sub);
+  out.push_back('\n');
+}
+
+void SyntheticData::searchLine(int64_t, std::mt19937_64& rng, std::string& out) const {
+  // item, search words
+  appendInt(out, items_(rng));
+  const int32_t n = tokenCount(config_.wordsPerSearch, rng);
+  for (int32_t j = 0; j < n; j++) {
+    out.push_back('\t');
+    appendInt(out, words_(rng));
+  }
+  out.push_back('\n');
+}
+
+} // namespace uni_vec
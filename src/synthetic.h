@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace uni_vec {
+
+// Shape of a synthetic dataset. Line counts of 0 skip the optional files.
+struct SyntheticConfig {
+  int64_t items = 100000;
+  int64_t users = 10000;
+  int64_t words = 20000;
+  int64_t userWords = 5000;
+  int64_t baskets = 200000;
+  int64_t views = 200000;
+  int64_t subs = 100000;
+  int64_t searches = 100000;
+  // exponent of the Zipf popularity of items and words
+  double zipf = 1.0;
+  // log-normal basket length, median exp(basketMu)
+  double basketMu = 1.5;
+  double basketSigma = 0.6;
+  int32_t maxBasket = 100;
+  // mean number of context tokens per item, user and search
+  double wordsPerItem = 8.0;
+  double wordsPerUser = 8.0;
+  double wordsPerSearch = 3.0;
+  int32_t seed = 1;
+  int32_t thread = 4;
+};
+
+// Draws ids with P(rank k) proportional to 1 / (k + 1)^s. Ranks are mapped to
+// ids through a random permutation so that popular ids are not all small.
+class ZipfSampler {
+ protected:
+  std::vector<double> cdf_;
+  std::vector<int32_t> ids_;
+
+ public:
+  ZipfSampler(int64_t n, double s, uint32_t seed);
+
+  template <typename RNG>
+  inline int32_t operator()(RNG& rng) const {
+    double u = std::uniform_real_distribution<double>(0.0, cdf_.back())(rng);
+    size_t k = std::upper_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    return ids_[std::min(k, ids_.size() - 1)];
+  }
+};
+
+/*
+ * Writes the item context, user context, trx, view, sub and search files in
+ * the formats DataLoader reads. Lines are generated in parallel blocks, each
+ * with its own seed, so the output only depends on the config and not on
+ * the number of threads.
+ */
+class SyntheticData {
+ protected:
+  SyntheticConfig config_;
+  ZipfSampler items_;
+  ZipfSampler words_;
+  ZipfSampler userWords_;
+
+  void writeFile(
+      const std::string&,
+      int64_t,
+      int32_t,
+      void (SyntheticData::*)(int64_t, std::mt19937_64&, std::string&) const)
+      const;
+
+  void itemWordLine(int64_t, std::mt19937_64&, std::string&) const;
+  void userWordLine(int64_t, std::mt19937_64&, std::string&) const;
+  void trxLine(int64_t, std::mt19937_64&, std::string&) const;
+  void viewLine(int64_t, std::mt19937_64&, std::string&) const;
+  void subLine(int64_t, std::mt19937_64&, std::string&) const;
+  void searchLine(int64_t, std::mt19937_64&, std::string&) const;
+  void basketLine(int32_t, double, std::mt19937_64&, std::string&) const;
+
+ public:
+  explicit SyntheticData(const SyntheticConfig&);
+
+  // Writes <prefix>_item_word.txt, _user_word.txt, _trx.txt, _view.txt,
+  // _sub.txt and _search.txt and returns the paths written.
+  std::vector<std::string> write(const std::string& prefix) const;
+
+  static const int64_t BLOCK_LINES = 65536;
+};
+
+} // namespace uni_vec
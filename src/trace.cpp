@@ -0,0 +1,113 @@
+#include "trace.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace uni_vec {
+
+namespace {
+
+struct TraceEvent {
+  const char* name;
+  const char* category;
+  int64_t start;
+  int64_t duration;
+};
+
+// Events of one thread. Owned by the registry so they outlive the thread.
+struct ThreadBuffer {
+  int32_t tid;
+  std::string name;
+  std::vector<TraceEvent> events;
+};
+
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+std::string tracePath;
+std::chrono::steady_clock::time_point traceStart;
+thread_local ThreadBuffer* localBuffer = nullptr;
+
+ThreadBuffer* threadBuffer() {
+  if (!localBuffer) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+    localBuffer = registry.back().get();
+    localBuffer->tid = registry.size();
+  }
+  return localBuffer;
+}
+
+void writeString(std::ostream& out, const std::string& s) {
+  out << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\';
+    }
+    out << c;
+  }
+  out << '"';
+}
+
+} // namespace
+
+std::atomic<bool> Trace::enabled_(false);
+
+void Trace::start(const std::string& path) {
+  tracePath = path;
+  traceStart = std::chrono::steady_clock::now();
+  setThreadName("main");
+  enabled_ = true;
+}
+
+int64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - traceStart)
+      .count();
+}
+
+void Trace::complete(const char* name, const char* category, int64_t start) {
+  threadBuffer()->events.push_back({name, category, start, now() - start});
+}
+
+void Trace::setThreadName(const std::string& name) {
+  threadBuffer()->name = name;
+}
+
+void Trace::finish() {
+  if (!enabled()) {
+    return;
+  }
+  enabled_ = false;
+  std::ofstream ofs(tracePath);
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(tracePath + " cannot be opened for tracing!");
+  }
+  std::lock_guard<std::mutex> lock(registryMutex);
+  ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto& buffer : registry) {
+    if (!buffer->name.empty()) {
+      ofs << (first ? "" : ",")
+          << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+          << buffer->tid << ",\"args\":{\"name\":";
+      writeString(ofs, buffer->name);
+      ofs << "}}";
+      first = false;
+    }
+    for (const auto& e : buffer->events) {
+      ofs << (first ? "" : ",") << "\n{\"name\":";
+      writeString(ofs, e.name);
+      ofs << ",\"cat\":";
+      writeString(ofs, e.category);
+      ofs << ",\"ph\":\"X\",\"ts\":" << e.start << ",\"dur\":" << e.duration
+          << ",\"pid\":1,\"tid\":" << buffer->tid << "}";
+      first = false;
+    }
+  }
+  ofs << "\n]}\n";
+}
+
+} // namespace uni_vec
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace uni_vec {
+
+/*
+ * Opt-in timeline tracing in the Chrome trace-event format (load the output
+ * in chrome://tracing or Perfetto). Events are buffered per thread and only
+ * written by finish(). While tracing is off a scope costs one relaxed load.
+ */
+class Trace {
+ protected:
+  static std::atomic<bool> enabled_;
+
+ public:
+  static void start(const std::string&);
+  static void finish();
+
+  static inline bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // microseconds since start()
+  static int64_t now();
+
+  // Records a complete event of the calling thread that began at start.
+  static void complete(const char* name, const char* category, int64_t start);
+
+  static void setThreadName(const std::string&);
+};
+
+class TraceScope {
+ protected:
+  const char* name_;
+  const char* category_;
+  int64_t start_;
+
+ public:
+  TraceScope(const char* name, const char* category)
+      : name_(name), category_(category), start_(-1) {
+    if (Trace::enabled()) {
+      start_ = Trace::now();
+    }
+  }
+  ~TraceScope() {
+    if (start_ >= 0) {
+      Trace::complete(name_, category_, start_);
+    }
+  }
+};
+
+} // namespace uni_vec
@@ -8,9 +8,13 @@
 
 #include "uniVec.h"
 
-#include "cnpy/cnpy.h"
+#include "delta.h"
+#include "kernel.h"
+#include "mappedModel.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
 #include <numeric>
@@ -24,12 +28,14 @@ namespace uni_vec {
 
 constexpr int32_t FASTTEXT_VERSION = 12; /* Version 1b */
 constexpr int32_t FASTTEXT_FILEFORMAT_MAGIC_INT32 = 793712314;
+constexpr real ADAGRAD_INIT_ACCUMULATOR = 0.1;
 
 bool comparePairs(
     const std::pair<real, std::string>& l,
     const std::pair<real, std::string>& r);
 
-UniVec::UniVec() : quant_(false), wordVectors_(nullptr) {}
+UniVec::UniVec()
+    : trainSeconds_(0), deltaCount_(0), quant_(false), wordVectors_(nullptr) {}
 
 std::shared_ptr<const int2VecOfInt> UniVec::getItem2Word() const {
   return item2Word_;
@@ -61,45 +67,776 @@ void UniVec::saveVectors(const std::string& filename, std::shared_ptr<const Matr
     throw std::invalid_argument(
         filename + " cannot be opened for saving vectors!");
   }
-  // ofs << *mat;
-  mat->dump(ofs);
+  mat->dump(ofs, 0, mat->rows(), args_->thread);
   ofs.close();
 }
 
 void UniVec::saveVectors(const std::string& filename) const {
-  // saveVectors(filename + "_userInput.vec", userInput_);
-  // saveVectors(filename + "_userViewInput.vec", userViewInput_);
-  // saveVectors(filename + "_itemInput.vec", itemInput_);
-  // saveVectors(filename + "_wordOutput.vec", wordOutput_);
-  // saveVectors(filename + "_itemOutput.vec", itemOutput_);
-  // saveVectors(filename + "_itemViewOutput.vec", itemViewOutput_);
-  size_t Nx = userInput_->rows();
-  size_t Ny = userInput_->cols();
-  cnpy::npy_save(filename + "_userInput.vec.npy",userInput_->data(),{Nx,Ny},"w");
+  TraceScope trace("saveVectors", "save");
+  exportVectors(
+      filename,
+      Exporter::formatsFromString(args_->exportFormats),
+      args_->exportShards,
+      args_->thread);
+}
+
+void UniVec::exportVectors(
+    const std::string& prefix,
+    const std::vector<export_format>& formats,
+    int32_t shards,
+    int32_t thread) const {
+  Exporter exporter(formats, shards, thread);
+  for (const auto& named : trainedMatrices()) {
+    exporter.add(prefix + "_" + named.first + ".vec", named.second);
+  }
+  exporter.write();
+
+  std::ofstream ofs(prefix + ".manifest.json");
+  if (!ofs.is_open()) {
+    throw std::invalid_argument(
+        prefix + ".manifest.json cannot be opened for saving!");
+  }
+  exporter.writeManifest(ofs);
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<Matrix>>>
+UniVec::trainedMatrices() const {
+  std::vector<std::pair<std::string, std::shared_ptr<Matrix>>> matrices;
+  auto add = [&](const char* name, std::shared_ptr<Matrix> mat, bool trained) {
+    if (mat && trained) {
+      matrices.emplace_back(name, mat);
+    }
+  };
+  add("userInput", userInput_, true);
+  add("userWordOutput", userWordOutput_, !args_->skipUserContext);
+  add("userViewInput", userViewInput_, !args_->skipViewData);
+  add("itemInput", itemInput_, true);
+  add("wordOutput", wordOutput_, true);
+  add("itemOutput", itemOutput_, true);
+  add("itemViewOutput", itemViewOutput_, !args_->skipViewData);
+  return matrices;
+}
+
+void UniVec::exportDelta(const std::string& prefix) {
+  TraceScope trace("exportDelta", "save");
+  int64_t rows = 0;
+  for (const auto& named : trainedMatrices()) {
+    Matrix& mat = *named.second;
+    if (!mat.tracksDirty()) {
+      throw std::logic_error("Updated rows are only tracked with -deltaInterval.");
+    }
+    // flags are cleared before the rows are copied, a concurrent update
+    // marks its row again and lands in the next delta
+    const std::vector<int64_t> ids = mat.takeDirty();
+    MatrixDelta::save(mat, ids, prefix + "_" + named.first + ".vec.delta");
+    rows += ids.size();
+  }
+  deltaCount_++;
+  if (args_->verbose > 1) {
+    std::cerr << "\rWrote delta " << deltaCount_ << " of " << rows
+              << " rows to " << prefix << std::endl;
+  }
+}
+
+std::vector<real> UniVec::itemQueries(const std::vector<int64_t>& items) const {
+  const int64_t dim = itemInput_->cols();
+  std::vector<real> queries(items.size() * dim);
+  for (size_t q = 0; q < items.size(); q++) {
+    if (items[q] < 0 || items[q] >= itemInput_->rows()) {
+      throw std::invalid_argument(
+          "Item " + std::to_string(items[q]) + " is out of range.");
+    }
+    std::copy(
+        itemInput_->row(items[q]),
+        itemInput_->row(items[q]) + dim,
+        queries.data() + q * dim);
+  }
+  return queries;
+}
+
+std::vector<std::vector<ScoredId>> UniVec::getNN(
+    const std::vector<int64_t>& items,
+    int32_t k,
+    bool cosine,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  const int64_t dim = itemInput_->cols();
+  // for concat the rows of itemOutput are [user part ; item part]
+  ExactSearch search(itemOutput_, itemOutput_->cols() - dim, dim, cosine);
+  const std::vector<real> queries = itemQueries(items);
+  return search.search(queries.data(), items.size(), k, bans, thread);
+}
+
+std::vector<std::vector<ScoredId>> UniVec::recommend(
+    const std::vector<int64_t>& queries,
+    bool users,
+    int32_t k,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  TraceScope trace("recommend", "search");
+  if (!users) {
+    if (int8Items_) {
+      return int8Items_->search(
+          *itemInput_, 0, queries, k, int8Rerank_, bans, thread);
+    }
+    const int64_t dim = itemInput_->cols();
+    BlockedSearch search(itemOutput_, itemOutput_->cols() - dim, dim);
+    return search.search(*itemInput_, 0, queries, k, bans, thread);
+  }
+  if (int8Users_) {
+    return int8Users_->search(
+        *userInput_, 0, queries, k, int8Rerank_, bans, thread);
+  }
+  const int64_t dim = userInput_->cols();
+  std::shared_ptr<const Matrix> base =
+      args_->combine == combine_method::meanSum ? itemInput_ : itemOutput_;
+  BlockedSearch search(base, 0, dim);
+  return search.search(*userInput_, 0, queries, k, bans, thread);
+}
+
+std::vector<std::vector<ScoredId>> UniVec::recommend(
+    const Matrix& vectors,
+    int32_t k,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  TraceScope trace("recommend", "search");
+  const int64_t dim = userInput_->cols();
+  if (vectors.cols() != dim) {
+    throw std::invalid_argument("The vectors are not user vectors.");
+  }
+  std::vector<int64_t> rows(vectors.rows());
+  std::iota(rows.begin(), rows.end(), 0);
+  if (int8Users_) {
+    return int8Users_->search(vectors, 0, rows, k, int8Rerank_, bans, thread);
+  }
+  std::shared_ptr<const Matrix> base =
+      args_->combine == combine_method::meanSum ? itemInput_ : itemOutput_;
+  BlockedSearch search(base, 0, dim);
+  return search.search(vectors, 0, rows, k, bans, thread);
+}
+
+template <int32_t D>
+void UniVec::fitColdRow(
+    Model& model,
+    int32_t row,
+    const std::vector<int32_t>& words,
+    int32_t epoch,
+    real lr) const {
+  for (int32_t e = 0; e < epoch; e++) {
+    regWordModel<D>(model, row, words, lr * (1.0 - real(e) / epoch));
+  }
+}
+
+std::shared_ptr<Matrix> UniVec::fitColdRows(
+    std::shared_ptr<Matrix> output,
+    const std::vector<std::vector<int32_t>>& words,
+    const std::vector<int64_t>& wordCounts,
+    int32_t epoch,
+    real lr,
+    int32_t neg,
+    int32_t thread) const {
+  const int64_t nwords = output->rows();
+  const int64_t dim = output->cols();
+  for (const auto& list : words) {
+    for (int32_t word : list) {
+      if (word < 0 || word >= nwords) {
+        throw std::invalid_argument(
+            "Word " + std::to_string(word) + " is out of range.");
+      }
+    }
+  }
+  if (int64_t(wordCounts.size()) > nwords) {
+    throw std::invalid_argument("More word counts than words in the model.");
+  }
+  if (epoch < 1 || neg < 1) {
+    throw std::invalid_argument("epoch and neg must be positive.");
+  }
+  std::vector<int64_t> counts(wordCounts);
+  counts.resize(nwords, 1);
+  auto negatives = std::make_shared<const NegativeTable>(counts, 0);
+
+  auto args = std::make_shared<Args>(*args_);
+  args->dim = dim;
+  args->neg = neg;
+  args->optimizer = optimizer_name::sgd;
+  auto rows = std::make_shared<Matrix>(words.size(), dim);
+  rows->zero();
+
+  ColdFitFn fit = &UniVec::fitColdRow<0>;
+  switch (dim) {
+#define UNI_VEC_SELECT_COLD_FIT(D)  \
+    case D:                         \
+      fit = &UniVec::fitColdRow<D>; \
+      break;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_SELECT_COLD_FIT)
+#undef UNI_VEC_SELECT_COLD_FIT
+  }
+
+  // rows are handed out in chunks, every thread reading the negative table
+  // from its own offset as in training
+  const int64_t CHUNK = 64;
+  const int64_t n = words.size();
+  const int32_t nthreads = std::max<int64_t>(
+      1, std::min<int64_t>(thread, (n + CHUNK - 1) / CHUNK));
+  std::atomic<int64_t> next(0);
+  auto worker = [&](int32_t threadId) {
+    Model model(rows, rows, output, output, args, true, threadId);
+    model.setNegativeTable(negatives, threadId * negatives->size() / nthreads);
+    model.freezeOutput(true);
+    for (int64_t b = next.fetch_add(CHUNK); b < n; b = next.fetch_add(CHUNK)) {
+      for (int64_t i = b; i < std::min(n, b + CHUNK); i++) {
+        (this->*fit)(model, i, words[i], epoch, lr);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int32_t t = 1; t < nthreads; t++) {
+    threads.push_back(std::thread(worker, t));
+  }
+  worker(0);
+  for (auto& th : threads) {
+    th.join();
+  }
+  return rows;
+}
+
+std::shared_ptr<Matrix> UniVec::inferColdItems(
+    const std::vector<std::vector<int32_t>>& words,
+    const std::vector<int64_t>& wordCounts,
+    int32_t epoch,
+    real lr,
+    int32_t neg,
+    int32_t thread) const {
+  TraceScope trace("inferColdItems", "infer");
+  if (wordOutput_->cols() != itemInput_->cols()) {
+    throw std::invalid_argument("The word and item vectors differ in size.");
+  }
+  return fitColdRows(wordOutput_, words, wordCounts, epoch, lr, neg, thread);
+}
+
+std::shared_ptr<Matrix> UniVec::inferColdUsers(
+    const std::vector<std::vector<int32_t>>& words,
+    const std::vector<int64_t>& wordCounts,
+    int32_t epoch,
+    real lr,
+    int32_t neg,
+    int32_t thread) const {
+  TraceScope trace("inferColdUsers", "infer");
+  if (!userWordOutput_ || userWordOutput_->rows() == 0) {
+    throw std::invalid_argument("The model has no user context vectors.");
+  }
+  return fitColdRows(userWordOutput_, words, wordCounts, epoch, lr, neg, thread);
+}
+
+std::shared_ptr<Matrix> UniVec::solveColdUsers(
+    const std::vector<std::vector<int32_t>>& words,
+    const std::vector<int64_t>& wordCounts,
+    int32_t neg,
+    real logit,
+    real lambda,
+    int32_t thread) const {
+  TraceScope trace("solveColdUsers", "infer");
+  typedef Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+  typedef Eigen::Matrix<real, Eigen::Dynamic, 1> DenseVector;
+  typedef Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      RowMatrix;
+  if (!userWordOutput_ || userWordOutput_->rows() == 0) {
+    throw std::invalid_argument("The model has no user context vectors.");
+  }
+  const int64_t nwords = userWordOutput_->rows();
+  const int64_t dim = userWordOutput_->cols();
+  for (const auto& list : words) {
+    for (int32_t word : list) {
+      if (word < 0 || word >= nwords) {
+        throw std::invalid_argument(
+            "Word " + std::to_string(word) + " is out of range.");
+      }
+    }
+  }
+  if (int64_t(wordCounts.size()) > nwords) {
+    throw std::invalid_argument("More word counts than words in the model.");
+  }
+  if (lambda <= 0.0) {
+    throw std::invalid_argument("lambda must be positive.");
+  }
+
+  // E[o o'] and E[o] under the unigram^0.5 distribution of NegativeTable
+  Eigen::Map<const RowMatrix> output(userWordOutput_->data(), nwords, dim);
+  DenseVector p(nwords);
+  for (int64_t w = 0; w < nwords; w++) {
+    p[w] = std::sqrt(real(w < int64_t(wordCounts.size()) ? wordCounts[w] : 1));
+  }
+  p /= p.sum();
+  const DenseMatrix secondMoment =
+      output.transpose() * p.asDiagonal() * output;
+  const DenseVector mean = output.transpose() * p;
+
+  auto rows = std::make_shared<Matrix>(words.size(), dim);
+  const int64_t CHUNK = 256;
+  const int64_t n = words.size();
+  const int32_t nthreads = std::max<int64_t>(
+      1, std::min<int64_t>(thread, (n + CHUNK - 1) / CHUNK));
+  std::atomic<int64_t> next(0);
+  auto worker = [&]() {
+    DenseMatrix system(dim, dim);
+    DenseVector rhs(dim);
+    Eigen::LDLT<DenseMatrix> ldlt(dim);
+    for (int64_t b = next.fetch_add(CHUNK); b < n; b = next.fetch_add(CHUNK)) {
+      for (int64_t i = b; i < std::min(n, b + CHUNK); i++) {
+        const real negatives = real(neg) * words[i].size();
+        system = negatives * secondMoment;
+        system.diagonal().array() += lambda;
+        rhs = -negatives * mean;
+        for (int32_t word : words[i]) {
+          system.selfadjointView<Eigen::Lower>().rankUpdate(
+              output.row(word).transpose());
+          rhs += output.row(word).transpose();
+        }
+        ldlt.compute(system);
+        Eigen::Map<DenseVector>(rows->row(i), dim) =
+            ldlt.solve(logit * rhs);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int32_t t = 1; t < nthreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto& th : threads) {
+    th.join();
+  }
+  return rows;
+}
 
-  Nx = userWordOutput_->rows();
-  Ny = userWordOutput_->cols();
-  cnpy::npy_save(filename + "_userWordOutput.vec.npy", userWordOutput_->data(),{Nx,Ny},"w");
+template <combine_method C, int32_t D>
+void UniVec::foldInUser(
+    Model& model,
+    const std::vector<std::vector<int32_t>>& windows,
+    int32_t epoch,
+    real lr) const {
+  const int32_t userPos = 1;
+  const int32_t itemPos = 0;
+  for (int32_t e = 0; e < epoch; e++) {
+    const real lrEpoch = lr * (1.0 - real(e) / epoch);
+    for (const auto& window : windows) {
+      if (C == combine_method::concat) {
+        model.updateConcatKernel<D>(window, userPos, itemPos, lrEpoch);
+      } else if (C == combine_method::mean) {
+        model.updateMeanKernel<D>(window, userPos, itemPos, lrEpoch);
+      } else {
+        model.updateMeanSumKernel<D>(window, userPos, itemPos, lrEpoch);
+      }
+    }
+  }
+}
+
+template <combine_method C>
+UniVec::FoldInFn UniVec::selectFoldIn(int32_t dim) const {
+  switch (dim) {
+#define UNI_VEC_SELECT_FOLD_IN(D) \
+    case D:                       \
+      return &UniVec::foldInUser<C, D>;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_SELECT_FOLD_IN)
+#undef UNI_VEC_SELECT_FOLD_IN
+  }
+  return &UniVec::foldInUser<C, 0>;
+}
+
+std::shared_ptr<Matrix> UniVec::foldInUsers(
+    const std::vector<int64_t>& users,
+    const std::vector<std::vector<std::vector<int32_t>>>& baskets,
+    std::shared_ptr<const NegativeTable> negatives,
+    int32_t epoch,
+    real lr,
+    int32_t thread) const {
+  TraceScope trace("foldInUsers", "infer");
+  if (users.size() != baskets.size()) {
+    throw std::invalid_argument("One list of baskets per user is required.");
+  }
+  if (args_->combine == combine_method::concat && args_->skipUserContext) {
+    throw std::invalid_argument(
+        "The model was trained without user vectors in its hidden vectors.");
+  }
+  if (epoch < 1) {
+    throw std::invalid_argument("epoch must be positive.");
+  }
+  const int64_t nitems = itemInput_->rows();
+  for (const auto& list : baskets) {
+    for (const auto& basket : list) {
+      for (int32_t item : basket) {
+        if (item < 0 || item >= nitems) {
+          throw std::invalid_argument(
+              "Item " + std::to_string(item) + " is out of range.");
+        }
+      }
+    }
+  }
+
+  // the kernels update row i of rows for the i-th user
+  const int64_t n = users.size();
+  const int64_t userDim = userInput_->cols();
+  auto rows = std::make_shared<Matrix>(n, userDim);
+  rows->zero();
+  for (int64_t i = 0; i < n; i++) {
+    if (users[i] < 0) {
+      throw std::invalid_argument(
+          "User " + std::to_string(users[i]) + " is out of range.");
+    }
+    if (users[i] < userInput_->rows()) {
+      const real* row = userInput_->row(users[i]);
+      std::copy(row, row + userDim, rows->row(i));
+    }
+  }
+
+  auto args = std::make_shared<Args>(*args_);
+  args->optimizer = optimizer_name::sgd;
+  // the kernels assume user and item rows have the same size
+  const int32_t dim = (args_->userDim == args_->dim) ? args_->dim : 0;
+  FoldInFn fold = selectFoldIn<combine_method::meanSum>(dim);
+  if (args_->combine == combine_method::concat) {
+    fold = selectFoldIn<combine_method::concat>(dim);
+  } else if (args_->combine == combine_method::mean) {
+    fold = selectFoldIn<combine_method::mean>(dim);
+  }
+
+  const int64_t CHUNK = 16;
+  const int32_t nthreads = std::max<int64_t>(
+      1, std::min<int64_t>(thread, (n + CHUNK - 1) / CHUNK));
+  std::atomic<int64_t> next(0);
+  auto worker = [&](int32_t threadId) {
+    Model model(
+        itemInput_, rows, wordOutput_, itemOutput_, args, false, threadId);
+    model.setNegativeTable(negatives, threadId * negatives->size() / nthreads);
+    model.freezeOutput(true);
+    model.freezeItemInput(true);
+    std::default_random_engine rng(threadId);
+    std::vector<std::vector<int32_t>> windows;
+    std::vector<int32_t> basket;
+    for (int64_t b = next.fetch_add(CHUNK); b < n; b = next.fetch_add(CHUNK)) {
+      for (int64_t i = b; i < std::min(n, b + CHUNK); i++) {
+        // windows as in training: the item, the user and the items before
+        windows.clear();
+        for (const auto& items : baskets[i]) {
+          if (items.size() < 2) {
+            continue;
+          }
+          basket.assign(1, i);
+          basket.insert(basket.end(), items.begin(), items.end());
+          for (auto& window : DataLoader::computeWindowedOrderedBasket(
+                   basket, 0, args_->ws, false, rng)) {
+            windows.push_back(std::move(window));
+          }
+        }
+        (this->*fold)(model, windows, epoch, lr);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int32_t t = 1; t < nthreads; t++) {
+    threads.push_back(std::thread(worker, t));
+  }
+  worker(0);
+  for (auto& th : threads) {
+    th.join();
+  }
+  return rows;
+}
 
-  Nx = userViewInput_->rows();
-  Ny = userViewInput_->cols();
-  cnpy::npy_save(filename + "_userViewInput.vec.npy",userViewInput_->data(),{Nx,Ny},"w");
+void UniVec::setUserRows(
+    const std::vector<int64_t>& users,
+    const Matrix& vectors) {
+  const int64_t userDim = userInput_->cols();
+  if (vectors.cols() != userDim || vectors.rows() != int64_t(users.size())) {
+    throw std::invalid_argument("One user vector per user is required.");
+  }
+  int64_t nusers = userInput_->rows();
+  for (int64_t user : users) {
+    nusers = std::max(nusers, user + 1);
+  }
+  auto updated = std::make_shared<Matrix>(nusers, userDim);
+  updated->zero();
+  std::copy(
+      userInput_->data(),
+      userInput_->data() + userInput_->rows() * userDim,
+      updated->data());
+  for (size_t i = 0; i < users.size(); i++) {
+    std::copy(
+        vectors.row(i), vectors.row(i) + userDim, updated->row(users[i]));
+  }
+  userInput_ = updated;
+}
 
-  Nx = itemInput_->rows();
-  Ny = itemInput_->cols();
-  cnpy::npy_save(filename + "_itemInput.vec.npy",itemInput_->data(),{Nx,Ny},"w");
+std::vector<std::vector<real>> UniVec::rank(
+    const std::vector<RankRequest>& requests,
+    int32_t thread) const {
+  Ranker ranker(
+      args_->combine, !args_->skipUserContext, userInput_, itemInput_, itemOutput_);
+  return ranker.score(requests, thread);
+}
+
+std::vector<std::vector<ScoredId>> UniVec::complete(
+    const std::vector<RankRequest>& requests,
+    int32_t k,
+    int32_t thread) const {
+  TraceScope trace("complete", "search");
+  Ranker ranker(
+      args_->combine, !args_->skipUserContext, userInput_, itemInput_, itemOutput_);
+  return ranker.complete(requests, k, thread);
+}
+
+RankingMetrics UniVec::test(
+    const std::vector<std::vector<int32_t>>& baskets,
+    bool lastOnly,
+    int32_t k,
+    int32_t candidates,
+    int32_t thread) const {
+  TraceScope trace("test", "eval");
+  if (k < 1 || candidates < 0) {
+    throw std::invalid_argument("k must be positive, candidates not negative.");
+  }
+  const int64_t nitems = itemInput_->rows();
+  const int64_t nusers = userInput_->rows();
+  for (const auto& basket : baskets) {
+    for (size_t i = 1; i < basket.size(); i++) {
+      if (basket[i] < 0 || basket[i] >= nitems) {
+        throw std::invalid_argument(
+            "Item " + std::to_string(basket[i]) + " is out of range.");
+      }
+    }
+  }
+  Ranker ranker(
+      args_->combine, !args_->skipUserContext, userInput_, itemInput_, itemOutput_);
+
+  // (basket, position of the held-out item) of every query
+  std::vector<std::pair<size_t, size_t>> queries;
+  for (size_t b = 0; b < baskets.size(); b++) {
+    const size_t size = baskets[b].size();
+    for (size_t i = lastOnly && size > 2 ? size - 1 : 2; i < size; i++) {
+      queries.emplace_back(b, i);
+    }
+  }
 
-  Nx = wordOutput_->rows();
-  Ny = wordOutput_->cols();
-  cnpy::npy_save(filename + "_wordOutput.vec.npy",wordOutput_->data(),{Nx,Ny},"w");
+  RankingMetrics metrics;
+  const size_t CHUNK = 4096;
+  std::vector<RankRequest> requests;
+  std::vector<int32_t> ranks;
+  for (size_t q0 = 0; q0 < queries.size(); q0 += CHUNK) {
+    const size_t q1 = std::min(queries.size(), q0 + CHUNK);
+    requests.resize(q1 - q0);
+    for (size_t q = q0; q < q1; q++) {
+      const auto& basket = baskets[queries[q].first];
+      const size_t pos = queries[q].second;
+      RankRequest& request = requests[q - q0];
+      request.user = basket[0] >= 0 && basket[0] < nusers ? basket[0] : -1;
+      request.context.assign(
+          basket.begin() + std::max<int64_t>(1, pos - args_->ws),
+          basket.begin() + pos);
+      request.candidates.clear();
+      if (candidates > 0) {
+        // the target first, then negatives seeded by the query alone
+        std::minstd_rand rng(q + 1);
+        std::uniform_int_distribution<int64_t> uniform(0, nitems - 1);
+        request.candidates.push_back(basket[pos]);
+        while (request.candidates.size() <= size_t(candidates)) {
+          const int64_t item = uniform(rng);
+          if (item != basket[pos]) {
+            request.candidates.push_back(item);
+          }
+        }
+      }
+    }
 
-  Nx = itemOutput_->rows();
-  Ny = itemOutput_->cols();
-  cnpy::npy_save(filename + "_itemOutput.vec.npy",itemOutput_->data(),{Nx,Ny},"w");
+    // 1-based rank of every held-out item, 0 past k
+    ranks.assign(requests.size(), 0);
+    if (candidates > 0) {
+      auto scores = ranker.score(requests, thread);
+      for (size_t r = 0; r < requests.size(); r++) {
+        int32_t rank = 1;
+        for (size_t c = 1; c < scores[r].size(); c++) {
+          rank += scores[r][c] > scores[r][0];
+        }
+        ranks[r] = rank <= k ? rank : 0;
+      }
+    } else {
+      auto results = ranker.complete(requests, k, thread);
+      for (size_t r = 0; r < requests.size(); r++) {
+        const int32_t target = baskets[queries[q0 + r].first]
+                                      [queries[q0 + r].second];
+        for (size_t j = 0; j < results[r].size(); j++) {
+          if (results[r][j].second == target) {
+            ranks[r] = j + 1;
+            break;
+          }
+        }
+      }
+    }
+    for (int32_t rank : ranks) {
+      if (rank > 0) {
+        metrics.hitRate += 1.0;
+        metrics.ndcg += 1.0 / std::log2(rank + 1.0);
+        metrics.mrr += 1.0 / rank;
+      }
+    }
+  }
+  metrics.count = queries.size();
+  if (metrics.count > 0) {
+    metrics.hitRate /= metrics.count;
+    metrics.ndcg /= metrics.count;
+    metrics.mrr /= metrics.count;
+  }
+  return metrics;
+}
+
+void UniVec::setCombineMethod(combine_method combine) {
+  args_->combine = combine;
+}
+
+void UniVec::buildIndex(
+    int32_t M,
+    int32_t efConstruction,
+    int32_t seed,
+    int32_t thread) {
+  TraceScope trace("buildIndex", "index");
+  const int64_t dim = itemInput_->cols();
+  index_ = std::make_shared<HnswIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+  index_->build(M, efConstruction, seed, thread);
+  ivfIndex_.reset();
+  hashIndex_.reset();
+}
+
+void UniVec::buildIvfPqIndex(
+    int32_t nlist,
+    int32_t dsub,
+    int32_t seed,
+    int32_t thread) {
+  TraceScope trace("buildIvfPqIndex", "index");
+  const int64_t dim = itemInput_->cols();
+  ivfIndex_ =
+      std::make_shared<IvfPqIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+  ivfIndex_->build(nlist, dsub, seed, thread);
+  index_.reset();
+  hashIndex_.reset();
+}
+
+void UniVec::buildHashIndex(int32_t bits, int32_t seed, int32_t thread) {
+  TraceScope trace("buildHashIndex", "index");
+  const int64_t dim = itemInput_->cols();
+  hashIndex_ =
+      std::make_shared<HashIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+  hashIndex_->build(bits, seed, thread);
+  index_.reset();
+  ivfIndex_.reset();
+}
 
-  Nx = itemViewOutput_->rows();
-  Ny = itemViewOutput_->cols();
-  cnpy::npy_save(filename + "_itemViewOutput.vec.npy",itemViewOutput_->data(),{Nx,Ny},"w");
+void UniVec::buildInt8(int32_t rerank, int32_t thread) {
+  TraceScope trace("buildInt8", "index");
+  const int64_t dim = itemInput_->cols();
+  int8Items_ = std::make_shared<SQMatrix>(
+      itemOutput_, itemOutput_->cols() - dim, dim, thread);
+  std::shared_ptr<const Matrix> base =
+      args_->combine == combine_method::meanSum ? itemInput_ : itemOutput_;
+  int8Users_ =
+      std::make_shared<SQMatrix>(base, 0, userInput_->cols(), thread);
+  int8Rerank_ = std::max(0, rerank);
+}
+
+bool UniVec::hasIndex() const {
+  return index_ || ivfIndex_ || hashIndex_ || int8Items_;
+}
+
+void UniVec::saveIndex(const std::string& filename) const {
+  if (ivfIndex_) {
+    ivfIndex_->save(filename);
+  } else if (hashIndex_) {
+    hashIndex_->save(filename);
+  } else if (index_) {
+    index_->save(filename);
+  } else {
+    throw std::logic_error("No index has been built.");
+  }
+}
+
+void UniVec::loadIndex(const std::string& filename) {
+  const int64_t dim = itemInput_->cols();
+  if (IvfPqIndex::isIvfPqIndex(filename)) {
+    auto index =
+        std::make_shared<IvfPqIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+    index->load(filename);
+    ivfIndex_ = index;
+    index_.reset();
+    hashIndex_.reset();
+  } else if (HashIndex::isHashIndex(filename)) {
+    auto index =
+        std::make_shared<HashIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+    index->load(filename);
+    hashIndex_ = index;
+    index_.reset();
+    ivfIndex_.reset();
+  } else {
+    auto index = std::make_shared<HnswIndex>(itemOutput_, itemOutput_->cols() - dim, dim);
+    index->load(filename);
+    index_ = index;
+    ivfIndex_.reset();
+    hashIndex_.reset();
+  }
+}
+
+std::vector<std::vector<ScoredId>> UniVec::getApproxNN(
+    const std::vector<int64_t>& items,
+    int32_t k,
+    int32_t efSearch,
+    int32_t nprobe,
+    int32_t shortlist,
+    const std::vector<std::vector<int64_t>>& bans,
+    int32_t thread) const {
+  if (!index_ && !ivfIndex_ && !hashIndex_) {
+    if (!int8Items_) {
+      throw std::logic_error("No index has been built or loaded.");
+    }
+    return int8Items_->search(
+        *itemInput_, 0, items, k, int8Rerank_, bans, thread);
+  }
+  const std::vector<real> queries = itemQueries(items);
+  if (ivfIndex_) {
+    return ivfIndex_->search(queries.data(), items.size(), k, nprobe, bans, thread);
+  }
+  if (hashIndex_) {
+    return hashIndex_->search(
+        queries.data(), items.size(), k, shortlist, bans, thread);
+  }
+  return index_->search(queries.data(), items.size(), k, efSearch, bans, thread);
+}
+
+std::vector<std::pair<real, std::string>> UniVec::getNN(
+    const std::string& word,
+    int32_t k) {
+  const int64_t item = std::stoll(word);
+  std::vector<std::pair<real, std::string>> nn;
+  for (const auto& p : getNN({item}, k, false, {{item}}, args_->thread)[0]) {
+    nn.emplace_back(p.first, std::to_string(p.second));
+  }
+  return nn;
+}
+
+std::vector<std::pair<real, std::string>> UniVec::getNN(
+    const Matrix& wordVectors,
+    const Vector& query,
+    int32_t k,
+    const std::set<std::string>& banSet) {
+  // not owned, the search does not outlive this call
+  std::shared_ptr<const Matrix> rows(&wordVectors, [](const Matrix*) {});
+  ExactSearch search(rows, 0, wordVectors.cols(), true);
+  std::vector<int64_t> bans;
+  for (const auto& word : banSet) {
+    bans.push_back(std::stoll(word));
+  }
+  std::sort(bans.begin(), bans.end());
+  std::vector<std::pair<real, std::string>> nn;
+  for (const auto& p : search.search(query.data(), 1, k, {bans}, args_->thread)[0]) {
+    nn.emplace_back(p.first, std::to_string(p.second));
+  }
+  return nn;
 }
 
 bool UniVec::checkModel(std::istream& in) {
@@ -151,6 +888,10 @@ void UniVec::saveModel(const std::string& filename) {
 }
 
 void UniVec::loadModel(const std::string& filename) {
+  if (MappedModel::isMappedModel(filename)) {
+    loadMappedModel(filename);
+    return;
+  }
   std::ifstream ifs(filename, std::ifstream::binary);
   if (!ifs.is_open()) {
     throw std::invalid_argument(filename + " cannot be opened for loading!");
@@ -178,18 +919,125 @@ void UniVec::loadModel(std::istream& in) {
   wordOutput_->load(in);
   itemOutput_->load(in);
   userWordOutput_->load(in);
-  
+  // not saved, but only concat widens the item output vectors
+  args_->combine = itemOutput_->cols() != itemInput_->cols()
+      ? combine_method::concat
+      : combine_method::meanSum;
+  args_->userDim = userInput_->cols();
+
   model_ = std::make_shared<Model>(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, 0);
 
   // model_->setTargetCounts(dict_->getCounts(entry_type::word));
 }
 
+void UniVec::saveMappedModel(const std::string& filename) const {
+  TraceScope trace("saveMappedModel", "save");
+  // matrices of skipped streams were never trained and are left out
+  std::vector<std::pair<std::string, std::shared_ptr<const Matrix>>> matrices;
+  matrices.push_back({"userInput", userInput_});
+  if (!args_->skipViewData) {
+    matrices.push_back({"userViewInput", userViewInput_});
+  }
+  if (!args_->skipUserContext) {
+    matrices.push_back({"userWordOutput", userWordOutput_});
+  }
+  matrices.push_back({"itemInput", itemInput_});
+  matrices.push_back({"wordOutput", wordOutput_});
+  matrices.push_back({"itemOutput", itemOutput_});
+  if (!args_->skipViewData) {
+    matrices.push_back({"itemViewOutput", itemViewOutput_});
+  }
+  // quantized matrices are saved as their codes
+  std::vector<std::pair<std::string, std::string>> codes;
+  for (auto it = matrices.begin(); it != matrices.end();) {
+    auto q = qmatrices_.find(it->first);
+    if (q == qmatrices_.end() || q->second.second != it->second) {
+      ++it;
+      continue;
+    }
+    std::ostringstream out;
+    q->second.first->save(out);
+    codes.emplace_back(it->first + ".pq", out.str());
+    it = matrices.erase(it);
+  }
+  MappedModel::save(filename, *args_, matrices, codes);
+}
+
+void UniVec::loadMappedModel(const std::string& filename) {
+  MappedModel mapped(filename);
+  args_ = std::make_shared<Args>();
+  mapped.loadArgs(*args_);
+  qmatrices_.clear();
+  // quantized matrices are decoded once, the others used in place
+  auto optional = [&](const std::string& name) -> std::shared_ptr<Matrix> {
+    if (mapped.hasMatrix(name)) {
+      return mapped.matrix(name);
+    }
+    if (!mapped.hasMatrix(name + ".pq")) {
+      return nullptr;
+    }
+    std::istringstream in(mapped.blob(name + ".pq"));
+    auto q = std::make_shared<QMatrix>();
+    q->load(in);
+    std::shared_ptr<Matrix> decoded = q->decode();
+    qmatrices_[name] = {q, decoded};
+    return decoded;
+  };
+  auto required = [&](const std::string& name) {
+    auto matrix = optional(name);
+    if (!matrix) {
+      throw std::invalid_argument("Model has no matrix " + name);
+    }
+    return matrix;
+  };
+
+  userInput_ = required("userInput");
+  userViewInput_ = optional("userViewInput");
+  userWordOutput_ = optional("userWordOutput");
+  itemInput_ = required("itemInput");
+  wordOutput_ = required("wordOutput");
+  itemOutput_ = required("itemOutput");
+  itemViewOutput_ = optional("itemViewOutput");
+  quant_ = !qmatrices_.empty();
+  args_->skipViewData = !itemViewOutput_;
+  args_->skipUserContext = !userWordOutput_;
+
+  model_ = std::make_shared<Model>(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, 0);
+}
+
+void UniVec::quantize(const Args& qargs) {
+  TraceScope trace("quantize", "quantize");
+  if (qargs.dsub < 1) {
+    throw std::invalid_argument("dsub must be positive.");
+  }
+  for (const auto& named : trainedMatrices()) {
+    const bool output = named.first.find("Output") != std::string::npos;
+    if ((output && !qargs.qout) ||
+        named.second->rows() < ProductQuantizer().get_ksub()) {
+      continue;
+    }
+    auto q = std::make_shared<QMatrix>(
+        *named.second, qargs.dsub, qargs.qnorm, qargs.thread);
+    std::shared_ptr<Matrix> decoded = q->decode();
+    qmatrices_[named.first] = {q, decoded};
+    for (auto* member : {&userInput_, &userViewInput_, &userWordOutput_,
+                         &itemInput_, &wordOutput_, &itemOutput_,
+                         &itemViewOutput_}) {
+      if (*member == named.second) {
+        *member = decoded;
+      }
+    }
+  }
+  quant_ = !qmatrices_.empty();
+  model_ = std::make_shared<Model>(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, 0);
+}
+
 void UniVec::printInfo(real progress, real loss, std::ostream& log_stream) {
   std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
   double t =
       std::chrono::duration_cast<std::chrono::duration<double>>(end - start_)
           .count();
-  double lr = args_->lr * (1.0 - progress);
+  double lr = learningRate(progress);
   double wst = 0;
 
   int64_t eta = 2592000; // Default to one month in seconds (720 * 3600)
@@ -213,67 +1061,57 @@ void UniVec::printInfo(real progress, real loss, std::ostream& log_stream) {
   log_stream << std::flush;
 }
 
-void UniVec::regWordModel(Model& itemWordModel, int32_t inputItemIdx, const std::vector<int32_t>& wordVec, real lr) {
+template <int32_t D>
+void UniVec::regWordModel(Model& itemWordModel, int32_t inputItemIdx, const std::vector<int32_t>& wordVec, real lr) const {
   std::vector<int32_t> input {inputItemIdx};
   //const std::vector<int32_t>& wordVec = dataLoader_->item2Word[inputItemIdx];
-  for (int i = 0; i < wordVec.size(); i++) {
-    itemWordModel.update(input, wordVec, i, lr);
+  const int32_t nwords = wordVec.size();
+  for (int32_t i = 0; i < nwords; i++) {
+    itemWordModel.updateKernel<D>(input, wordVec, i, lr);
   }
 }
 
-void UniVec::trainOnObs(Model& itemWordModel, Model& itemUserModel, Model& userWordModel ,const std::vector<int32_t>& obsVec, real lr) {
+template <combine_method C, int32_t D>
+void UniVec::trainOnObs(Model& itemWordModel, Model& itemUserModel, Model& userWordModel ,const std::vector<int32_t>& obsVec, real lr, ThreadMetrics* metrics) {
   // train on the user-item
   const int32_t userPos = 1;
   const int32_t itemPos = 0;
 
-  if (args_->combine == combine_method::concat) {
-    itemUserModel.updateConcat(obsVec, userPos, itemPos, lr);
-
-    // contextual user embedding
-    if (!args_->skipUserContext) {
-      regWordModel(userWordModel, obsVec[userPos], dataLoader_->user2Word[obsVec[userPos]], lr);
-    }
-
-    // contextual item embeddings
-    if (!args_->skipContext) {
-      if (args_->regOutput) {
-        regWordModel(itemWordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
-      } else {
-        std::vector<int32_t> input;
-        for (int pos = 0; pos < obsVec.size(); pos++) {
-          if (pos == userPos || pos == itemPos) continue;
-          int32_t inputItemIdx = obsVec[pos];
-          regWordModel(itemWordModel, inputItemIdx, dataLoader_->item2Word[inputItemIdx], lr);
-        }
-      }
-    }
-  } else if (args_->combine == combine_method::mean) {
-
-    itemUserModel.updateMean(obsVec, userPos, itemPos, lr);
-    
-    // contextual user embedding
-    if (!args_->skipUserContext) {
-      regWordModel(userWordModel, obsVec[userPos], dataLoader_->user2Word[obsVec[userPos]], lr);
+  {
+    ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::update));
+    // C is a template argument, so only one of these branches survives.
+    if (C == combine_method::concat) {
+      itemUserModel.updateConcatKernel<D>(obsVec, userPos, itemPos, lr);
+    } else if (C == combine_method::mean) {
+      itemUserModel.updateMeanKernel<D>(obsVec, userPos, itemPos, lr);
+    } else {
+      itemUserModel.updateMeanSumKernel<D>(obsVec, userPos, itemPos, lr);
     }
+  }
 
-    if (args_->skipContext) return;
-    regWordModel(itemWordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
-  } else if (args_->combine == combine_method::meanSum) {
-    
-    itemUserModel.updateMeanSum(obsVec, userPos, itemPos, lr);
+  // contextual user embedding
+  if (!args_->skipUserContext) {
+    ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::userContext));
+    regWordModel<D>(userWordModel, obsVec[userPos], dataLoader_->user2Word[obsVec[userPos]], lr);
+  }
 
-    // contextual user embedding
-    if (!args_->skipUserContext) {
-      regWordModel(userWordModel, obsVec[userPos], dataLoader_->user2Word[obsVec[userPos]], lr);
+  // contextual item embeddings
+  if (args_->skipContext) return;
+  ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::itemContext));
+  if (C == combine_method::concat && !args_->regOutput) {
+    const int32_t nobs = obsVec.size();
+    for (int32_t pos = 0; pos < nobs; pos++) {
+      if (pos == userPos || pos == itemPos) continue;
+      int32_t inputItemIdx = obsVec[pos];
+      regWordModel<D>(itemWordModel, inputItemIdx, dataLoader_->item2Word[inputItemIdx], lr);
     }
-
-    if (args_->skipContext) return;
-    regWordModel(itemWordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
+  } else {
+    regWordModel<D>(itemWordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
   }
 };
 
-void UniVec::trainOnSubObs(Model& wordModel, Model& model, const std::vector<int32_t>& obsVec, real lr) {
-  const int32_t userPos = 1;
+template <int32_t D>
+void UniVec::trainOnSubObs(Model& wordModel, Model& model, const std::vector<int32_t>& obsVec, real lr, ThreadMetrics* metrics) {
   const int32_t itemPos = 0;
   const int32_t subPos = 2;
   assert(obsVec.size() == 3);
@@ -281,59 +1119,70 @@ void UniVec::trainOnSubObs(Model& wordModel, Model& model, const std::vector<int
   input.push_back(obsVec[itemPos]);
   std::vector<int32_t> subVec;
   subVec.push_back(obsVec[subPos]);
-  model.update(input, subVec, 0, lr);
-  if (!args_->skipContext) regWordModel(wordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
+  {
+    ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::update));
+    model.updateKernel<D>(input, subVec, 0, lr);
+  }
+  if (!args_->skipContext) {
+    ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::itemContext));
+    regWordModel<D>(wordModel, obsVec[itemPos], dataLoader_->item2Word[obsVec[itemPos]], lr);
+  }
 }
 
-void UniVec::trainOnSearchObs(Model& model, const std::vector<int32_t>& obsVec, real lr) {
+template <int32_t D>
+void UniVec::trainOnSearchObs(Model& model, const std::vector<int32_t>& obsVec, real lr, ThreadMetrics* metrics) {
   // item_id, search word1 search word2
   const int32_t itemPos = 0;
+  ScopedTimer timer(ThreadMetrics::phase(metrics, train_phase::update));
   assert(obsVec.size() > 1);
   std::vector<int32_t> input;
   input.push_back(obsVec[itemPos]);
-  for(int i = itemPos + 1; i < obsVec.size(); i++) {
-    model.update(input, obsVec, i, lr);
+  const int32_t nobs = obsVec.size();
+  for (int32_t i = itemPos + 1; i < nobs; i++) {
+    model.updateKernel<D>(input, obsVec, i, lr);
   }
 }
 
+template <combine_method C, int32_t D>
 void UniVec::trainThread(int32_t threadId) {
 
-  Model itemWordModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, threadId);
-  Model itemUserModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, false, threadId);
+  // All models of this thread share one set of scratch buffers and read the
+  // shared negative tables from their own offset.
+  std::shared_ptr<TrainContext> ctx = std::make_shared<TrainContext>(args_->dim, args_->userDim);
+  auto negOffset = [&](const std::shared_ptr<const NegativeTable>& table) {
+    return threadId * table->size() / args_->thread;
+  };
+
+  Model itemWordModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, threadId, ctx);
+  Model itemUserModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, false, threadId, ctx);
 
-  itemWordModel.setTargetCounts(dataLoader_->wordCount);
+  itemWordModel.setNegativeTable(wordNegatives_, negOffset(wordNegatives_));
 
   // An item2word model is the first matrix to the third matrix.
-  Model userWordModel(userInput_, userInput_, userWordOutput_, itemOutput_, args_, true, threadId);
+  Model userWordModel(userInput_, userInput_, userWordOutput_, itemOutput_, args_, true, threadId, ctx);
   if (!args_->skipUserContext) {
-    userWordModel.setTargetCounts(dataLoader_->userWordCount);
+    userWordModel.setNegativeTable(userWordNegatives_, negOffset(userWordNegatives_));
   }
 
   if (!args_->skipTrxData) {
-    if (threadId == 0) std::cout << "Generating TRX neg sample table" << std::endl;
-    itemUserModel.setTargetCounts(dataLoader_->itemCount);
+    itemUserModel.setNegativeTable(itemNegatives_, negOffset(itemNegatives_));
   }
-  
-  Model itemUserViewModel(itemInput_, userViewInput_, wordOutput_, itemViewOutput_, args_, false, threadId);
+
+  Model itemUserViewModel(itemInput_, userViewInput_, wordOutput_, itemViewOutput_, args_, false, threadId, ctx);
   if (!args_->skipViewData) {
-    if (threadId == 0)  std::cout << "Generating VIEW neg sample table" << std::endl;
-    itemUserViewModel.setTargetCounts(dataLoader_->itemViewCount);
+    itemUserViewModel.setNegativeTable(itemViewNegatives_, negOffset(itemViewNegatives_));
   }
-  
-  Model itemSubModel(itemInput_, userInput_, itemInput_, itemOutput_, args_, false, threadId);
+
+  Model itemSubModel(itemInput_, userInput_, itemInput_, itemOutput_, args_, false, threadId, ctx);
   if (!args_->skipSubData) {
-    if (threadId == 0)  std::cout << "Generating SUB neg sample table" << std::endl;
-    itemSubModel.setTargetCounts(dataLoader_->itemSubCount);
+    itemSubModel.setNegativeTable(itemSubNegatives_, negOffset(itemSubNegatives_));
   }
 
-  Model itemSearchModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, threadId);
+  Model itemSearchModel(itemInput_, userInput_, wordOutput_, itemOutput_, args_, true, threadId, ctx);
   if (!args_->skipSearchData) {
-    if (threadId == 0)  std::cout << "Generating SEARCH neg sample table" << std::endl;
-    itemSearchModel.setTargetCounts(dataLoader_->searchWordCount);
+    itemSearchModel.setNegativeTable(searchWordNegatives_, negOffset(searchWordNegatives_));
   }
 
-  size_t mSize = 1;
-
   int64_t localTokenCount = 0;
 
   int64_t obsIdx = threadId * ntokens / args_->thread;
@@ -343,12 +1192,32 @@ void UniVec::trainThread(int32_t threadId) {
 
   std::vector<int32_t> line, labels;
 
+  ThreadMetrics* metrics = metrics_ ? metrics_->thread(threadId) : nullptr;
+  auto publishMetrics = [&]() {
+    if (!metrics) return;
+    auto publish = [&](train_model name, const Model& model) {
+      metrics->publishModel(name, model.getNumExamples(), model.getNumNegatives(), model.getLoss());
+    };
+    publish(train_model::itemWord, itemWordModel);
+    publish(train_model::userWord, userWordModel);
+    publish(train_model::itemUser, itemUserModel);
+    publish(train_model::itemUserView, itemUserViewModel);
+    publish(train_model::itemSub, itemSubModel);
+    publish(train_model::itemSearch, itemSearchModel);
+  };
+
   std::cout << "Train start!!" << std::endl;
 
-  while (tokenCount_ < args_->epoch * expectToken) {
+  if (Trace::enabled()) {
+    Trace::setThreadName("train " + std::to_string(threadId));
+  }
+  TraceScope threadTrace("trainThread", "train");
+  int64_t batchStart = Trace::enabled() ? Trace::now() : -1;
+
+  while (tokenCount_ < args_->epoch * expectToken && !stop_) {
 
     real progress = real(tokenCount_) / (args_->epoch * expectToken);
-    real lr = args_->lr * (1.0 - progress);
+    real lr = learningRate(progress);
    
     localTokenCount++;
 
@@ -357,21 +1226,33 @@ void UniVec::trainThread(int32_t threadId) {
     // Anchor - User - Context model with contextual constraints
 
     if (!args_->skipTrxData) {
+      ScopedTimer timer(ThreadMetrics::stream(metrics, train_stream::trx));
       const std::vector<int32_t>& trxObsVec = dataLoader_->allUserHist[obsIdx];
-      std::vector<std::vector<int32_t> > trxWinSeq = dataLoader_->computeWindowedOrderedBasket(trxObsVec, 0, args_->ws, args_->shuffleTrxData, rng);
+      std::vector<std::vector<int32_t> > trxWinSeq;
+      {
+        ScopedTimer windowTimer(ThreadMetrics::phase(metrics, train_phase::window));
+        trxWinSeq = dataLoader_->computeWindowedOrderedBasket(trxObsVec, 0, args_->ws, args_->shuffleTrxData, rng);
+      }
       for (const auto& trx: trxWinSeq) {
-        trainOnObs(itemWordModel, itemUserModel, userWordModel, trx, lr);
+        trainOnObs<C, D>(itemWordModel, itemUserModel, userWordModel, trx, lr, metrics);
       }
+      if (metrics) ThreadMetrics::bump(metrics->examples[int(train_stream::trx)], trxWinSeq.size());
     }
     
     obsViewIdx++;
     obsViewIdx = obsViewIdx % nViewTokens;
     if (!args_->skipViewData) {
+      ScopedTimer timer(ThreadMetrics::stream(metrics, train_stream::view));
       const std::vector<int32_t>& viewObsVec = dataLoader_->allUserHistView[obsViewIdx];
-      std::vector<std::vector<int32_t> > viewWinSeq = dataLoader_->computeWindowedOrderedBasket(viewObsVec, 0, args_->ws, args_->shuffleViewData, rng);
+      std::vector<std::vector<int32_t> > viewWinSeq;
+      {
+        ScopedTimer windowTimer(ThreadMetrics::phase(metrics, train_phase::window));
+        viewWinSeq = dataLoader_->computeWindowedOrderedBasket(viewObsVec, 0, args_->ws, args_->shuffleViewData, rng);
+      }
       for (const auto& view: viewWinSeq) {
-        trainOnObs(itemWordModel, itemUserViewModel, userWordModel, view, lr);
+        trainOnObs<C, D>(itemWordModel, itemUserViewModel, userWordModel, view, lr, metrics);
       }
+      if (metrics) ThreadMetrics::bump(metrics->examples[int(train_stream::view)], viewWinSeq.size());
     }
 
     // Anchor - Anchor model as a speicial item word model;
@@ -379,27 +1260,42 @@ void UniVec::trainThread(int32_t threadId) {
     obsSubIdx = obsSubIdx % nSubTokens;
 
     if (!args_->skipSubData) {
+      ScopedTimer timer(ThreadMetrics::stream(metrics, train_stream::sub));
       const std::vector<int32_t>& subObsVec = dataLoader_->allUserHistSub[obsSubIdx]; 
-      trainOnSubObs(itemWordModel, itemSubModel, subObsVec, lr);
+      trainOnSubObs<D>(itemWordModel, itemSubModel, subObsVec, lr, metrics);
+      if (metrics) ThreadMetrics::bump(metrics->examples[int(train_stream::sub)], 1);
     }
 
     obsSearchIdx++;
     obsSearchIdx = obsSearchIdx % nSearchTokens;
     if (!args_->skipSearchData) {
+      ScopedTimer timer(ThreadMetrics::stream(metrics, train_stream::search));
       const std::vector<int32_t>& searchObsVec = dataLoader_->allUserHistSearch[obsSearchIdx]; 
-      trainOnSearchObs(itemSearchModel, searchObsVec, lr);
+      trainOnSearchObs<D>(itemSearchModel, searchObsVec, lr, metrics);
+      if (metrics) ThreadMetrics::bump(metrics->examples[int(train_stream::search)], searchObsVec.size() - 1);
     }
 
     if (localTokenCount > args_->lrUpdateRate) {
       tokenCount_ += localTokenCount;
       localTokenCount = 0;
-      if (threadId == 0 && args_->verbose > 1)
+      publishMetrics();
+      if (batchStart >= 0) {
+        Trace::complete("train batch", "train", batchStart);
+        batchStart = Trace::now();
+      }
+      // the loss is also what -targetLoss is checked against
+      if (threadId == 0 && (args_->verbose > 1 || args_->targetLoss > 0))
         // loss_ = itemUserModel.getLoss();
         loss_ = itemWordModel.getLoss() + itemUserModel.getLoss() + itemUserViewModel.getLoss() + itemSubModel.getLoss() + itemSearchModel.getLoss() + userWordModel.getLoss();
     }
 
     // std::cout<<"after update"<< std::endl;
   }
+  tokenCount_ += localTokenCount;
+  publishMetrics();
+  exampleCount_ += itemWordModel.getNumExamples() + itemUserModel.getNumExamples() +
+      itemUserViewModel.getNumExamples() + itemSubModel.getNumExamples() +
+      itemSearchModel.getNumExamples() + userWordModel.getNumExamples();
   if (threadId == 0)
     // loss_ = itemUserModel.getLoss();
     loss_ = itemWordModel.getLoss() + itemUserModel.getLoss() + itemUserViewModel.getLoss() + itemSubModel.getLoss() + itemSearchModel.getLoss() + userWordModel.getLoss();
@@ -467,6 +1363,27 @@ void UniVec::initMatrix() {
   wordOutput_->uniform(1.0);
   itemOutput_->uniform(1.0);
   itemViewOutput_->uniform(1.0);
+
+  if (args_->optimizer == optimizer_name::adagrad) {
+    for (auto mat : {userInput_, userViewInput_, userWordOutput_, itemInput_,
+                     wordOutput_, itemOutput_, itemViewOutput_}) {
+      mat->initAdagrad(ADAGRAD_INIT_ACCUMULATOR);
+    }
+  }
+  if (args_->deltaInterval > 0) {
+    for (auto mat : {userInput_, userViewInput_, userWordOutput_, itemInput_,
+                     wordOutput_, itemOutput_, itemViewOutput_}) {
+      mat->trackDirty();
+    }
+  }
+}
+
+real UniVec::learningRate(real progress) const {
+  // Adagrad decays the step of each row by itself, SGD decays linearly.
+  if (args_->optimizer == optimizer_name::adagrad) {
+    return args_->lr;
+  }
+  return args_->lr * (1.0 - progress);
 }
 
 void UniVec::train(const Args& args) {
@@ -486,33 +1403,193 @@ void UniVec::train(const Args& args) {
 
 }
 
+template <combine_method C>
+UniVec::TrainThreadFn UniVec::selectTrainThread(int32_t dim) const {
+  switch (dim) {
+#define UNI_VEC_SELECT_TRAIN_THREAD(D) \
+    case D:                            \
+      return &UniVec::trainThread<C, D>;
+    UNI_VEC_FOR_EACH_KERNEL_DIM(UNI_VEC_SELECT_TRAIN_THREAD)
+#undef UNI_VEC_SELECT_TRAIN_THREAD
+  }
+  return &UniVec::trainThread<C, 0>;
+}
+
+UniVec::TrainThreadFn UniVec::selectTrainThread() const {
+  // The dimension kernels assume user and item rows have the same size.
+  const int32_t dim = (args_->userDim == args_->dim) ? args_->dim : 0;
+  switch (args_->combine) {
+    case combine_method::concat:
+      return selectTrainThread<combine_method::concat>(dim);
+    case combine_method::mean:
+      return selectTrainThread<combine_method::mean>(dim);
+    case combine_method::meanSum:
+      return selectTrainThread<combine_method::meanSum>(dim);
+  }
+  throw std::invalid_argument("Unknown combine method.");
+}
+
+void UniVec::initNegativeTables() {
+  // The tables are independent, build them concurrently.
+  std::vector<std::thread> builders;
+  auto build = [&](const char* name,
+                   const std::vector<int64_t>& counts,
+                   std::shared_ptr<const NegativeTable>& table) {
+    std::cout << "Generating " << name << " neg sample table" << std::endl;
+    builders.push_back(std::thread([name, &counts, &table, this]() {
+      if (Trace::enabled()) {
+        Trace::setThreadName(std::string("negatives ") + name);
+      }
+      table = std::make_shared<NegativeTable>(counts, args_->thread);
+    }));
+  };
+
+  build("WORD", dataLoader_->wordCount, wordNegatives_);
+  if (!args_->skipUserContext) {
+    build("USER WORD", dataLoader_->userWordCount, userWordNegatives_);
+  }
+  if (!args_->skipTrxData) {
+    build("TRX", dataLoader_->itemCount, itemNegatives_);
+  }
+  if (!args_->skipViewData) {
+    build("VIEW", dataLoader_->itemViewCount, itemViewNegatives_);
+  }
+  if (!args_->skipSubData) {
+    build("SUB", dataLoader_->itemSubCount, itemSubNegatives_);
+  }
+  if (!args_->skipSearchData) {
+    build("SEARCH", dataLoader_->searchWordCount, searchWordNegatives_);
+  }
+  for (auto& builder : builders) {
+    builder.join();
+  }
+}
+
 void UniVec::startThreads() {
+  {
+    TraceScope trace("initNegativeTables", "negatives");
+    initNegativeTables();
+  }
+  std::ofstream metricsStream;
+  if (!args_->metricsOutput.empty()) {
+    metricsStream.open(args_->metricsOutput, std::ofstream::app);
+    if (!metricsStream.is_open()) {
+      throw std::invalid_argument(
+          args_->metricsOutput + " cannot be opened for writing metrics!");
+    }
+    metrics_.reset(new TrainMetrics(args_->thread));
+  }
+  deltaCount_ = 0;
+  if (args_->deltaInterval > 0) {
+    // the snapshot every delta of this run is relative to
+    exportVectors(
+        args_->output + ".base",
+        {export_format::npy},
+        1,
+        args_->thread);
+  }
   start_ = std::chrono::steady_clock::now();
+  auto lastMetrics = start_;
+  auto lastDelta = start_;
   tokenCount_ = 0;
+  exampleCount_ = 0;
+  stop_ = false;
   loss_ = -1;
+  const TrainThreadFn trainFn = selectTrainThread();
   std::vector<std::thread> threads;
   for (int32_t i = 0; i < args_->thread; i++) {
-    threads.push_back(std::thread([=]() { trainThread(i); }));
+    threads.push_back(std::thread([=]() { (this->*trainFn)(i); }));
   }
 
   //  const int64_t ntokens = dataLoader_->allUserHist.size();
   // Same condition as trainThread
+  bool targetReached = false;
   while (tokenCount_ < args_->epoch * expectToken) {
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    real progress = real(tokenCount_) / (args_->epoch * expectToken);
     if (loss_ >= 0 && args_->verbose > 1) {
-      real progress = real(tokenCount_) / (args_->epoch * expectToken);
       std::cerr << "\r";
       printInfo(progress, loss_, std::cerr);
     }
+    if (args_->targetLoss > 0 && !targetReached && loss_ >= 0 &&
+        loss_ <= args_->targetLoss) {
+      targetReached = true;
+      printTargetLoss(progress, std::cerr);
+    }
+    if (metrics_ && std::chrono::steady_clock::now() - lastMetrics >=
+        std::chrono::seconds(args_->metricsInterval)) {
+      lastMetrics = std::chrono::steady_clock::now();
+      writeMetrics(metricsStream, progress);
+    }
+    if (args_->deltaInterval > 0 && std::chrono::steady_clock::now() - lastDelta >=
+        std::chrono::duration<double>(args_->deltaInterval)) {
+      lastDelta = std::chrono::steady_clock::now();
+      exportDelta(args_->output + ".delta" + std::to_string(deltaCount_ + 1));
+    }
+    if (args_->timeLimit > 0 && std::chrono::steady_clock::now() - start_ >=
+        std::chrono::duration<double>(args_->timeLimit)) {
+      stop_ = true;
+      break;
+    }
   }
-  for (int32_t i = 0; i < args_->thread; i++) {
-    threads[i].join();
+  {
+    TraceScope trace("join", "train");
+    for (int32_t i = 0; i < args_->thread; i++) {
+      threads[i].join();
+    }
+  }
+  trainSeconds_ = std::chrono::duration_cast<std::chrono::duration<double>>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count();
+  if (metrics_) {
+    writeMetrics(metricsStream, 1.0);
+  }
+  if (args_->deltaInterval > 0) {
+    // the remaining updates, base plus all deltas now equals the final vectors
+    exportDelta(args_->output + ".delta" + std::to_string(deltaCount_ + 1));
   }
   if (args_->verbose > 0) {
     std::cerr << "\r";
     printInfo(1.0, loss_, std::cerr);
     std::cerr << std::endl;
   }
+  if (args_->targetLoss > 0 && !targetReached) {
+    std::cerr << "Target loss " << args_->targetLoss << " ("
+              << args_->optimizerToString(args_->optimizer)
+              << ") not reached, final loss " << loss_ << std::endl;
+  }
+}
+
+void UniVec::writeMetrics(std::ostream& out, real progress) const {
+  double t = std::chrono::duration_cast<std::chrono::duration<double>>(
+                 std::chrono::steady_clock::now() - start_)
+                 .count();
+  metrics_->writeJson(out, t, progress, tokenCount_);
+}
+
+void UniVec::printTargetLoss(real progress, std::ostream& log_stream) {
+  double t = std::chrono::duration_cast<std::chrono::duration<double>>(
+                 std::chrono::steady_clock::now() - start_)
+                 .count();
+  // formatted apart so that the precision of log_stream is left alone
+  std::ostringstream out;
+  out << "Target loss " << args_->targetLoss << " ("
+      << args_->optimizerToString(args_->optimizer) << ") reached after "
+      << std::fixed << std::setprecision(2) << t << "s, "
+      << progress * args_->epoch << " epochs";
+  log_stream << std::endl << out.str() << std::endl;
+}
+
+int64_t UniVec::getTokenCount() const {
+  return tokenCount_;
+}
+
+int64_t UniVec::getExampleCount() const {
+  return exampleCount_;
+}
+
+double UniVec::getTrainSeconds() const {
+  return trainSeconds_;
 }
 
 int UniVec::getDimension() const {
@@ -28,6 +28,14 @@
 #include "utils.h"
 #include "vector.h"
 #include "dataLoader.h"
+#include "exporter.h"
+#include "hashindex.h"
+#include "hnsw.h"
+#include "ivfpq.h"
+#include "metrics.h"
+#include "neighbors.h"
+#include "ranker.h"
+#include "sqmatrix.h"
 
 namespace uni_vec {
 
@@ -55,13 +63,44 @@ class UniVec {
 
   std::shared_ptr<DataLoader> dataLoader_;
 
-  std::shared_ptr<QMatrix> qinput_;
-  std::shared_ptr<QMatrix> qoutput_;
+  // product quantized matrices by name with their reconstruction, see
+  // quantize; saved as codes only while the dense matrix of the same name
+  // is still that reconstruction, not once fold-in or infer replaced it
+  std::unordered_map<
+      std::string,
+      std::pair<std::shared_ptr<const QMatrix>, std::shared_ptr<const Matrix>>>
+      qmatrices_;
 
   std::shared_ptr<Model> model_;
+  // approximate complement search, at most one of them, see buildIndex
+  std::shared_ptr<HnswIndex> index_;
+  std::shared_ptr<IvfPqIndex> ivfIndex_;
+  std::shared_ptr<HashIndex> hashIndex_;
+  // int8 copies of the bases of recommend, see buildInt8
+  std::shared_ptr<const SQMatrix> int8Items_;
+  std::shared_ptr<const SQMatrix> int8Users_;
+  int32_t int8Rerank_ = 0;
   std::shared_ptr<Model> exModel_;
 
+  // negative sampling tables, built once and shared by all training threads
+  std::shared_ptr<const NegativeTable> wordNegatives_;
+  std::shared_ptr<const NegativeTable> userWordNegatives_;
+  std::shared_ptr<const NegativeTable> itemNegatives_;
+  std::shared_ptr<const NegativeTable> itemViewNegatives_;
+  std::shared_ptr<const NegativeTable> itemSubNegatives_;
+  std::shared_ptr<const NegativeTable> searchWordNegatives_;
+
   std::atomic<int64_t> tokenCount_{};
+  // model updates of all threads, added when each thread finishes
+  std::atomic<int64_t> exampleCount_{};
+  // set by the monitor loop once -timeLimit elapsed
+  std::atomic<bool> stop_{};
+  double trainSeconds_;
+  // deltas written by exportDelta since the base snapshot
+  int32_t deltaCount_;
+
+  // per-thread counters, only allocated when -metricsOutput is given
+  std::unique_ptr<TrainMetrics> metrics_;
 
   std::atomic<real> loss_{};
   std::atomic<real> lossView_{};
@@ -73,14 +112,57 @@ class UniVec {
   std::chrono::steady_clock::time_point start_;
   void signModel(std::ostream&);
   bool checkModel(std::istream&);
+  void initNegativeTables();
   void startThreads();
   void addInputVector(Vector&, int32_t) const;
-  void regWordModel(Model&, int32_t, const std::vector<int32_t>&, real) ;
-
-  void trainOnObs(Model&, Model&, Model&, const std::vector<int32_t>&, real);
-  void trainOnSubObs(Model&, Model&, const std::vector<int32_t>&, real);
-  void trainOnSearchObs(Model&, const std::vector<int32_t>&, real);
-
+  // itemInput rows of the items, one after the other
+  std::vector<real> itemQueries(const std::vector<int64_t>&) const;
+  // Matrices worth saving, by name: those of skipped streams keep their
+  // initial values and loaded models may not have them at all.
+  std::vector<std::pair<std::string, std::shared_ptr<Matrix>>> trainedMatrices() const;
+
+  // The training loop is specialised on the combine method C and the
+  // embedding dimension D (0 for any dimension without its own kernel);
+  // startThreads picks the instantiation once per run.
+  typedef void (UniVec::*TrainThreadFn)(int32_t);
+  TrainThreadFn selectTrainThread() const;
+  template <combine_method C>
+  TrainThreadFn selectTrainThread(int32_t) const;
+
+  template <int32_t D>
+  void regWordModel(Model&, int32_t, const std::vector<int32_t>&, real) const;
+
+  // New input rows fitted against a frozen output matrix of words, see
+  // inferColdItems.
+  std::shared_ptr<Matrix> fitColdRows(
+      std::shared_ptr<Matrix>,
+      const std::vector<std::vector<int32_t>>&,
+      const std::vector<int64_t>&,
+      int32_t,
+      real,
+      int32_t,
+      int32_t) const;
+  typedef void (UniVec::*FoldInFn)(
+      Model&, const std::vector<std::vector<int32_t>>&, int32_t, real) const;
+  template <combine_method C, int32_t D>
+  void foldInUser(Model&, const std::vector<std::vector<int32_t>>&, int32_t, real)
+      const;
+  template <combine_method C>
+  FoldInFn selectFoldIn(int32_t) const;
+  typedef void (UniVec::*ColdFitFn)(
+      Model&, int32_t, const std::vector<int32_t>&, int32_t, real) const;
+  template <int32_t D>
+  void fitColdRow(Model&, int32_t, const std::vector<int32_t>&, int32_t, real)
+      const;
+
+  template <combine_method C, int32_t D>
+  void trainOnObs(Model&, Model&, Model&, const std::vector<int32_t>&, real, ThreadMetrics*);
+  template <int32_t D>
+  void trainOnSubObs(Model&, Model&, const std::vector<int32_t>&, real, ThreadMetrics*);
+  template <int32_t D>
+  void trainOnSearchObs(Model&, const std::vector<int32_t>&, real, ThreadMetrics*);
+
+  template <combine_method C, int32_t D>
   void trainThread(int32_t);
   std::vector<std::pair<real, std::string>> getNN(
       const Matrix& wordVectors,
@@ -89,6 +171,9 @@ class UniVec {
       const std::set<std::string>& banSet);
   void lazyComputeWordVectors();
   void printInfo(real, real, std::ostream&);
+  void printTargetLoss(real, std::ostream&);
+  void writeMetrics(std::ostream&, real) const;
+  real learningRate(real) const;
 
   bool quant_;
   int32_t version;
@@ -126,6 +211,22 @@ class UniVec {
 
   void saveVectors(const std::string& filename, std::shared_ptr<const Matrix> mat) const;
 
+  // Writes <prefix>_<matrix>.vec[.npy|.fp16.npy|.int8.npy] for every trained
+  // matrix in every requested format, with files written concurrently and
+  // optionally split into row shards, and lists them in
+  // <prefix>.manifest.json.
+  void exportVectors(
+      const std::string& prefix,
+      const std::vector<export_format>& formats,
+      int32_t shards,
+      int32_t thread) const;
+
+  // Writes <prefix>_<matrix>.vec.delta with the rows of every trained
+  // matrix updated since the previous delta, or since training started.
+  // Applied in order to the snapshot taken when training started they give
+  // the current matrices. Requires -deltaInterval.
+  void exportDelta(const std::string& prefix);
+
   void saveModel();
 
   void saveModel(const std::string& filename);
@@ -134,12 +235,33 @@ class UniVec {
 
   void loadModel(const std::string& filename);
 
+  // Page-aligned, checksummed model that loadModel maps instead of reading.
+  void saveMappedModel(const std::string& filename) const;
+
+  void loadMappedModel(const std::string& filename);
+
   void getSentenceVector(std::istream& in, Vector& vec);
 
+  // Product quantizes userInput, itemInput and userViewInput, and the
+  // output matrices too with qargs.qout, with sub-quantizers of qargs.dsub
+  // columns trained on qargs.thread threads. Matrices of fewer rows than
+  // centroids stay dense. The dense matrices are replaced by their
+  // reconstruction, and saveMappedModel stores the codes instead.
   void quantize(const Args& qargs);
 
-  std::tuple<int64_t, double, double>
-  test(std::istream& in, int32_t k, real threshold = 0.0);
+  // Next-item evaluation on baskets [user, items...] in purchase order.
+  // Every item after the first, or only the last one with lastOnly, is
+  // ranked given the user and the ws items before it, as in training; users
+  // the model does not have rank with their context alone. candidates 0
+  // ranks the whole catalog without the context items, otherwise the item
+  // competes with that many items drawn uniformly, the same ones whatever
+  // thread. Queries are scored in chunks spread over thread threads.
+  RankingMetrics test(
+      const std::vector<std::vector<int32_t>>& baskets,
+      bool lastOnly,
+      int32_t k,
+      int32_t candidates,
+      int32_t thread) const;
 
   bool predictLine(
       std::istream& in,
@@ -150,10 +272,152 @@ class UniVec {
   std::vector<std::pair<std::string, Vector>> getNgramVectors(
       const std::string& word) const;
 
+  // Item ids are the words of this model: the k best complements of the
+  // item, see below, without the item itself.
   std::vector<std::pair<real, std::string>> getNN(
       const std::string& word,
       int32_t k);
 
+  // Complements of each anchor item: its itemInput row scored against the
+  // item part of every itemOutput row, the asymmetric score the model is
+  // trained on, best first. bans is empty or one sorted list of item ids
+  // per anchor that must not be returned.
+  std::vector<std::vector<ScoredId>> getNN(
+      const std::vector<int64_t>& items,
+      int32_t k,
+      bool cosine,
+      const std::vector<std::vector<int64_t>>& bans,
+      int32_t thread) const;
+
+  // Exact top k items for every query through blocked matrix products,
+  // meant for whole catalogs. Queries are items, scored as by getNN without
+  // cosine, or with users userInput rows scored by the user term of the
+  // combine method: against the user part of itemOutput for concat, all of
+  // it for mean, and against itemInput for meanSum. bans as for getNN.
+  std::vector<std::vector<ScoredId>> recommend(
+      const std::vector<int64_t>& queries,
+      bool users,
+      int32_t k,
+      const std::vector<std::vector<int64_t>>& bans,
+      int32_t thread) const;
+
+  // itemInput rows for items unseen in training, one per list of context
+  // words: the item-word negative sampling objective of training, run for
+  // epoch passes over the words with the learning rate decaying from lr to
+  // 0, wordOutput frozen. Negatives are drawn from one table, weighted by
+  // wordCounts (empty or shorter than wordOutput counts missing words once),
+  // and items are spread over thread threads.
+  std::shared_ptr<Matrix> inferColdItems(
+      const std::vector<std::vector<int32_t>>& words,
+      const std::vector<int64_t>& wordCounts,
+      int32_t epoch,
+      real lr,
+      int32_t neg,
+      int32_t thread) const;
+
+  // userInput rows for users unseen in training from their context words,
+  // as inferColdItems against the frozen userWordOutput.
+  std::shared_ptr<Matrix> inferColdUsers(
+      const std::vector<std::vector<int32_t>>& words,
+      const std::vector<int64_t>& wordCounts,
+      int32_t epoch,
+      real lr,
+      int32_t neg,
+      int32_t thread) const;
+
+  // Closed form of inferColdUsers: the logistic loss of every word and of
+  // its neg negatives replaced by the squared error to the logits +logit
+  // and -logit, negatives counted by their expectation under the sampling
+  // distribution. Each user solves a userDim x userDim ridge system
+  //
+  //   (sum_w o_w o_w' + neg |w| E[o o'] + lambda I) u
+  //       = logit (sum_w o_w - neg |w| E[o])
+  //
+  // with the two expectations computed once over userWordOutput.
+  std::shared_ptr<Matrix> solveColdUsers(
+      const std::vector<std::vector<int32_t>>& words,
+      const std::vector<int64_t>& wordCounts,
+      int32_t neg,
+      real logit,
+      real lambda,
+      int32_t thread) const;
+
+  // Fold-in: fresh userInput rows, in the order of users, fitted to the
+  // recent baskets of each user (lists of items in purchase order) by the
+  // user-item objective of training for the combine method, every item
+  // vector frozen. Each row starts from the current row of the user, or
+  // from zero for a user the model does not have, and takes epoch passes
+  // over the windows of the baskets with the learning rate decaying from lr
+  // to 0. Negatives are drawn from negatives; users are spread over thread
+  // threads. The model itself is not changed, see setUserRows.
+  std::shared_ptr<Matrix> foldInUsers(
+      const std::vector<int64_t>& users,
+      const std::vector<std::vector<std::vector<int32_t>>>& baskets,
+      std::shared_ptr<const NegativeTable> negatives,
+      int32_t epoch,
+      real lr,
+      int32_t thread) const;
+
+  // Replaces the userInput rows of users by the rows of vectors, growing
+  // the matrix for new users. userInput is copied first, so it may be
+  // mapped, and matrices handed out before keep the old rows.
+  void setUserRows(const std::vector<int64_t>& users, const Matrix& vectors);
+
+  // recommend for users given by their userInput rows, one per row of
+  // vectors, rather than by id.
+  std::vector<std::vector<ScoredId>> recommend(
+      const Matrix& vectors,
+      int32_t k,
+      const std::vector<std::vector<int64_t>>& bans,
+      int32_t thread) const;
+
+  // Scores of the candidates of every request with the formula of the
+  // combine method, see Ranker.
+  std::vector<std::vector<real>> rank(
+      const std::vector<RankRequest>& requests,
+      int32_t thread) const;
+
+  // Best k items to complete the basket of every request, see
+  // Ranker::complete.
+  std::vector<std::vector<ScoredId>> complete(
+      const std::vector<RankRequest>& requests,
+      int32_t k,
+      int32_t thread) const;
+
+  // The legacy model format does not record the combine method: loadModel tells
+  // concat from the shapes of the matrices and assumes meanSum otherwise.
+  void setCombineMethod(combine_method combine);
+
+  // HNSW, IVF-PQ or binary hash index over the item part of itemOutput for
+  // getApproxNN.
+  void buildIndex(int32_t M, int32_t efConstruction, int32_t seed, int32_t thread);
+  void buildIvfPqIndex(int32_t nlist, int32_t dsub, int32_t seed, int32_t thread);
+  void buildHashIndex(int32_t bits, int32_t seed, int32_t thread);
+  void saveIndex(const std::string& filename) const;
+  // Any kind, told apart by the file.
+  void loadIndex(const std::string& filename);
+
+  // Int8 copies of the item part of itemOutput and of the base of user
+  // recommendations, see SQMatrix. recommend then scans them, and so does
+  // getApproxNN when no index is loaded; the best max(k, rerank) are scored
+  // again in fp32 when rerank > 0.
+  void buildInt8(int32_t rerank, int32_t thread);
+
+  // an index or the int8 copies
+  bool hasIndex() const;
+
+  // getNN without cosine through the index, or the int8 copy of the items.
+  // efSearch for HNSW, nprobe for IVF-PQ and shortlist, the rows of a hash
+  // scan scored exactly, trade speed for recall.
+  std::vector<std::vector<ScoredId>> getApproxNN(
+      const std::vector<int64_t>& items,
+      int32_t k,
+      int32_t efSearch,
+      int32_t nprobe,
+      int32_t shortlist,
+      const std::vector<std::vector<int64_t>>& bans,
+      int32_t thread) const;
+
   std::vector<std::pair<real, std::string>> getAnalogies(
       int32_t k,
       const std::string& wordA,
@@ -168,6 +432,12 @@ class UniVec {
 
   void train(const Args& args);
 
+  // Throughput of the last train(): baskets, model updates and the wall time
+  // of the training threads, excluding the negative table setup.
+  int64_t getTokenCount() const;
+  int64_t getExampleCount() const;
+  double getTrainSeconds() const;
+
   void loadVectors(const std::string& filename);
 
   int getDimension() const;
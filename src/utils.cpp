@@ -8,6 +8,9 @@
 
 #include "utils.h"
 
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <ios>
 
 namespace uni_vec {
@@ -23,6 +26,72 @@ void seek(std::ifstream& ifs, int64_t pos) {
   ifs.clear();
   ifs.seekg(std::streampos(pos));
 }
+
+void appendReal(std::string& out, real v) {
+  static const double kPow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+  const double x = v;
+  const double ax = std::fabs(x);
+  // -ffast-math lets the compiler assume there is no nan or inf, so they
+  // and -0 are told from the bits, not by comparisons
+  uint32_t bits;
+  static_assert(sizeof(bits) == sizeof(real), "real is a float");
+  std::memcpy(&bits, &v, sizeof(bits));
+  const bool finite = ((bits >> 23) & 0xff) != 0xff;
+  if (bits == 0) {
+    out.push_back('0');
+    return;
+  }
+  // %g switches to the exponent form outside [1e-4, 1e6); leave that, inf,
+  // nan and -0 to snprintf, embeddings are rarely there.
+  if (!finite || bits == 0x80000000u || !(ax >= 1e-4 && ax < 1e5)) {
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%g", x);
+    out.append(buf, n);
+    return;
+  }
+  if (x < 0) {
+    out.push_back('-');
+  }
+  // decimal exponent of the leading digit, in [-4, 4]
+  int32_t e = 4;
+  while (ax < kPow10[e + 4] * 1e-4) {
+    e--;
+  }
+  // six significant digits
+  int32_t decimals = 5 - e;
+  uint64_t scaled = uint64_t(std::nearbyint(ax * kPow10[decimals]));
+  if (scaled >= 1000000) {
+    // rounding carried into a new leading digit, e.g. 9.9999996
+    decimals--;
+    scaled = uint64_t(std::nearbyint(ax * kPow10[decimals]));
+  }
+  const uint64_t unit = uint64_t(kPow10[decimals]);
+  uint64_t whole = scaled / unit;
+  uint64_t frac = scaled % unit;
+
+  char buf[24];
+  int32_t n = 0;
+  do {
+    buf[n++] = '0' + whole % 10;
+    whole /= 10;
+  } while (whole > 0);
+  while (n > 0) {
+    out.push_back(buf[--n]);
+  }
+  if (frac == 0) {
+    return;
+  }
+  while (frac % 10 == 0) {
+    frac /= 10;
+    decimals--;
+  }
+  out.push_back('.');
+  for (int32_t i = decimals - 1; i >= 0; i--) {
+    buf[i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  out.append(buf, decimals);
+}
 } // namespace utils
 
 } // namespace uni_vec
@@ -10,8 +10,11 @@
 
 #include <algorithm>
 #include <fstream>
+#include <string>
 #include <vector>
 
+#include "real.h"
+
 // #if defined(__clang__) || defined(__GNUC__)
 // #define FASTTEXT_DEPRECATED(msg) __attribute__((__deprecated__(msg)))
 // #elif defined(_MSC_VER)
@@ -28,6 +31,10 @@ int64_t size(std::ifstream&);
 
 void seek(std::ifstream&, int64_t);
 
+// Appends v as std::ostream << v would with the default precision (%g),
+// without going through a stream or the locale.
+void appendReal(std::string&, real);
+
 template <typename T>
 bool contains(const std::vector<T>& container, const T& value) {
   return std::find(container.begin(), container.end(), value) !=
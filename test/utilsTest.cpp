@@ -0,0 +1,74 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+
+#include "utils.h"
+
+using namespace uni_vec;
+
+namespace {
+
+int32_t failures = 0;
+
+void expect(real v, const std::string& want) {
+  std::string got;
+  utils::appendReal(got, v);
+  if (got != want) {
+    std::cerr << "appendReal: expected " << want << ", got " << got << std::endl;
+    failures++;
+  }
+}
+
+real fromBits(uint32_t bits) {
+  real v;
+  std::memcpy(&v, &bits, sizeof(v));
+  return v;
+}
+
+std::string printf(real v) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%g", double(v));
+  return buf;
+}
+
+} // namespace
+
+int main() {
+  // values -ffast-math must not fold away
+  expect(fromBits(0x00000000u), "0");
+  expect(fromBits(0x80000000u), "-0");
+  expect(std::numeric_limits<real>::infinity(), "inf");
+  expect(-std::numeric_limits<real>::infinity(), "-inf");
+  expect(fromBits(0x7fc00000u), "nan");
+  expect(fromBits(0xffc00000u), "-nan");
+  expect(fromBits(0x7f800001u), "nan");
+
+  expect(1.0, "1");
+  expect(-0.5, "-0.5");
+  expect(9.9999996, "10");
+  expect(123456.0, "123456");
+  expect(1e-5, "1e-05");
+
+  // any bit pattern prints as %g does
+  std::mt19937 rng(0);
+  for (int32_t i = 0; i < 1000000; i++) {
+    const real v = fromBits(rng());
+    expect(v, printf(v));
+  }
+  std::uniform_real_distribution<real> uniform(-10, 10);
+  for (int32_t i = 0; i < 1000000; i++) {
+    const real v = uniform(rng);
+    expect(v, printf(v));
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}